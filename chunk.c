@@ -1,6 +1,7 @@
 #include <stdlib.h>
 
 #include "chunk.h"
+#include "object.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -12,6 +13,8 @@ void init_chunk(Chunk *chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   init_val_array(&chunk->constants);
+  chunk->caches = NULL;
+  chunk->cache_count = 0;
 }
 
 void free_chunk(RotoVM* vm,Chunk *chunk) {
@@ -19,9 +22,23 @@ void free_chunk(RotoVM* vm,Chunk *chunk) {
   FREE_ARRAY(vm,uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(vm,int, chunk->lines, chunk->capacity);
   free_val_array(vm,&chunk->constants);
+  FREE_ARRAY(vm,InlineCache, chunk->caches, chunk->cache_count);
   init_chunk(chunk);
 
 }
+//count empty inline caches for the chunk's property and invoke sites
+void init_caches(RotoVM* vm, Chunk* chunk, int count){
+  chunk->caches = ALLOCATE(vm, InlineCache, count);
+  for (int i = 0; i < count; i++) {
+    for (int way = 0; way < CACHE_WAYS; way++) {
+      chunk->caches[i].ways[way].key = NULL;
+      chunk->caches[i].ways[way].field = -1;
+      chunk->caches[i].ways[way].method = NIL_VAL;
+      chunk->caches[i].ways[way].transition = NULL;
+    }
+  }
+  chunk->cache_count = count;
+}
 /* **THINGS TO REMEMBER** for bytcode space allocation:
 *1.Allocate a new array with more capacity.
 *2.Copy the existing elements from the old array to the new one.
@@ -50,3 +67,222 @@ int add_constant(RotoVM* vm,Chunk *chunk, Value value){
     pop(vm);
     return chunk->constants.count - 1;
 }
+
+//size in bytes of the instruction at offset, operands included
+int instruction_length(Chunk* chunk, int offset){
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_BUILD_LIST:
+        case OP_CLASS:
+        case OP_R_SETTOP:
+        case OP_R_RETURN:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_THIS_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_METHOD:
+        case OP_INC_LOCAL:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_EQUAL:
+        case OP_R_LOADNIL:
+        case OP_R_LOADTRUE:
+        case OP_R_LOADFALSE:
+        case OP_R_SET_UPVALUE:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            return 3;
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        case OP_R_MOVE:
+        case OP_R_LOADK:
+        case OP_R_NOT:
+        case OP_R_NEGATE:
+        case OP_R_GET_UPVALUE:
+            return 4;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_R_GET_GLOBAL:
+        case OP_R_ADD:
+        case OP_R_SUB:
+        case OP_R_MUL:
+        case OP_R_DIV:
+        case OP_R_LESS:
+        case OP_R_GREATER:
+        case OP_R_EQUAL:
+            return 5;
+        case OP_R_JUMP_IF_NOT_LESS:
+        case OP_R_JUMP_IF_NOT_GREATER:
+        case OP_R_JUMP_IF_NOT_EQUAL:
+        case OP_R_JUMP_IF_LESS:
+        case OP_R_JUMP_IF_GREATER:
+        case OP_R_JUMP_IF_EQUAL:
+            return 6;
+        case OP_CLOSURE:{
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalue_count * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+//how many values a stack instruction leaves on the stack minus how many it takes
+int stack_effect(Chunk* chunk, int offset){
+    uint8_t* code = chunk->code + offset;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_THIS_PROPERTY:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_BITWISE_AND:
+        case OP_BITWISE_OR:
+        case OP_BITWISE_XOR:
+        case OP_RIGHT_SHIFT:
+        case OP_LEFT_SHIFT:
+        case OP_INDEX_SUBSCR:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_ADD_NUM:
+        case OP_SUB_NUM:
+        case OP_MUL_NUM:
+        case OP_DIV_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_EQUAL_NUM:
+        case OP_ADD_INT:
+        case OP_SUB_INT:
+        case OP_MUL_INT:
+        case OP_LESS_INT:
+        case OP_GREATER_INT:
+        case OP_EQUAL_INT:
+            return -1;
+        case OP_STORE_SUBSCR:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_EQUAL:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return -code[3];
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+            return -code[3] - 1;
+        case OP_BUILD_LIST:
+            return 1 - code[1];
+        default:
+            return 0;
+    }
+}
+
+bool is_jump(uint8_t op){
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//offset a stack jump lands on
+int jump_target(Chunk* chunk, int offset){
+    uint16_t distance = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    if(chunk->code[offset] == OP_LOOP) return offset + 3 - distance;
+    return offset + 3 + distance;
+}
+
+static bool flow_to(Chunk* chunk, int* heights, int* worklist, int* work_count, int offset, int height){
+    if(offset < 0 || offset >= chunk->count || height < 0) return false;
+    if(heights[offset] == -1){
+        heights[offset] = height;
+        worklist[(*work_count)++] = offset;
+        return true;
+    }
+    return heights[offset] == height;
+}
+
+/*
+ * follows every path through stack code from its entry, where the stack
+ * holds entry_height values. fills heights (when given) with the height
+ * before each instruction, -1 where nothing reaches, and returns the most
+ * values the code ever has on the stack, or -1 if two paths disagree.
+ */
+int stack_heights(RotoVM* vm, Chunk* chunk, int entry_height, int* heights){
+    int* own = NULL;
+    if(heights == NULL){
+        own = ALLOCATE(vm, int, chunk->count);
+        heights = own;
+    }
+    int* worklist = ALLOCATE(vm, int, chunk->count);
+    for (int i = 0; i < chunk->count; i++) {
+        heights[i] = -1;
+    }
+    int work_count = 0;
+    int max = entry_height;
+    bool ok = flow_to(chunk, heights, worklist, &work_count, 0, entry_height);
+
+    while (work_count > 0 && ok) {
+        int offset = worklist[--work_count];
+        uint8_t op = chunk->code[offset];
+        int after = heights[offset] + stack_effect(chunk, offset);
+        if(after > max) max = after;
+        if(is_jump(op)){
+            ok = flow_to(chunk, heights, worklist, &work_count, jump_target(chunk, offset), after);
+            if(op == OP_JUMP || op == OP_LOOP) continue;
+        }
+        if(op == OP_RETURN) continue;
+        ok = ok && flow_to(chunk, heights, worklist, &work_count,
+                           offset + instruction_length(chunk, offset), after);
+    }
+    FREE_ARRAY(vm, int, worklist, chunk->count);
+    if(own != NULL) FREE_ARRAY(vm, int, own, chunk->count);
+    return ok ? max : -1;
+}
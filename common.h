@@ -7,9 +7,18 @@
 #include <stdio.h>
 
 //#define DEBUG_TRACE_EXECUTION
+//#define DEBUG_COUNT_INSTRUCTIONS
 
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+//branch hint for the interpreter's fast paths
+#ifdef __GNUC__
+#define LIKELY(x) __builtin_expect(!!(x), 1)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define LIKELY(x) (x)
+#define UNLIKELY(x) (x)
+#endif
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define UINT16_COUNT (UINT16_MAX + 1)
 #define NAN_BOXING
@@ -1,12 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "common.h"
 #include "chunk.h"
 #include "compiler.h"
 #include "scanner.h"
 #include "memory.h"
+#include "number.h"
+#include "registers.h"
 
 #ifndef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -39,13 +45,7 @@ expr :=  num | string|
   block := '{' declaration* '}' ;
 */
 
-typedef struct{
-  /* data */
-  Token current;
-  Token previous;
-  bool hadError;
-  bool panicMode;
-} Parser;
+typedef struct Parser Parser;
 
 typedef enum{
   PREC_NONE,
@@ -67,7 +67,7 @@ typedef enum{
 
 } Precedence;
 
-typedef void (*ParseFn)(RotoVM* vm, bool can_assign);
+typedef void (*ParseFn)(Parser* parser, bool can_assign);
 
 typedef struct{
   ParseFn prefix;
@@ -100,6 +100,9 @@ typedef struct Compiler{
     int local_count;
     Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
+    int instr_starts[4];//offsets of the last few instructions, newest first
+    int jump_target;//highest offset any forward jump lands on
+    int cache_count;//inline caches handed out to property and invoke sites
 }Compiler;
 
 typedef struct ClassCompiler{
@@ -108,18 +111,27 @@ typedef struct ClassCompiler{
     bool has_super_class;
 }ClassCompiler;
 
-Parser parser;
-ClassCompiler* current_class = NULL;
-Compiler* current = NULL;
+//everything one compile works on, so separate vms can compile on separate threads
+struct Parser{
+  RotoVM* vm;
+  ObjString* source;//heap copy of the script when bodies are skimmed, else NULL
+  Scanner scanner;
+  Token current;
+  Token previous;
+  bool hadError;
+  bool panicMode;
+  Compiler* compiler;
+  ClassCompiler* current_class;
+};
 
 
-static Chunk* current_chunk(){
-  return &current->function->chunk;
+static Chunk* current_chunk(Parser* parser){
+  return &parser->compiler->function->chunk;
 }
 
-static void error_at(Token *token, const char* message) {
-  if(parser.panicMode) return;
-  parser.panicMode = true;
+static void error_at(Parser* parser, Token *token, const char* message) {
+  if(parser->panicMode) return;
+  parser->panicMode = true;
   /* code */
   fprintf(stderr, "[line %d] ERROR",token->line);
   if (token->type == TOKEN_EOF) {
@@ -131,112 +143,224 @@ static void error_at(Token *token, const char* message) {
     fprintf(stderr, " at '%.*s'\n",token->length, token->start);
   }
   fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+  parser->hadError = true;
 }
 
-static void error(const char* msg){
-  error_at(&parser.previous, msg);
+static void error(Parser* parser, const char* msg){
+  error_at(parser, &parser->previous, msg);
 }
 
-static void error_at_current(const char* message){
-  error_at(&parser.current, message);
+static void error_at_current(Parser* parser, const char* message){
+  error_at(parser, &parser->current, message);
 }
 //consume the token and move to the next
-static void advance(){
-  parser.previous = parser.current;
+static void advance(Parser* parser){
+  parser->previous = parser->current;
 
   for(;;){
-    parser.current = scan_token();
-    if(parser.current.type != TOKEN_ERROR) break;
+    parser->current = scan_token(&parser->scanner);
+    if(parser->current.type != TOKEN_ERROR) break;
 
-    error_at_current(parser.current.start);
+    error_at_current(parser, parser->current.start);
   }
 }
 
-static void consume(TokenType type, const char *message){
-  if(parser.current.type == type){
-    advance();
+static void consume(Parser* parser, TokenType type, const char *message){
+  if(parser->current.type == type){
+    advance(parser);
     return;
   }
-  error_at_current(message);
+  error_at_current(parser, message);
 }
-static bool check(TokenType type){
-  return parser.current.type == type;
+static bool check(Parser* parser, TokenType type){
+  return parser->current.type == type;
 }
-static bool match(TokenType type){
-  if(!check(type)) return false;
-  advance();
+static bool match(Parser* parser, TokenType type){
+  if(!check(parser, type)) return false;
+  advance(parser);
   return true;
 }
-static void emit_byte(RotoVM* vm, uint8_t byte) {
+static void emit_byte(Parser* parser, uint8_t byte) {
   /* code */
-  write_chunk(vm,current_chunk(), byte, parser.previous.line);
+  write_chunk(parser->vm,current_chunk(parser), byte, parser->previous.line);
+}
+//emits the first byte of an instruction, remembering where it starts for the peephole
+static void emit_op(Parser* parser, uint8_t op){
+  for (int i = 3; i > 0; i--) {
+    parser->compiler->instr_starts[i] = parser->compiler->instr_starts[i - 1];
+  }
+  parser->compiler->instr_starts[0] = current_chunk(parser)->count;
+  emit_byte(parser,op);
+}
+//instruction with a one byte operand
+static void emit_bytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+  emit_op(parser,byte1);
+  emit_byte(parser,byte2);
+}
+static void emit_short(Parser* parser, uint16_t value){
+  emit_byte(parser,(value >> 8) & 0xff);
+  emit_byte(parser,value & 0xff);
+}
+//global slots take two bytes, locals and upvalues one
+static void emit_variable(Parser* parser, uint8_t op, int arg){
+  if(op == OP_GET_GLOBAL || op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL){
+    emit_op(parser,op);
+    emit_short(parser,(uint16_t)arg);
+    return;
+  }
+  emit_bytes(parser,op,(uint8_t)arg);
 }
-static void emit_bytes(RotoVM* vm,uint8_t byte1, uint8_t byte2) {
-  emit_byte(vm,byte1);
-  emit_byte(vm,byte2);
+
+/*
+ * superinstructions
+ * the last n instructions can be fused when they are back to back, are the
+ * given opcodes and no jump lands inside or right after them.
+ * returns the offset of the first one or -1.
+ */
+static int last_instrs(Parser* parser, int n, const uint8_t* ops){
+  //every instruction goes through emit_op, so consecutive entries are contiguous
+  Chunk* chunk = current_chunk(parser);
+  for (int i = 0; i < n; i++) {
+    int start = parser->compiler->instr_starts[i];
+    if (start < 0 || chunk->code[start] != ops[n - 1 - i]) return -1;
+  }
+  int first = parser->compiler->instr_starts[n - 1];
+  if (parser->compiler->jump_target > first) return -1;
+  return first;
+}
+
+//drop the instructions from offset on so a fused one can replace them
+static void rewind_code(Parser* parser, int offset){
+  current_chunk(parser)->count = offset;
+  for (int i = 0; i < 4; i++) {
+    parser->compiler->instr_starts[i] = -1;
+  }
+}
+//a call whose result is returned as is can hand its frame to the callee
+static void mark_tail_call(Parser* parser){
+  int start = parser->compiler->instr_starts[0];
+  if (start < 0 || parser->compiler->jump_target > start) return;
+  uint8_t* op = &current_chunk(parser)->code[start];
+  switch (*op) {
+    case OP_CALL: *op = OP_TAIL_CALL; break;
+    case OP_INVOKE: *op = OP_TAIL_INVOKE; break;
+    case OP_SUPER_INVOKE: *op = OP_TAIL_SUPER_INVOKE; break;
+    default: break;
+  }
+}
+//operand naming the inline cache of a property or invoke site
+static void emit_cache(Parser* parser){
+  if (parser->compiler->cache_count == NO_CACHE){
+    emit_byte(parser,NO_CACHE);
+    return;
+  }
+  emit_byte(parser,(uint8_t)parser->compiler->cache_count++);
 }
-static void emit_loop(RotoVM* vm,int loop_start){
-  emit_byte(vm,OP_LOOP);
+static void emit_loop(Parser* parser, int loop_start){
+  emit_op(parser,OP_LOOP);
 
-  int offset = current_chunk()->count - loop_start + 2;
-  if(offset > UINT16_MAX) error("Loop body too large.");
+  int offset = current_chunk(parser)->count - loop_start + 2;
+  if(offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-  emit_byte(vm,(offset >> 8) & 0xff);
-  emit_byte(vm,offset & 0xff);
+  emit_byte(parser,(offset >> 8) & 0xff);
+  emit_byte(parser,offset & 0xff);
 }
-static int emit_jmp(RotoVM* vm,uint8_t instruction){
-  emit_byte(vm,instruction);
-  emit_byte(vm,0xff);
-  emit_byte(vm,0xff);
-  return current_chunk()->count - 2;
+static int emit_jmp(Parser* parser, uint8_t instruction){
+  emit_op(parser,instruction);
+  emit_byte(parser,0xff);
+  emit_byte(parser,0xff);
+  return current_chunk(parser)->count - 2;
 }
-static void emit_return(RotoVM* vm) {
-    if(current->type == TYPE_INITIALIZER){
-        emit_bytes(vm,OP_GET_LOCAL, 0);
+static void emit_return(Parser* parser) {
+    if(parser->compiler->type == TYPE_INITIALIZER){
+        emit_bytes(parser,OP_GET_LOCAL, 0);
     } else {
-        emit_byte(vm,OP_NIL);
+        emit_op(parser,OP_NIL);
     }
-    emit_byte(vm,OP_RETURN);
+    emit_op(parser,OP_RETURN);
 }
-static uint8_t make_constant(RotoVM* vm,Value value){
-  int constant = add_constant(vm,current_chunk(), value);
+static uint8_t make_constant(Parser* parser, Value value){
+  int constant = add_constant(parser->vm,current_chunk(parser), value);
   if(constant > UINT8_MAX){
-    error("Too many constants in one chunk");
+    error(parser, "Too many constants in one chunk");
     return 0;
   }
   return (uint8_t)constant;
 }
-static void emit_constant(RotoVM* vm,Value value) {
-  emit_bytes(vm,OP_CONSTANT, make_constant(vm,value));
+static void emit_constant(Parser* parser, Value value) {
+  emit_bytes(parser,OP_CONSTANT, make_constant(parser,value));
 }
 
-static void patch_jmp(int offset){
+static void patch_jmp(Parser* parser, int offset){
   // -2 to adjust for the bytecode for the jump offset itself
-  int jump = current_chunk()->count - offset - 2;
+  int jump = current_chunk(parser)->count - offset - 2;
 
   if(jump > UINT16_MAX){
-    error("Too much code to jump over.");
+    error(parser, "Too much code to jump over.");
   }
-  current_chunk()->code[offset] = (jump >> 8) & 0xff;
-  current_chunk()->code[offset + 1] = jump & 0xff;
+  current_chunk(parser)->code[offset] = (jump >> 8) & 0xff;
+  current_chunk(parser)->code[offset + 1] = jump & 0xff;
+  parser->compiler->jump_target = current_chunk(parser)->count;
 }
 
-static void init_compiler(RotoVM* vm,Compiler* compiler,FunctionType type){
-    compiler->enclosing = current;
+/*
+ * jump out of an if or loop when the condition is false.
+ * a comparison right before it becomes a compare-and-branch that consumes
+ * both operands, so *fused tells the caller there is no condition left to pop.
+ */
+static int emit_cond_jmp(Parser* parser, bool* fused){
+  static const uint8_t compares[][2] = {
+      {OP_LESS, OP_JUMP_IF_NOT_LESS},
+      {OP_GREATER, OP_JUMP_IF_NOT_GREATER},
+      {OP_EQUAL, OP_JUMP_IF_NOT_EQUAL},
+  };
+  static const uint8_t negated[][2] = {
+      {OP_LESS, OP_JUMP_IF_LESS},
+      {OP_GREATER, OP_JUMP_IF_GREATER},
+      {OP_EQUAL, OP_JUMP_IF_EQUAL},
+  };
+  for (int i = 0; i < 3; i++) {
+    int start = last_instrs(parser, 1, compares[i]);
+    if (start != -1){
+      rewind_code(parser, start);
+      *fused = true;
+      return emit_jmp(parser,compares[i][1]);
+    }
+    uint8_t seq[2] = {negated[i][0], OP_NOT};
+    start = last_instrs(parser, 2, seq);
+    if (start != -1){
+      rewind_code(parser, start);
+      *fused = true;
+      return emit_jmp(parser,negated[i][1]);
+    }
+  }
+  *fused = false;
+  int jump = emit_jmp(parser,OP_JUMP_IF_FALSE);
+  emit_op(parser,OP_POP);
+  return jump;
+}
+
+//function is the skimmed one when compiling its body later, else NULL for a new one
+static void init_compiler(Parser* parser, Compiler* compiler,FunctionType type, ObjFunction* function){
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = newFunction(vm);
+    for (int i = 0; i < 4; i++) {
+        compiler->instr_starts[i] = -1;
+    }
+    compiler->jump_target = 0;
+    compiler->cache_count = 0;
+    compiler->function = function != NULL ? function : newFunction(parser->vm);
 
-    current = compiler;
+    parser->compiler = compiler;
 
-    if (type != TYPE_SCRIPT){
-        current->function->name = copy_string(vm,parser.previous.start, parser.previous.length);
+    if (type != TYPE_SCRIPT && function == NULL){
+        parser->compiler->function->name = copy_string(parser->vm,parser->previous.start, parser->previous.length);
     }
 
-    Local* local = &current->locals[current->local_count++];
+    Local* local = &parser->compiler->locals[parser->compiler->local_count++];
     local->depth = 0;
     local->is_captured = false;
     if(type != TYPE_FUNCTION) {
@@ -250,61 +374,71 @@ static void init_compiler(RotoVM* vm,Compiler* compiler,FunctionType type){
 }
 
 
-static ObjFunction* end_compiler(RotoVM* vm) {
-    emit_return(vm);
-    ObjFunction* function = current->function;
+static ObjFunction* end_compiler(Parser* parser) {
+    emit_return(parser);
+    ObjFunction* function = parser->compiler->function;
+    Chunk* chunk = current_chunk(parser);
+    init_caches(parser->vm, chunk, parser->compiler->cache_count);
+    //worked out once here so a call only has to check the stack has room for it
+    function->max_slots = stack_heights(parser->vm, current_chunk(parser), function->arity + 1, NULL);
+    if(function->max_slots == -1) function->max_slots = UINT8_COUNT;
+    if(!parser->hadError && parser->vm->backend == BACKEND_REGISTER){
+        compile_registers(parser->vm, function);
+    }
 #ifndef DEBUG_PRINT_CODE
-    if(!parser.hadError){
-      disassembleChunk(current_chunk(), function->name != NULL
+    if(!parser->hadError){
+      disassembleChunk(current_chunk(parser), function->name != NULL
                         ? function->name->chars: "<script>");
     }
 
 #endif
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
-static void begin_scope(){
-  current->scope_depth++;
+static void begin_scope(Parser* parser){
+  parser->compiler->scope_depth++;
 }
 
-static void end_scope(RotoVM* vm){
-    current->scope_depth--;
-  while (current->local_count > 0 && current->locals[current->local_count - 1].depth >
-          current->scope_depth) {
-      if (current->locals[current->local_count - 1].is_captured) {
-            emit_byte(vm,OP_CLOSE_UPVALUE);
+static void end_scope(Parser* parser){
+    parser->compiler->scope_depth--;
+  while (parser->compiler->local_count > 0 && parser->compiler->locals[parser->compiler->local_count - 1].depth >
+          parser->compiler->scope_depth) {
+      if (parser->compiler->locals[parser->compiler->local_count - 1].is_captured) {
+            emit_op(parser,OP_CLOSE_UPVALUE);
       }else{
-          emit_byte(vm,OP_POP);//optimization use a pop instr with an operand to pop many at once
+          emit_op(parser,OP_POP);//optimization use a pop instr with an operand to pop many at once
       }
-    current->local_count--;
+    parser->compiler->local_count--;
   }
 }
 
 //foward declaration // many like this is not good. bruh dont do this in own..
-static void expression(RotoVM* vm);
-static void statement(RotoVM* vm);
-static void declaration(RotoVM* vm);
-static void and_(RotoVM* vm,bool can_assign);
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
+static void and_(Parser* parser, bool can_assign);
 static ParseRule* get_rule(TokenType type);
-static void parse_precedence(RotoVM* vm,Precedence precedence);
-static uint8_t parse_variable(RotoVM* vm, const char* error_msg);
-static void define_variable(RotoVM* vm,uint8_t global);
-static void var_decl(RotoVM* vm);
-static void mark_initialized();
-static void fun_declaration(RotoVM* vm);
-static uint8_t argument_list(RotoVM* vm);
-static int resolve_local(Compiler* compiler, Token* name);
-static int resolve_upvalue(Compiler* compiler, Token* name);
-static void named_variable(RotoVM* vm,Token name, bool can_assign);
-static void call(RotoVM* vm,bool can_assign);
-static uint8_t identifier_constant(RotoVM* vm,Token* name);
-static void decl_variable();
-static void variable(RotoVM* vm,bool can_assign);
+static void parse_precedence(Parser* parser, Precedence precedence);
+static uint16_t parse_variable(Parser* parser, const char* error_msg);
+static void define_variable(Parser* parser, uint16_t global);
+static void var_decl(Parser* parser);
+static void mark_initialized(Parser* parser);
+static void fun_declaration(Parser* parser);
+static uint8_t argument_list(Parser* parser);
+static int resolve_local(Parser* parser, Compiler* compiler, Token* name);
+static int resolve_upvalue(Parser* parser, Compiler* compiler, Token* name);
+static void named_variable(Parser* parser, Token name, bool can_assign);
+static void call(Parser* parser, bool can_assign);
+static uint8_t identifier_constant(Parser* parser, Token* name);
+static uint16_t global_variable(Parser* parser, Token* name);
+static uint16_t method_name(Parser* parser, Token* name);
+static void decl_variable(Parser* parser);
+static void variable(Parser* parser, bool can_assign);
 static bool identifiers_equal(Token* a, Token* b);
-static void add_local(Token name);
+static void add_local(Parser* parser, Token name);
 static Token synthetic_token(const char* text);
-static void class_declaration(RotoVM* vm);
+static void class_declaration(Parser* parser);
 
 
 
@@ -312,181 +446,280 @@ static void class_declaration(RotoVM* vm);
 
 
 
-static void expression(RotoVM* vm){
-  parse_precedence(vm,PREC_ASSIGNMENT);
+static void expression(Parser* parser){
+  parse_precedence(parser,PREC_ASSIGNMENT);
 }
 
-static void block(RotoVM* vm){
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration(vm);
+static void block(Parser* parser){
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
-static void function(RotoVM* vm,FunctionType type){
-    Compiler compiler;
-    init_compiler(vm,&compiler, type);
-    begin_scope();
-
-    //compile the parameter list
-    consume(TOKEN_LEFT_PAREN,"Expect '(' after function name.");
-    if(!check(TOKEN_RIGHT_PAREN)){
+static void parameters(Parser* parser){
+    consume(parser, TOKEN_LEFT_PAREN,"Expect '(' after function name.");
+    if(!check(parser, TOKEN_RIGHT_PAREN)){
         do {
-            current->function->arity++;
-            if(current->function->arity > 255){
-                error_at_current("Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if(parser->compiler->function->arity > 255){
+                error_at_current(parser, "Can't have more than 255 parameters.");
             }
             //parsing
-            uint8_t paramConstant = parse_variable(vm,"Expect parameter name");
-            define_variable(vm,paramConstant);
-        } while (match(TOKEN_COMMA));
+            uint8_t paramConstant = parse_variable(parser,"Expect parameter name");
+            define_variable(parser,paramConstant);
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN,"Expect ')' after parameters.");
+    consume(parser, TOKEN_RIGHT_PAREN,"Expect ')' after parameters.");
+}
+
+//body_flags of a skimmed function: its kind and the class it's written in
+#define BODY_METHOD 0x1
+#define BODY_INITIALIZER 0x2
+#define BODY_IN_CLASS 0x4
+#define BODY_SUPER_CLASS 0x8
+
+//a name in a skimmed body. when it resolves to a variable of an enclosing
+//function the body gets an upvalue for it, as it would had it been compiled.
+//a name the body declares itself may be captured needlessly, which costs a slot
+static void skim_name(Parser* parser, Token name, Token* names){
+    Compiler* compiler = parser->compiler;
+    if(resolve_local(parser, compiler, &name) != -1) return;
+    int count = compiler->function->upvalue_count;
+    int upvalue = resolve_upvalue(parser, compiler, &name);
+    if(upvalue == count && compiler->function->upvalue_count > count){
+        names[upvalue] = name;
+    }
+}
+
+//in place of compiling a body: find its end and what it captures, counting
+//nested functions' captures as its own, and leave the rest to compile_body
+static void skim_body(Parser* parser, FunctionType type){
+    ObjFunction* function = parser->compiler->function;
+    function->source = parser->source;
+    function->body_start = (int)(parser->current.start - parser->source->chars);
+    function->body_line = parser->current.line;
+    if(type == TYPE_METHOD) function->body_flags |= BODY_METHOD;
+    if(type == TYPE_INITIALIZER) function->body_flags |= BODY_INITIALIZER;
+    if(parser->current_class != NULL){
+        function->body_flags |= BODY_IN_CLASS;
+        if(parser->current_class->has_super_class) function->body_flags |= BODY_SUPER_CLASS;
+    }
+
+    Token names[UINT8_COUNT];
+    parameters(parser);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    int depth = 1;
+    while (depth > 0 && !check(parser, TOKEN_EOF)) {
+        TokenType before = parser->previous.type;
+        advance(parser);
+        switch (parser->previous.type) {
+            case TOKEN_LEFT_BRACE: depth++; break;
+            case TOKEN_RIGHT_BRACE: depth--; break;
+            case TOKEN_IDENTIFIER:
+                //a property name isn't a variable
+                if(before != TOKEN_DOT) skim_name(parser, parser->previous, names);
+                break;
+            case TOKEN_THIS:
+                skim_name(parser, synthetic_token("this"), names);
+                break;
+            case TOKEN_SUPER:
+                skim_name(parser, synthetic_token("this"), names);
+                skim_name(parser, synthetic_token("super"), names);
+                break;
+            default: break;
+        }
+    }
+    if(depth > 0) error_at_current(parser, "Expect '}' after block.");
+
+    //nulled first, so a collection while the names are copied marks only what's there
+    function->upvalue_names = ALLOCATE(parser->vm, ObjString*, function->upvalue_count);
+    for (int i = 0; i < function->upvalue_count; i++) {
+        function->upvalue_names[i] = NULL;
+    }
+    for (int i = 0; i < function->upvalue_count; i++) {
+        function->upvalue_names[i] = copy_string(parser->vm, names[i].start, names[i].length);
+    }
+    parser->compiler = parser->compiler->enclosing;
+}
+
+static void function(Parser* parser, FunctionType type){
+    Compiler compiler;
+    init_compiler(parser,&compiler, type, NULL);
+    begin_scope(parser);
 
-    //The body
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block(vm);
+    ObjFunction* function;
+    if(parser->source != NULL){
+        skim_body(parser, type);
+        function = compiler.function;
+    }else{
+        parameters(parser);
+        //The body
+        consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+        block(parser);
 
-    //Create the function object.
-    ObjFunction* function = end_compiler(vm);
-    emit_bytes(vm,OP_CLOSURE,make_constant(vm,OBJ_VAL(function)));
+        //Create the function object.
+        function = end_compiler(parser);
+    }
+    emit_bytes(parser,OP_CLOSURE,make_constant(parser,OBJ_VAL(function)));
 
         for (int i = 0; i < function->upvalue_count; ++i) {
-            emit_byte(vm,compiler.upvalues[i].is_local ? 1 : 0);
-            emit_byte(vm,compiler.upvalues[i].index);
+            emit_byte(parser,compiler.upvalues[i].is_local ? 1 : 0);
+            emit_byte(parser,compiler.upvalues[i].index);
         }
 
 }
-static void method(RotoVM* vm){
-    consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifier_constant(vm, &parser.previous);
+static void method(Parser* parser){
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    uint16_t symbol = method_name(parser, &parser->previous);
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0){
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0){
         type = TYPE_INITIALIZER;
     }
-    function(vm,type);
-    emit_bytes(vm,OP_METHOD, constant);
+    function(parser,type);
+    emit_op(parser,OP_METHOD);
+    emit_short(parser,symbol);
 }
-static void class_declaration(RotoVM* vm){
-    consume(TOKEN_IDENTIFIER,"Expected class name.");
-    Token class_name = parser.previous;
-    uint8_t name_constant = identifier_constant(vm,&parser.previous);
-    decl_variable();
+static void class_declaration(Parser* parser){
+    consume(parser, TOKEN_IDENTIFIER,"Expected class name.");
+    Token class_name = parser->previous;
+    uint8_t name_constant = identifier_constant(parser,&parser->previous);
+    decl_variable(parser);
+    uint16_t global = parser->compiler->scope_depth > 0 ? 0 : global_variable(parser,&class_name);
 
-    emit_bytes(vm,OP_CLASS, name_constant);
-    define_variable(vm,name_constant);
+    emit_bytes(parser,OP_CLASS, name_constant);
+    define_variable(parser,global);
 
     ClassCompiler classCompiler;
-    classCompiler.name = parser.previous;
+    classCompiler.name = parser->previous;
     classCompiler.has_super_class = false;
-    classCompiler.enclosing = current_class;
-    current_class = &classCompiler;
-
-    if(match(TOKEN_LESS)){
-        consume(TOKEN_IDENTIFIER,"Expect superclass name.");
-        variable(vm,false);
-        if(identifiers_equal(&class_name, &parser.previous)){
-            error("A class can't inherit from itself.");
+    classCompiler.enclosing = parser->current_class;
+    parser->current_class = &classCompiler;
+
+    if(match(parser, TOKEN_LESS)){
+        consume(parser, TOKEN_IDENTIFIER,"Expect superclass name.");
+        variable(parser,false);
+        if(identifiers_equal(&class_name, &parser->previous)){
+            error(parser, "A class can't inherit from itself.");
         }
-        begin_scope();
-        add_local(synthetic_token("super"));
-        define_variable(vm,0);
-        named_variable(vm,class_name,false);
-        emit_byte(vm,OP_INHERIT);
+        begin_scope(parser);
+        add_local(parser, synthetic_token("super"));
+        define_variable(parser,0);
+        named_variable(parser,class_name,false);
+        emit_op(parser,OP_INHERIT);
         classCompiler.has_super_class = true;
     }
 
-    named_variable(vm,class_name, false);
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before the class body.");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)){
-        method(vm);
+    named_variable(parser,class_name, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before the class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)){
+        method(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after the class body.");
-    emit_byte(vm,OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after the class body.");
+    emit_op(parser,OP_POP);
 
     if (classCompiler.has_super_class){
-        end_scope(vm);
+        end_scope(parser);
     }
-    current_class = current_class->enclosing;
+    parser->current_class = parser->current_class->enclosing;
 }
-static void fun_declaration(RotoVM* vm){
-    uint8_t global = parse_variable(vm,"Expect function name.");
-    mark_initialized();
-    function(vm,TYPE_FUNCTION);
-    define_variable(vm,global);
+static void fun_declaration(Parser* parser){
+    uint16_t global = parse_variable(parser,"Expect function name.");
+    mark_initialized(parser);
+    function(parser,TYPE_FUNCTION);
+    define_variable(parser,global);
 }
-static void var_decl(RotoVM* vm) {
-  uint8_t global = parse_variable(vm,"Expected variable name.");
+static void var_decl(Parser* parser) {
+  uint16_t global = parse_variable(parser,"Expected variable name.");
 
-  if(match(TOKEN_EQUAL)){
-    expression(vm);
+  if(match(parser, TOKEN_EQUAL)){
+    expression(parser);
   }
   else{
-    emit_byte(vm,OP_NIL);
+    emit_op(parser,OP_NIL);
   }
-  consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
-
-  define_variable(vm,global);
+  consume(parser, TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
+
+  define_variable(parser,global);
+}
+
+//discard the value of an expression statement.
+//`i = i + k` on a local collapses into a single OP_INC_LOCAL
+static void emit_expr_pop(Parser* parser){
+  static const uint8_t increment[] = {OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL};
+  int start = last_instrs(parser, 4, increment);
+  if (start != -1){
+    uint8_t* code = current_chunk(parser)->code;
+    uint8_t slot = code[start + 1];
+    uint8_t constant = code[start + 3];
+    if (slot == code[start + 6] && IS_NUMBER(current_chunk(parser)->constants.values[constant])){
+      rewind_code(parser, start);
+      emit_bytes(parser,OP_INC_LOCAL, slot);
+      emit_byte(parser,constant);
+      return;
+    }
+  }
+  emit_op(parser,OP_POP);
 }
 
-void expr_stmt(RotoVM* vm) {
-  expression(vm);
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emit_byte(vm,OP_POP);
+void expr_stmt(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emit_expr_pop(parser);
 
 }
 
-static void for_stmt(RotoVM* vm) {
+static void for_stmt(Parser* parser) {
 
   //declaration part: var i = 0;
-  begin_scope();
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {
+  begin_scope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {
     //no initializer
-  }else if(match(TOKEN_VAR)){
-    var_decl(vm);
+  }else if(match(parser, TOKEN_VAR)){
+    var_decl(parser);
   }else{
-    expr_stmt(vm);
+    expr_stmt(parser);
   }
 
-  int loop_start = current_chunk()->count;
+  int loop_start = current_chunk(parser)->count;
 
   //conditional part: eg. i < 3; ....
   int exit_jmp = -1;
-  if(!match(TOKEN_SEMICOLON)){
-    expression(vm);
-    consume(TOKEN_SEMICOLON, "Expected ';' after loop condition.");
+  bool fused = false;
+  if(!match(parser, TOKEN_SEMICOLON)){
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expected ';' after loop condition.");
 
     //jump out of the loop if the condition is false
-    exit_jmp = emit_jmp(vm,OP_JUMP_IF_FALSE);
-    emit_byte(vm,OP_POP); //condition
+    exit_jmp = emit_cond_jmp(parser,&fused);
   }
 
   //increment part: i++;
-  if(!match(TOKEN_RIGHT_PAREN)){
-    int body_jump = emit_jmp(vm,OP_JUMP);
+  if(!match(parser, TOKEN_RIGHT_PAREN)){
+    int body_jump = emit_jmp(parser,OP_JUMP);
 
-    int increment_start = current_chunk()->count;
-    expression(vm);
-    emit_byte(vm,OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expected ')' after for clauses");
+    int increment_start = current_chunk(parser)->count;
+    expression(parser);
+    emit_expr_pop(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after for clauses");
 
-    emit_loop(vm,loop_start);
+    emit_loop(parser,loop_start);
     loop_start = increment_start;
-    patch_jmp(body_jump);
+    patch_jmp(parser, body_jump);
 
   }
 
-  statement(vm);
+  statement(parser);
 
-  emit_loop(vm,loop_start);
+  emit_loop(parser,loop_start);
 
   if(exit_jmp != -1){
-    patch_jmp(exit_jmp);
-    emit_byte(vm,OP_POP);
+    patch_jmp(parser, exit_jmp);
+    if(!fused) emit_op(parser,OP_POP);
   }
 
-  end_scope(vm);
+  end_scope(parser);
 }
 /*
 if_stmt := '(' expr; ')' '{' statement; '}' else '{' statement '}'
@@ -501,66 +734,67 @@ if_stmt := '(' expr; ')' '{' statement; '}' else '{' statement '}'
 
 */
 
-static void if_stmt(RotoVM* vm){
-    consume(TOKEN_LEFT_PAREN, "Expected '(' after 'if'.");
-    expression(vm);
-    consume(TOKEN_RIGHT_PAREN,"Expected ')' after condition.");
+static void if_stmt(Parser* parser){
+    consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN,"Expected ')' after condition.");
 
-    int then_jmp = emit_jmp(vm,OP_JUMP_IF_FALSE);
-    emit_byte(vm,OP_POP);
-    statement(vm);
-    int else_jmp = emit_jmp(vm,OP_JUMP);
-    patch_jmp(then_jmp);
+    bool fused;
+    int then_jmp = emit_cond_jmp(parser,&fused);
+    statement(parser);
+    int else_jmp = emit_jmp(parser,OP_JUMP);
+    patch_jmp(parser, then_jmp);
 
-    emit_byte(vm,OP_POP);
-    if(match(TOKEN_ELSE)) statement(vm);
-    patch_jmp(else_jmp);
+    if(!fused) emit_op(parser,OP_POP);
+    if(match(parser, TOKEN_ELSE)) statement(parser);
+    patch_jmp(parser, else_jmp);
 }
 //static void print_statement() {
 //  expression();
-//  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+//  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
 //  emit_byte(OP_PRINT);
 //}
 
-static void return_stmt(RotoVM* vm){
-    if (current->type == TYPE_SCRIPT){
-        error("Can't return from top-level code.");
+static void return_stmt(Parser* parser){
+    if (parser->compiler->type == TYPE_SCRIPT){
+        error(parser, "Can't return from top-level code.");
     }
-    if(match(TOKEN_SEMICOLON)){
-        emit_return(vm);
+    if(match(parser, TOKEN_SEMICOLON)){
+        emit_return(parser);
     } else{
-        if (current->type == TYPE_INITIALIZER){
-            error("Can't return a value from an initializer.");
+        if (parser->compiler->type == TYPE_INITIALIZER){
+            error(parser, "Can't return a value from an initializer.");
         }
-        expression(vm);
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emit_byte(vm,OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        mark_tail_call(parser);
+        emit_op(parser,OP_RETURN);
     }
 }
 
-static void while_stmt(RotoVM* vm) {
-  int loop_start = current_chunk()->count;
+static void while_stmt(Parser* parser) {
+  int loop_start = current_chunk(parser)->count;
 
-  consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
-  expression(vm);
-  consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
+  consume(parser, TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
 
-  int exit_jmp = emit_jmp(vm,OP_JUMP_IF_FALSE);
+  bool fused;
+  int exit_jmp = emit_cond_jmp(parser,&fused);
 
-  emit_byte(vm,OP_POP);
-  statement(vm);
+  statement(parser);
 
-  emit_loop(vm,loop_start);
+  emit_loop(parser,loop_start);
 
-  patch_jmp(exit_jmp);
-  emit_byte(vm,OP_POP);
+  patch_jmp(parser, exit_jmp);
+  if(!fused) emit_op(parser,OP_POP);
 }
-static void synchronize() {
-  parser.panicMode = false;
+static void synchronize(Parser* parser) {
+  parser->panicMode = false;
 
-  while(parser.current.type != TOKEN_EOF){
-    if(parser.previous.type == TOKEN_SEMICOLON) return;
-    switch (parser.current.type) {
+  while(parser->current.type != TOKEN_EOF){
+    if(parser->previous.type == TOKEN_SEMICOLON) return;
+    switch (parser->current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
       case TOKEN_VAR:
@@ -571,20 +805,20 @@ static void synchronize() {
         return;
       default: ;
     }
-    advance();
+    advance(parser);
   }
 }
-static void declaration(RotoVM* vm) {
-    if(match(TOKEN_CLASS)){
-        class_declaration(vm);
-    }else if(match(TOKEN_FUN)){
-        fun_declaration(vm);
-    }else if(match(TOKEN_VAR)){
-      var_decl(vm);
+static void declaration(Parser* parser) {
+    if(match(parser, TOKEN_CLASS)){
+        class_declaration(parser);
+    }else if(match(parser, TOKEN_FUN)){
+        fun_declaration(parser);
+    }else if(match(parser, TOKEN_VAR)){
+      var_decl(parser);
   }else{
-    statement(vm);
+    statement(parser);
   }
-  if(parser.panicMode) synchronize();
+  if(parser->panicMode) synchronize(parser);
 }
 
 // statement := expr_stmt
@@ -595,80 +829,80 @@ static void declaration(RotoVM* vm) {
 //             |while_stmt
 //             |block
 
-static void statement(RotoVM* vm) {
-    if(match(TOKEN_FOR)){
-         for_stmt(vm);
-  }else if(match(TOKEN_IF)){
-    if_stmt(vm);
-  }else if(match(TOKEN_RETURN)){
-      return_stmt(vm);
-  }else if(match(TOKEN_WHILE)){
-    while_stmt(vm);
-  }else if(match(TOKEN_LEFT_BRACE)){
-    begin_scope();
-    block(vm);
-    end_scope(vm);
+static void statement(Parser* parser) {
+    if(match(parser, TOKEN_FOR)){
+         for_stmt(parser);
+  }else if(match(parser, TOKEN_IF)){
+    if_stmt(parser);
+  }else if(match(parser, TOKEN_RETURN)){
+      return_stmt(parser);
+  }else if(match(parser, TOKEN_WHILE)){
+    while_stmt(parser);
+  }else if(match(parser, TOKEN_LEFT_BRACE)){
+    begin_scope(parser);
+    block(parser);
+    end_scope(parser);
   }else{
-    expr_stmt(vm);
+    expr_stmt(parser);
   }
 }
-static void grouping(RotoVM* vm,bool can_assign){
-  expression(vm);
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+static void grouping(Parser* parser, bool can_assign){
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression");
 }
 
 
-static void binary(RotoVM* vm,bool can_assign) {
+static void binary(Parser* parser, bool can_assign) {
   //remember the token
-  TokenType operator_type = parser.previous.type;
+  TokenType operator_type = parser->previous.type;
 
   //compile the right operand
   ParseRule* rule = get_rule(operator_type);
-  parse_precedence(vm,(Precedence)(rule->precedence + 1));
+  parse_precedence(parser,(Precedence)(rule->precedence + 1));
 
   //emit the operator instruction
   switch (operator_type) {
-    case TOKEN_BANG_EQUAL: emit_bytes(vm,OP_EQUAL,OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL: emit_byte(vm,OP_EQUAL); break;
-    case TOKEN_GREATER: emit_byte(vm,OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emit_bytes(vm,OP_LESS, OP_NOT); break;
-    case TOKEN_LESS: emit_byte(vm,OP_LESS); break;
-    case TOKEN_LESS_EQUAL: emit_bytes(vm,OP_GREATER, OP_NOT); break;
-    case TOKEN_PIPE: emit_byte(vm,OP_BITWISE_OR); break;
-    case TOKEN_CARET: emit_byte(vm,OP_BITWISE_XOR); break;
-      case TOKEN_AMPERSAND: emit_byte(vm,OP_BITWISE_AND); break;
-    case TOKEN_RIGHT_SHIFT: emit_byte(vm,OP_RIGHT_SHIFT); break;
-    case TOKEN_LEFT_SHIFT: emit_byte(vm,OP_LEFT_SHIFT); break;
-    case TOKEN_PLUS: emit_byte(vm,OP_ADD); break;
-    case TOKEN_MINUS: emit_byte(vm,OP_SUB); break;
-    case TOKEN_STAR: emit_byte(vm,OP_MUL); break;
-    case TOKEN_SLASH: emit_byte(vm,OP_DIV); break;
+    case TOKEN_BANG_EQUAL: emit_op(parser,OP_EQUAL); emit_op(parser,OP_NOT); break;
+    case TOKEN_EQUAL_EQUAL: emit_op(parser,OP_EQUAL); break;
+    case TOKEN_GREATER: emit_op(parser,OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emit_op(parser,OP_LESS); emit_op(parser,OP_NOT); break;
+    case TOKEN_LESS: emit_op(parser,OP_LESS); break;
+    case TOKEN_LESS_EQUAL: emit_op(parser,OP_GREATER); emit_op(parser,OP_NOT); break;
+    case TOKEN_PIPE: emit_op(parser,OP_BITWISE_OR); break;
+    case TOKEN_CARET: emit_op(parser,OP_BITWISE_XOR); break;
+      case TOKEN_AMPERSAND: emit_op(parser,OP_BITWISE_AND); break;
+    case TOKEN_RIGHT_SHIFT: emit_op(parser,OP_RIGHT_SHIFT); break;
+    case TOKEN_LEFT_SHIFT: emit_op(parser,OP_LEFT_SHIFT); break;
+    case TOKEN_PLUS: emit_op(parser,OP_ADD); break;
+    case TOKEN_MINUS: emit_op(parser,OP_SUB); break;
+    case TOKEN_STAR: emit_op(parser,OP_MUL); break;
+    case TOKEN_SLASH: emit_op(parser,OP_DIV); break;
 
   }
 }
 
-static void call(RotoVM* vm,bool can_assign){
-    uint8_t arg_count = argument_list(vm);
-    emit_bytes(vm,OP_CALL, arg_count);
+static void call(Parser* parser, bool can_assign){
+    uint8_t arg_count = argument_list(parser);
+    emit_bytes(parser,OP_CALL, arg_count);
 }
 
-static void list(RotoVM* vm,bool can_assign){
+static void list(Parser* parser, bool can_assign){
     int item_count = 0;
-//    if(!check(TOKEN_RIGHT_BRACKET)){
+//    if(!check(parser, TOKEN_RIGHT_BRACKET)){
         do {
-            if(check(TOKEN_RIGHT_BRACKET)){
+            if(check(parser, TOKEN_RIGHT_BRACKET)){
                 break;
             }
 //            parse_precedence(PREC_OR);
 //            if (item_count == UINT8_COUNT){
-//                error("Cannot have more than 256 items in a list literal.");
+//                error(parser, "Cannot have more than 256 items in a list literal.");
 //            }
-            expression(vm);
+            expression(parser);
             item_count++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
 //    }
-    emit_bytes(vm,OP_BUILD_LIST,item_count);
-    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list literal.");
+    emit_bytes(parser,OP_BUILD_LIST,item_count);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list literal.");
 //    if(item_count < 256){
 //        emit_bytes(OP_BUILD_LIST,item_count);
 //    } else{
@@ -682,103 +916,107 @@ static void list(RotoVM* vm,bool can_assign){
 
 }
 
-static void subscript(RotoVM* vm,bool can_assign){
-    parse_precedence(vm,PREC_OR);
-    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+static void subscript(Parser* parser, bool can_assign){
+    parse_precedence(parser,PREC_OR);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
 
-    if(can_assign && match(TOKEN_EQUAL)){
-        expression(vm);
-        emit_byte(vm,OP_STORE_SUBSCR);
+    if(can_assign && match(parser, TOKEN_EQUAL)){
+        expression(parser);
+        emit_op(parser,OP_STORE_SUBSCR);
     } else{
-        emit_byte(vm,OP_INDEX_SUBSCR);
+        emit_op(parser,OP_INDEX_SUBSCR);
     }
 }
 
 
-static void dot(RotoVM* vm, bool can_assign){
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_constant(vm,&parser.previous);
-    if(can_assign && match(TOKEN_EQUAL)){
-        expression(vm);
-        emit_bytes(vm,OP_SET_PROPERTY, name);
-    } else if(match(TOKEN_LEFT_PAREN)) {
-        uint8_t arg_count = argument_list(vm);
-        emit_bytes(vm,OP_INVOKE, name);
-        emit_byte(vm,arg_count);
+static void dot(Parser* parser, bool can_assign){
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    Token property = parser->previous;
+    if(can_assign && match(parser, TOKEN_EQUAL)){
+        uint8_t name = identifier_constant(parser,&property);
+        expression(parser);
+        emit_bytes(parser,OP_SET_PROPERTY, name);
+        emit_cache(parser);
+    } else if(match(parser, TOKEN_LEFT_PAREN)) {
+        uint16_t symbol = method_name(parser,&property);
+        uint8_t arg_count = argument_list(parser);
+        emit_op(parser,OP_INVOKE);
+        emit_short(parser,symbol);
+        emit_byte(parser,arg_count);
+        emit_cache(parser);
     }else{
-        emit_bytes(vm,OP_GET_PROPERTY, name);
+        uint8_t name = identifier_constant(parser,&property);
+        //this.name: GET_LOCAL 0 + GET_PROPERTY
+        static const uint8_t this_get[] = {OP_GET_LOCAL};
+        int start = last_instrs(parser, 1, this_get);
+        if (start != -1 && current_chunk(parser)->code[start + 1] == 0){
+            rewind_code(parser, start);
+            emit_bytes(parser,OP_GET_THIS_PROPERTY, name);
+        } else{
+            emit_bytes(parser,OP_GET_PROPERTY, name);
+        }
+        emit_cache(parser);
     }
 }
 
-static void literal(RotoVM* vm,bool can_assign) {
-  switch (parser.previous.type) {
-    case TOKEN_FALSE: emit_byte(vm,OP_FALSE); break;
-    case TOKEN_NIL: emit_byte(vm,OP_NIL); break;
-    case TOKEN_TRUE: emit_byte(vm,OP_TRUE); break;
+static void literal(Parser* parser, bool can_assign) {
+  switch (parser->previous.type) {
+    case TOKEN_FALSE: emit_op(parser,OP_FALSE); break;
+    case TOKEN_NIL: emit_op(parser,OP_NIL); break;
+    case TOKEN_TRUE: emit_op(parser,OP_TRUE); break;
     default:
       return;
   }
 }
-static void or_(RotoVM* vm,bool can_assign) {
-  int else_jmp = emit_jmp(vm,OP_JUMP_IF_FALSE);
-  int end_jump = emit_jmp(vm,OP_JUMP);
+static void or_(Parser* parser, bool can_assign) {
+  int else_jmp = emit_jmp(parser,OP_JUMP_IF_FALSE);
+  int end_jump = emit_jmp(parser,OP_JUMP);
 
-  patch_jmp(else_jmp);
-  emit_jmp(vm,OP_POP);
+  patch_jmp(parser, else_jmp);
+  emit_op(parser,OP_POP);
 
-  parse_precedence(vm,PREC_OR);
-  patch_jmp(end_jump);
+  parse_precedence(parser,PREC_OR);
+  patch_jmp(parser, end_jump);
 }
-static void number(RotoVM* vm,bool can_assign) {
-
-    // credit Dictu,https://github.com/dictu-lang/Dictu/blob/9fffbef4b19d0f0a8f0c2fa4ead70631b22d5c91/src/vm/compiler.c#L821
-    char* buffer  = malloc(sizeof(char)*(parser.previous.length + 1));
-    char* current = buffer;
-
-    for (int i = 0; i < parser.previous.length; i++) {
-        char c = parser.previous.start[i];
-
-        if (c != '_'){
-            *(current++) = c;
-        }
+static void number(Parser* parser, bool can_assign) {
+    double value;
+    if(!parse_number(parser->previous.start, (size_t)parser->previous.length, &value)){
+        error(parser, "Invalid number literal.");
+        return;
     }
-    *current = '\0';
-//    double value = strtod(parser.previous.start, NULL);
-    double value = strtod(buffer, NULL);
-    emit_constant(vm,NUMBER_VAL(value));
-    free(buffer);
+    emit_constant(parser,exact_number(value));
 }
 
 
-static void string(RotoVM* vm, bool can_assign){
-  emit_constant(vm,OBJ_VAL(copy_string(vm,parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser* parser, bool can_assign){
+  emit_constant(parser,OBJ_VAL(copy_string(parser->vm,parser->previous.start + 1, parser->previous.length - 2)));
 }
-static void named_variable(RotoVM* vm,Token name, bool can_assign) {
+static void named_variable(Parser* parser, Token name, bool can_assign) {
     uint8_t get_op, set_op;
-    int arg = resolve_local(current, &name);
+    int arg = resolve_local(parser, parser->compiler, &name);
 
     if(arg != -1){
       get_op = OP_GET_LOCAL;
       set_op = OP_SET_LOCAL;
-    }else if((arg = resolve_upvalue(current, &name)) != -1){
+    }else if((arg = resolve_upvalue(parser, parser->compiler, &name)) != -1){
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
 
     }else{
-      arg = identifier_constant(vm,&name);
+      arg = global_variable(parser,&name);
       get_op = OP_GET_GLOBAL;
       set_op = OP_SET_GLOBAL;
     }
 
-   if(can_assign && match(TOKEN_EQUAL)){
-     expression(vm);
-     emit_bytes(vm,set_op,(uint8_t)arg);
+   if(can_assign && match(parser, TOKEN_EQUAL)){
+     expression(parser);
+     emit_variable(parser,set_op,arg);
    }else{
-     emit_bytes(vm,get_op,(uint8_t)arg);
+     emit_variable(parser,get_op,arg);
    }
 }
-static void variable(RotoVM* vm,bool can_assign){
-  named_variable(vm,parser.previous, can_assign);
+static void variable(Parser* parser, bool can_assign){
+  named_variable(parser,parser->previous, can_assign);
 }
 static Token synthetic_token(const char* text){
     Token token;
@@ -786,44 +1024,46 @@ static Token synthetic_token(const char* text){
     token.length = (int)strlen(text);
     return token;
 }
-static void super_(RotoVM* vm,bool can_assign){
-    if(current_class == NULL){
-        error("Can't use 'super' outside of a class");
-    } else if(!current_class->has_super_class){
-        error("Can't use 'super' in a class with no superclass.");
+static void super_(Parser* parser, bool can_assign){
+    if(parser->current_class == NULL){
+        error(parser, "Can't use 'super' outside of a class");
+    } else if(!parser->current_class->has_super_class){
+        error(parser, "Can't use 'super' in a class with no superclass.");
     }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifier_constant(vm,&parser.previous);
-    named_variable(vm,synthetic_token("this"), false);
-    if(match(TOKEN_LEFT_PAREN)){
-        uint8_t arg_count = argument_list(vm);
-        named_variable(vm,synthetic_token("super"),false);
-        emit_bytes(vm,OP_SUPER_INVOKE, name);
-        emit_byte(vm,arg_count);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint16_t symbol = method_name(parser,&parser->previous);
+    named_variable(parser,synthetic_token("this"), false);
+    if(match(parser, TOKEN_LEFT_PAREN)){
+        uint8_t arg_count = argument_list(parser);
+        named_variable(parser,synthetic_token("super"),false);
+        emit_op(parser,OP_SUPER_INVOKE);
+        emit_short(parser,symbol);
+        emit_byte(parser,arg_count);
     } else{
-        named_variable(vm,synthetic_token("super"), false);
-        emit_bytes(vm,OP_GET_SUPER,name);
+        named_variable(parser,synthetic_token("super"), false);
+        emit_op(parser,OP_GET_SUPER);
+        emit_short(parser,symbol);
     }
 
 }
-static void this_(RotoVM* vm,bool can_assign){
-    if (current_class == NULL){
-        error("Can't use 'this' outside of a class.");
+static void this_(Parser* parser, bool can_assign){
+    if (parser->current_class == NULL){
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
-   variable(vm,false);
+   variable(parser,false);
 }
 
-static void unary(RotoVM* vm,bool can_assign){
-  TokenType operator_type = parser.previous.type;
+static void unary(Parser* parser, bool can_assign){
+  TokenType operator_type = parser->previous.type;
   //compile the operand ('-' expr)
-  parse_precedence(vm,PREC_UNARY);
+  parse_precedence(parser,PREC_UNARY);
 
   switch (operator_type) {
-    case TOKEN_BANG: emit_byte(vm,OP_NOT); break;
-    case TOKEN_MINUS: emit_byte(vm,OP_NEGATE); break;
+    case TOKEN_BANG: emit_op(parser,OP_NOT); break;
+    case TOKEN_MINUS: emit_op(parser,OP_NEGATE); break;
     default:
       return;
   }
@@ -842,12 +1082,12 @@ ParseRule rules[] = {
   { NULL,     NULL,    PREC_NONE },       // TOKEN_SEMICOLON
   { NULL,     binary,  PREC_FACTOR },     // TOKEN_SLASH
   { NULL,     binary,  PREC_FACTOR },     // TOKEN_STAR
-  { unary,     NULL,    PREC_NONE },       // TOKEN_BANG
   { NULL,     binary,    PREC_BITWISE_AND},       // TOKEN_AMPERSAND
   { NULL,     binary,    PREC_BITWISE_OR},       // TOKEN_PIPE
   { NULL,     binary,    PREC_BITWISE_XOR},       // TOKEN_CARET
   { NULL,     binary,    PREC_LEFT_SHIFT},       // TOKEN_LEFT_SHIFT
   { NULL,     binary,    PREC_RIGHT_SHIFT},       // TOKEN_RIGHT_SHIFT
+  { unary,     NULL,    PREC_NONE },       // TOKEN_BANG
   { NULL,     binary,    PREC_EQUALITY },       // TOKEN_BANG_EQUAL
   { NULL,     NULL,    PREC_NONE },       // TOKEN_EQUAL
   { NULL,     binary,    PREC_EQUALITY },       // TOKEN_EQUAL_EQUAL
@@ -878,27 +1118,44 @@ ParseRule rules[] = {
   { NULL,     NULL,    PREC_NONE },       // TOKEN_EOF
 };
 
-static void parse_precedence(RotoVM* vm,Precedence precedence){
-    advance();
-    ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+static void parse_precedence(Parser* parser, Precedence precedence){
+    advance(parser);
+    ParseFn prefix_rule = get_rule(parser->previous.type)->prefix;
     if(prefix_rule == NULL){
-      error("Expect expression");
+      error(parser, "Expect expression");
       return;
     }
     bool can_assign = precedence <= PREC_ASSIGNMENT;
-    prefix_rule(vm,can_assign);
+    prefix_rule(parser,can_assign);
 
-    while (precedence <= get_rule(parser.current.type)->precedence) {
-      advance();
-      ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-      infix_rule(vm,can_assign);
+    while (precedence <= get_rule(parser->current.type)->precedence) {
+      advance(parser);
+      ParseFn infix_rule = get_rule(parser->previous.type)->infix;
+      infix_rule(parser,can_assign);
     }
-    if(can_assign && match (TOKEN_EQUAL)){
-      error("Invalid assignment target.");
+    if(can_assign && match(parser, TOKEN_EQUAL)){
+      error(parser, "Invalid assignment target.");
     }
 }
-static uint8_t identifier_constant(RotoVM* vm,Token* name){
-  return make_constant(vm,OBJ_VAL(copy_string(vm,name->start, name->length)));
+static uint8_t identifier_constant(Parser* parser, Token* name){
+  return make_constant(parser,OBJ_VAL(copy_string(parser->vm,name->start, name->length)));
+}
+static uint16_t method_name(Parser* parser, Token* name){
+  int symbol = method_symbol(parser->vm, copy_string(parser->vm,name->start, name->length));
+  if(symbol == -1){
+    error(parser, "Too many method names.");
+    return 0;
+  }
+  return (uint16_t)symbol;
+}
+//globals live in numbered slots shared by everything the vm compiles
+static uint16_t global_variable(Parser* parser, Token* name){
+  int slot = global_slot(parser->vm, copy_string(parser->vm,name->start, name->length));
+  if(slot == -1){
+    error(parser, "Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
 }
 static bool identifiers_equal(Token* a, Token* b){
   if(a->length != b->length) return false;
@@ -906,12 +1163,12 @@ static bool identifiers_equal(Token* a, Token* b){
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolve_local(Compiler* compiler, Token* name){
+static int resolve_local(Parser* parser, Compiler* compiler, Token* name){
   for(int i = compiler->local_count - 1; i >=0; i--){
     Local* local = &compiler->locals[i];
     if (identifiers_equal(name, &local->name)) {
       if (local->depth == -1) {
-        error("Cannot read local variable in its own initializer.");
+        error(parser, "Cannot read local variable in its own initializer.");
       }
         return i;
     }
@@ -919,7 +1176,7 @@ static int resolve_local(Compiler* compiler, Token* name){
 
   return -1;
 }
-static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local){
+static int add_upvalue(Parser* parser, Compiler* compiler, uint8_t index, bool is_local){
     int upvalue_count = compiler->function->upvalue_count;
     for (int i = 0; i < upvalue_count; i++){
         Upvalue* upvalue = &compiler->upvalues[i];
@@ -930,7 +1187,7 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local){
     }
 
     if(upvalue_count == UINT8_COUNT){
-        error("Too many closure variables in function");
+        error(parser, "Too many closure variables in function");
         return 0;
     }
     compiler->upvalues[upvalue_count].is_local = is_local;
@@ -938,85 +1195,96 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local){
     return compiler->function->upvalue_count++;
 }
 
-static int resolve_upvalue(Compiler* compiler, Token* name){
-    if(compiler->enclosing == NULL) return -1;
+static int resolve_upvalue(Parser* parser, Compiler* compiler, Token* name){
+    if(compiler->enclosing == NULL){
+        //a skimmed body compiled on its own only has the upvalues the skim found
+        ObjFunction* function = compiler->function;
+        if(function->upvalue_names == NULL) return -1;
+        for (int i = 0; i < function->upvalue_count; i++) {
+            ObjString* upvalue = function->upvalue_names[i];
+            if(upvalue->length == name->length && memcmp(upvalue->chars, name->start, name->length) == 0){
+                return i;
+            }
+        }
+        return -1;
+    }
 
-    int local = resolve_local(compiler->enclosing, name);
+    int local = resolve_local(parser, compiler->enclosing, name);
     if (local != -1){
         compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t)local, true);
+        return add_upvalue(parser, compiler, (uint8_t)local, true);
     }
-    int upvalue = resolve_upvalue(compiler->enclosing, name);
+    int upvalue = resolve_upvalue(parser, compiler->enclosing, name);
     if(upvalue != -1){
-        return add_upvalue(compiler, (uint8_t)upvalue, false);
+        return add_upvalue(parser, compiler, (uint8_t)upvalue, false);
     }
 
     return -1;
 }
-static void add_local(Token name) {
-  if(current->local_count == UINT8_COUNT){
-    error("Too many local variables in function.");
+static void add_local(Parser* parser, Token name) {
+  if(parser->compiler->local_count == UINT8_COUNT){
+    error(parser, "Too many local variables in function.");
     return;
   }
-  Local* local = &current->locals[current->local_count++];
+  Local* local = &parser->compiler->locals[parser->compiler->local_count++];
   local->name = name;
   local->depth = -1;
   local->is_captured = false;
 }
 
-static void decl_variable(){
+static void decl_variable(Parser* parser){
   //globals are implicitly declared
-  if(current->scope_depth == 0) return;
+  if(parser->compiler->scope_depth == 0) return;
 
-  Token* name = &parser.previous;
-  for (int i = current->local_count - 1; i >= 0; i--) {
-    Local* local = &current->locals[i];
+  Token* name = &parser->previous;
+  for (int i = parser->compiler->local_count - 1; i >= 0; i--) {
+    Local* local = &parser->compiler->locals[i];
 
-    if (local->depth != -1 && local->depth < current->scope_depth) {
+    if (local->depth != -1 && local->depth < parser->compiler->scope_depth) {
       break;
     }
     if (identifiers_equal(name, &local->name)) {
-      error("Variable with this name already declared in this scope.");
+      error(parser, "Variable with this name already declared in this scope.");
     }
   }
-  add_local(*name);
+  add_local(parser, *name);
 
 }
 
-static uint8_t parse_variable(RotoVM* vm,const char* error_msg){
-  consume(TOKEN_IDENTIFIER, error_msg);
+static uint16_t parse_variable(Parser* parser, const char* error_msg){
+  consume(parser, TOKEN_IDENTIFIER, error_msg);
 
-  decl_variable();
-  if(current->scope_depth > 0) return 0;
-  return identifier_constant(vm,&parser.previous);
+  decl_variable(parser);
+  if(parser->compiler->scope_depth > 0) return 0;
+  return global_variable(parser,&parser->previous);
 }
 
-static void mark_initialized() {
-    if(current->scope_depth == 0) return;
-  current->locals[current->local_count - 1].depth = current->scope_depth;
+static void mark_initialized(Parser* parser) {
+    if(parser->compiler->scope_depth == 0) return;
+  parser->compiler->locals[parser->compiler->local_count - 1].depth = parser->compiler->scope_depth;
 }
 
-static void define_variable(RotoVM* vm,uint8_t global) {
-  if(current->scope_depth > 0){
-    mark_initialized();
+static void define_variable(Parser* parser, uint16_t global) {
+  if(parser->compiler->scope_depth > 0){
+    mark_initialized(parser);
     return;
   }
-  emit_bytes(vm,OP_DEFINE_GLOBAL, global);
+  emit_variable(parser,OP_DEFINE_GLOBAL,global);
 }
 
-static uint8_t argument_list(RotoVM* vm){
+static uint8_t argument_list(Parser* parser){
     uint8_t arg_count = 0;
-    if(!check(TOKEN_RIGHT_PAREN)){
+    if(!check(parser, TOKEN_RIGHT_PAREN)){
         do {
-            expression(vm);
+            expression(parser);
             if (arg_count == 255){
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
             arg_count++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
 
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return arg_count;
 }
 
@@ -1027,13 +1295,13 @@ static uint8_t argument_list(RotoVM* vm){
     true: POP move to right expr
   right expr value is result of right expr
 */
-static void and_(RotoVM* vm,bool can_assign) {
-   int end_jump = emit_jmp(vm,OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool can_assign) {
+   int end_jump = emit_jmp(parser,OP_JUMP_IF_FALSE);
 
-   emit_byte(vm,OP_POP);
-   parse_precedence(vm,PREC_AND);
+   emit_op(parser,OP_POP);
+   parse_precedence(parser,PREC_AND);
 
-   patch_jmp(end_jump);
+   patch_jmp(parser, end_jump);
 }
 
 static ParseRule* get_rule(TokenType type){
@@ -1041,27 +1309,129 @@ static ParseRule* get_rule(TokenType type){
 }
 
 
-ObjFunction* compile(RotoVM* vm, const char *source){
-  init_scanner(source);
+//how far the top level gets past the last release before a mapped source gives more back
+#define RELEASE_BYTES (1 << 20)
+
+//hands the pages of a mapped source from from up to to back to the system. they
+//read in again from the file if a token still in use points there. returns where
+//the next release starts
+static const char* release_source(const char* from, const char* to){
+#ifdef MADV_DONTNEED
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)from & ~(page - 1);
+  uintptr_t end = (uintptr_t)to & ~(page - 1);
+  if(end <= start) return from;
+  madvise((void*)start, end - start, MADV_DONTNEED);
+  return (const char*)end;
+#else
+  return to;
+#endif
+}
+
+static ObjFunction* compile_source(RotoVM* vm, const char *source, bool mapped){
+  Parser parser;
+  parser.vm = vm;
+  parser.source = NULL;
+  parser.hadError = false;
+  parser.panicMode = false;
+  parser.compiler = NULL;
+  parser.current_class = NULL;
+  vm->parser = &parser;
+  if(vm->lazy_bodies){
+    //skimmed bodies are compiled after the caller has let go of source
+    parser.source = copy_string(vm, source, (int)strlen(source));
+    source = parser.source->chars;
+    mapped = false;
+  }
+  init_scanner(&parser.scanner, source);
+
   Compiler compiler;
-  init_compiler(vm,&compiler,TYPE_SCRIPT);
+  init_compiler(&parser,&compiler,TYPE_SCRIPT, NULL);
+  advance(&parser);
+
+  const char* released = source;
+  while (!match(&parser, TOKEN_EOF)) {
+    declaration(&parser);
+    if(mapped && parser.previous.start - released >= RELEASE_BYTES){
+      released = release_source(released, parser.previous.start);
+    }
+  }
+  ObjFunction* function = end_compiler(&parser);
 
-   parser.hadError = false;
-   parser.panicMode = false;
-   advance();
+  vm->parser = NULL;
+  return parser.hadError ? NULL: function;
+}
 
-   while (!match(TOKEN_EOF)) {
-     declaration(vm);
-   }
-   ObjFunction* function = end_compiler(vm);
+ObjFunction* compile(RotoVM* vm, const char *source){
+  return compile_source(vm, source, false);
+}
+
+ObjFunction* compile_mapped(RotoVM* vm, const char* source){
+  return compile_source(vm, source, true);
+}
+
+bool compile_body(RotoVM* vm, ObjFunction* function){
+  Parser parser;
+  parser.vm = vm;
+  parser.source = function->source;
+  parser.hadError = false;
+  parser.panicMode = false;
+  parser.compiler = NULL;
+  parser.current_class = NULL;
+  init_scanner(&parser.scanner, function->source->chars + function->body_start);
+  parser.scanner.line = function->body_line;
+
+  //only whether there is a class and whether it has a superclass matter now
+  ClassCompiler klass;
+  klass.enclosing = NULL;
+  klass.name = synthetic_token("");
+  klass.has_super_class = (function->body_flags & BODY_SUPER_CLASS) != 0;
+  if(function->body_flags & BODY_IN_CLASS) parser.current_class = &klass;
+  FunctionType type = TYPE_FUNCTION;
+  if(function->body_flags & BODY_METHOD) type = TYPE_METHOD;
+  if(function->body_flags & BODY_INITIALIZER) type = TYPE_INITIALIZER;
+
+  vm->parser = &parser;
+  Compiler compiler;
+  init_compiler(&parser, &compiler, type, function);
+  begin_scope(&parser);
+  advance(&parser);
+  //the skim counted them already
+  function->arity = 0;
+  parameters(&parser);
+  consume(&parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(&parser);
+  end_compiler(&parser);
+  vm->parser = NULL;
+
+  if(parser.hadError){
+    //left skimmed, so the next call reports the same errors
+    free_chunk(vm, &function->chunk);
+    function->max_slots = 0;
+    function->registers = false;
+    return false;
+  }
+  FREE_ARRAY(vm, ObjString*, function->upvalue_names, function->upvalue_count);
+  function->upvalue_names = NULL;
+  function->source = NULL;
+  return true;
+}
 
-   return parser.hadError ? NULL: function;
+bool compile_bodies(RotoVM* vm, ObjFunction* function){
+  if(function->source != NULL && !compile_body(vm, function)) return false;
+  for (int i = 0; i < function->chunk.constants.count; i++) {
+    Value constant = function->chunk.constants.values[i];
+    if(IS_FUNCTION(constant) && !compile_bodies(vm, AS_FUNCTION(constant))) return false;
+  }
+  return true;
 }
 
 void mark_compiler_roots(RotoVM* vm){
-    Compiler* compiler = current;
+    if (vm->parser == NULL) return;
+    mark_object(vm,(Obj*)vm->parser->source);
+    Compiler* compiler = vm->parser->compiler;
     while (compiler != NULL){
         mark_object(vm,(Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
-}
\ No newline at end of file
+}
@@ -4,6 +4,13 @@
 #include "object.h"
 
 ObjFunction* compile(RotoVM* vm,const char* source);
+//source is a private read-only file mapping. the pages the top level is done with
+//are given back as it goes, so memory holds the output and not the whole file
+ObjFunction* compile_mapped(RotoVM* vm, const char* source);
+//compiles a body compile() only skimmed, false after reporting its errors
+bool compile_body(RotoVM* vm, ObjFunction* function);
+//same for function and every function nested in it, for writing them out
+bool compile_bodies(RotoVM* vm, ObjFunction* function);
 void mark_compiler_roots(RotoVM* vm);
 
 #endif
@@ -22,15 +22,47 @@ static int constant_instr(const char* name, Chunk *chunk, int offset){
   return offset + 2;
 }
 
+//method names are numbered per vm rather than kept in the chunk
+static int symbol_instr(const char* name, Chunk* chunk, int offset){
+  uint16_t symbol = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  printf("%-16s #%d\n", name, symbol);
+  return offset + 3;
+}
 static int invoke_instruction(const char* name, Chunk* chunk, int offset){
-    uint8_t constant = chunk->code[offset+1];
-    uint8_t arg_count = chunk->code[offset + 2];
-    __print_with_color(_MAGENTA, "%-16s (%d args) %4d '",name, arg_count, constant);
-
-    print_value(chunk->constants.values[constant]);
-    printf("'\n");
+    uint16_t symbol = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    uint8_t arg_count = chunk->code[offset + 3];
+    __print_with_color(_MAGENTA, "%-16s (%d args) #%d\n",name, arg_count, symbol);
+    printf(_RESET);
+    return offset + 4;
+}
+static int global_instr(const char* name, Chunk *chunk, int offset){
+  uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+//property access and invoke sites carry the index of their inline cache last
+static void print_cache(uint8_t cache){
+  if(cache == NO_CACHE){
+    printf(" [no cache]\n");
+  }else{
+    printf(" [cache %d]\n", cache);
+  }
+}
+static int property_instr(const char* name, Chunk *chunk, int offset){
+  uint8_t constant = chunk->code[offset+1];
+  printf("%-16s %4d '", name, constant);
+  print_value(chunk->constants.values[constant]);
+  printf("'");
+  print_cache(chunk->code[offset+2]);
+  return offset + 3;
+}
+static int cached_invoke_instr(const char* name, Chunk* chunk, int offset){
+    uint16_t symbol = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    uint8_t arg_count = chunk->code[offset + 3];
+    __print_with_color(_MAGENTA, "%-16s (%d args) #%d",name, arg_count, symbol);
+    print_cache(chunk->code[offset + 4]);
     printf(_RESET);
-    return offset + 3;
+    return offset + 5;
 }
 static int simple_instr(const char* name, int offset){
   printf("%s\n", name);
@@ -53,6 +85,36 @@ static int jump_instr(const char* name, int sign, Chunk* chunk, int offset){
   return offset + 3;
 }
 
+//operands are described by layout: r register, x register or constant,
+//k constant, u upvalue, g global slot, t stack height, j jump distance
+static int register_instr(const char* name, const char* layout, Chunk* chunk, int offset){
+  int length = instruction_length(chunk, offset);
+  printf("%-16s", name);
+  int operand = offset + 1;
+  for (const char* c = layout; *c != '\0'; c++) {
+    uint8_t byte = chunk->code[operand++];
+    switch (*c) {
+      case 'r': printf(" r%d", byte); break;
+      case 'x':
+        if(byte & 0x80) printf(" k%d", byte & 0x7f);
+        else printf(" r%d", byte);
+        break;
+      case 'k': printf(" k%d", byte); break;
+      case 'u': printf(" u%d", byte); break;
+      case 'g': printf(" g%d", (byte << 8) | chunk->code[operand++]); break;
+      case 't': printf(" top %d", byte); break;
+      case 'j':{
+        uint16_t jump = (uint16_t)((byte << 8) | chunk->code[operand++]);
+        printf(" -> %d", offset + length + jump);
+        break;
+      }
+    }
+  }
+  printf("\n");
+  printf(_RESET);
+  return offset + length;
+}
+
 int disassemble_instr(Chunk *chunk, int offset) {
   /* code */
   printf(_MAGENTA);
@@ -86,25 +148,25 @@ int disassemble_instr(Chunk *chunk, int offset) {
     case OP_SET_LOCAL:
       return byte_instr("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constant_instr("OP_GET_GLOBAL", chunk, offset);
+      return global_instr("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constant_instr("OP_DEFINE_GLOBAL", chunk, offset);
+      return global_instr("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constant_instr("OP_SET_GLOBAL", chunk, offset);
+      return global_instr("OP_SET_GLOBAL", chunk, offset);
       case OP_GET_UPVALUE:
           return byte_instr("OP_GET_UPVALUE", chunk, offset);
       case OP_SET_UPVALUE:
           return byte_instr("OP_SET_UPVALUE", chunk,offset);
 
       case OP_GET_PROPERTY:
-          return constant_instr("OP_GET_PROPERTY", chunk, offset);
+          return property_instr("OP_GET_PROPERTY", chunk, offset);
 
       case OP_SET_PROPERTY:
-          return constant_instr("OP_SET_PROPERTY", chunk, offset);
+          return property_instr("OP_SET_PROPERTY", chunk, offset);
 
 
       case OP_GET_SUPER:
-          return constant_instr("OP_GET_SUPER", chunk, offset);
+          return symbol_instr("OP_GET_SUPER", chunk, offset);
 
 
       case OP_EQUAL:
@@ -135,7 +197,7 @@ int disassemble_instr(Chunk *chunk, int offset) {
           return byte_instr("OP_CALL", chunk, offset);
 
       case OP_INVOKE:
-          return invoke_instruction("OP_INVOKE",chunk, offset);
+          return cached_invoke_instr("OP_INVOKE",chunk, offset);
 
       case OP_BUILD_LIST:
           return simple_instr("OP_BUILD_LIST", offset);
@@ -178,7 +240,117 @@ int disassemble_instr(Chunk *chunk, int offset) {
       case OP_INHERIT:
           return simple_instr("OP_INHERIT", offset);
       case OP_METHOD:
-          return constant_instr("OP_METHOD", chunk, offset);
+          return symbol_instr("OP_METHOD", chunk, offset);
+
+      case OP_GET_THIS_PROPERTY:
+          return property_instr("OP_GET_THIS_PROPERTY", chunk, offset);
+      case OP_INC_LOCAL:{
+          uint8_t slot = chunk->code[offset + 1];
+          uint8_t constant = chunk->code[offset + 2];
+          printf("%-16s %4d += '", "OP_INC_LOCAL", slot);
+          print_value(chunk->constants.values[constant]);
+          printf("'\n");
+          printf(_RESET);
+          return offset + 3;
+      }
+      case OP_JUMP_IF_NOT_LESS:
+          return jump_instr("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+      case OP_JUMP_IF_NOT_GREATER:
+          return jump_instr("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+      case OP_JUMP_IF_NOT_EQUAL:
+          return jump_instr("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+      case OP_JUMP_IF_LESS:
+          return jump_instr("OP_JUMP_IF_LESS", 1, chunk, offset);
+      case OP_JUMP_IF_GREATER:
+          return jump_instr("OP_JUMP_IF_GREATER", 1, chunk, offset);
+      case OP_JUMP_IF_EQUAL:
+          return jump_instr("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+      case OP_TAIL_CALL:
+          return byte_instr("OP_TAIL_CALL", chunk, offset);
+      case OP_TAIL_INVOKE:
+          return cached_invoke_instr("OP_TAIL_INVOKE", chunk, offset);
+      case OP_TAIL_SUPER_INVOKE:
+          return invoke_instruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
+
+      case OP_ADD_NUM:
+          return simple_instr("OP_ADD_NUM", offset);
+      case OP_SUB_NUM:
+          return simple_instr("OP_SUB_NUM", offset);
+      case OP_MUL_NUM:
+          return simple_instr("OP_MUL_NUM", offset);
+      case OP_DIV_NUM:
+          return simple_instr("OP_DIV_NUM", offset);
+      case OP_LESS_NUM:
+          return simple_instr("OP_LESS_NUM", offset);
+      case OP_GREATER_NUM:
+          return simple_instr("OP_GREATER_NUM", offset);
+      case OP_EQUAL_NUM:
+          return simple_instr("OP_EQUAL_NUM", offset);
+      case OP_NEGATE_NUM:
+          return simple_instr("OP_NEGATE_NUM", offset);
+      case OP_ADD_INT:
+          return simple_instr("OP_ADD_INT", offset);
+      case OP_SUB_INT:
+          return simple_instr("OP_SUB_INT", offset);
+      case OP_MUL_INT:
+          return simple_instr("OP_MUL_INT", offset);
+      case OP_LESS_INT:
+          return simple_instr("OP_LESS_INT", offset);
+      case OP_GREATER_INT:
+          return simple_instr("OP_GREATER_INT", offset);
+      case OP_EQUAL_INT:
+          return simple_instr("OP_EQUAL_INT", offset);
+
+      case OP_R_MOVE:
+          return register_instr("OP_R_MOVE", "rrt", chunk, offset);
+      case OP_R_LOADK:
+          return register_instr("OP_R_LOADK", "rkt", chunk, offset);
+      case OP_R_LOADNIL:
+          return register_instr("OP_R_LOADNIL", "rt", chunk, offset);
+      case OP_R_LOADTRUE:
+          return register_instr("OP_R_LOADTRUE", "rt", chunk, offset);
+      case OP_R_LOADFALSE:
+          return register_instr("OP_R_LOADFALSE", "rt", chunk, offset);
+      case OP_R_ADD:
+          return register_instr("OP_R_ADD", "rxxt", chunk, offset);
+      case OP_R_SUB:
+          return register_instr("OP_R_SUB", "rxxt", chunk, offset);
+      case OP_R_MUL:
+          return register_instr("OP_R_MUL", "rxxt", chunk, offset);
+      case OP_R_DIV:
+          return register_instr("OP_R_DIV", "rxxt", chunk, offset);
+      case OP_R_LESS:
+          return register_instr("OP_R_LESS", "rxxt", chunk, offset);
+      case OP_R_GREATER:
+          return register_instr("OP_R_GREATER", "rxxt", chunk, offset);
+      case OP_R_EQUAL:
+          return register_instr("OP_R_EQUAL", "rxxt", chunk, offset);
+      case OP_R_NOT:
+          return register_instr("OP_R_NOT", "rxt", chunk, offset);
+      case OP_R_NEGATE:
+          return register_instr("OP_R_NEGATE", "rxt", chunk, offset);
+      case OP_R_GET_UPVALUE:
+          return register_instr("OP_R_GET_UPVALUE", "rut", chunk, offset);
+      case OP_R_SET_UPVALUE:
+          return register_instr("OP_R_SET_UPVALUE", "ux", chunk, offset);
+      case OP_R_GET_GLOBAL:
+          return register_instr("OP_R_GET_GLOBAL", "rgt", chunk, offset);
+      case OP_R_JUMP_IF_NOT_LESS:
+          return register_instr("OP_R_JUMP_IF_NOT_LESS", "xxtj", chunk, offset);
+      case OP_R_JUMP_IF_NOT_GREATER:
+          return register_instr("OP_R_JUMP_IF_NOT_GREATER", "xxtj", chunk, offset);
+      case OP_R_JUMP_IF_NOT_EQUAL:
+          return register_instr("OP_R_JUMP_IF_NOT_EQUAL", "xxtj", chunk, offset);
+      case OP_R_JUMP_IF_LESS:
+          return register_instr("OP_R_JUMP_IF_LESS", "xxtj", chunk, offset);
+      case OP_R_JUMP_IF_GREATER:
+          return register_instr("OP_R_JUMP_IF_GREATER", "xxtj", chunk, offset);
+      case OP_R_JUMP_IF_EQUAL:
+          return register_instr("OP_R_JUMP_IF_EQUAL", "xxtj", chunk, offset);
+      case OP_R_SETTOP:
+          return register_instr("OP_R_SETTOP", "t", chunk, offset);
+      case OP_R_RETURN:
+          return register_instr("OP_R_RETURN", "x", chunk, offset);
     default:
       printf("Unknown opcode %d\n", instr);
       return offset + 1;
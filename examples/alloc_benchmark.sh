@@ -0,0 +1,17 @@
+#!/bin/sh
+# objects allocated per second and peak memory for alloc_benchmark.rt, with no
+# nursery so every object comes from the old heap, then with the default one.
+# more than one lox compares builds. usage: alloc_benchmark.sh path/to/lox...
+: "${1:?usage: alloc_benchmark.sh path/to/lox...}"
+SCRIPT=$(dirname "$0")/alloc_benchmark.rt
+
+for lox in "$@"; do
+  echo "$lox"
+  for kb in 0 1024; do
+    out=$("$lox" --nursery $kb --gc-stats "$SCRIPT" 2>&1)
+    #the stats come out on stderr, ahead of what the script printed
+    echo "$out" | grep -v ':' | awk -v kb=$kb 'NR == 1 { rate = $1 / 1e6 } NR == 2 {
+      printf "  nursery %5skb  %.2f million objects/s, rebuild %.3f s\n", kb, rate, $1 }'
+    echo "$out" | grep '^memory: ' | sed 's/^memory: /                   /'
+  done
+done
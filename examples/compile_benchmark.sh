@@ -0,0 +1,39 @@
+#!/bin/sh
+# times --compile-all over a pile of generated scripts at 1, 2, 4... jobs up to
+# the core count. usage: compile_benchmark.sh path/to/lox [files] [functions per file]
+LOX=${1:?usage: compile_benchmark.sh path/to/lox [files] [functions per file]}
+FILES=${2:-2000}
+FUNCTIONS=${3:-100}
+CORES=$(getconf _NPROCESSORS_ONLN)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+i=0
+while [ $i -lt "$FILES" ]; do
+  awk -v n="$FUNCTIONS" -v file=$i 'BEGIN{
+    print "class Counter" file "{ init(n){ this.n = n; } step(by){ this.n = this.n + by; return this; } }";
+    for (f = 0; f < n; f++) {
+      print "func f" f "(a, b){";
+      print "  var total = 0;";
+      print "  for(var i = 0; i < a; i = i + 1){";
+      print "    if(i > 3 and b > 1){ total = total + i * b; } else { total = total - 1; }";
+      print "  }";
+      print "  var c = Counter" file "(total);";
+      print "  return c.step(a).step(b).n;";
+      print "}";
+    }
+    print "print(f0(10, 2));";
+  }' > "$DIR/script$i.rt"
+  i=$((i + 1))
+done
+
+jobs=1
+while [ $jobs -le "$CORES" ]; do
+  start=$(date +%s.%N)
+  "$LOX" --jobs $jobs --compile-all "$DIR"/*.rt || exit 1
+  end=$(date +%s.%N)
+  echo "$jobs $start $end" | awk '{ printf "%3d jobs  %.3fs\n", $1, $3 - $2 }'
+  [ $jobs -eq "$CORES" ] && break
+  jobs=$((jobs * 2))
+  [ $jobs -gt "$CORES" ] && jobs=$CORES
+done
@@ -0,0 +1,17 @@
+#!/bin/sh
+# collection counts, total gc time and the longest pause for gc_benchmark.rt
+# with no nursery and a few nursery sizes, then with a few incremental slice
+# budgets. usage: gc_benchmark.sh path/to/lox [script]
+LOX=${1:?usage: gc_benchmark.sh path/to/lox [script]}
+SCRIPT=${2:-$(dirname "$0")/gc_benchmark.rt}
+
+for kb in 0 256 1024 4096; do
+  printf "nursery %5skb              " $kb
+  "$LOX" --nursery $kb --gc-stats "$SCRIPT" 2>&1 >/dev/null | sed 's/^gc: //'
+done
+for kb in 0 1024; do
+  for work in 500 2000 10000; do
+    printf "nursery %5skb  slice %5s  " $kb $work
+    "$LOX" --nursery $kb --gc-slice $work --gc-stats "$SCRIPT" 2>&1 >/dev/null | sed 's/^gc: //'
+  done
+done
@@ -0,0 +1,15 @@
+#!/bin/sh
+# major collection marking time for gc_parallel_benchmark.rt at 1, 2, 4... gc
+# threads up to the core count. usage: gc_parallel_benchmark.sh path/to/lox [script]
+LOX=${1:?usage: gc_parallel_benchmark.sh path/to/lox [script]}
+SCRIPT=${2:-$(dirname "$0")/gc_parallel_benchmark.rt}
+CORES=$(getconf _NPROCESSORS_ONLN)
+
+threads=1
+while [ $threads -le "$CORES" ]; do
+  printf "%3d threads  " $threads
+  "$LOX" --nursery 0 --gc-threads $threads --gc-stats "$SCRIPT" 2>&1 >/dev/null | sed 's/^gc: //'
+  [ $threads -eq "$CORES" ] && break
+  threads=$((threads * 2))
+  [ $threads -gt "$CORES" ] && threads=$CORES
+done
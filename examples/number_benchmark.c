@@ -0,0 +1,106 @@
+//literals per second through the compiler's old number path (copy without
+//the '_' separators into a malloc'd buffer, then strtod) against
+//parse_number, on the numbers a generated data script holds. build with
+//  cmake --build build --target number_benchmark
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "number.h"
+
+#define LITERALS 1000000
+
+static double now(void){
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+//what the compiler did before parse_number
+static double old_number(const char* start, int length){
+  char* buffer = malloc(sizeof(char) * (length + 1));
+  char* current = buffer;
+  for (int i = 0; i < length; i++) {
+    if(start[i] != '_') *(current++) = start[i];
+  }
+  *current = '\0';
+  double value = strtod(buffer, NULL);
+  free(buffer);
+  return value;
+}
+
+//ids, weights, money, hex flags and the odd long measurement, one after
+//another with a space between
+static char* generate(int* starts, int* lengths){
+  char* text = (char*)malloc((size_t)LITERALS * 32);
+  if(text == NULL) exit(74);
+  size_t length = 0;
+  unsigned seed = 12345;
+  for (int i = 0; i < LITERALS; i++) {
+    seed = seed * 1103515245 + 12345;
+    starts[i] = (int)length;
+    switch (i % 5) {
+      case 0: length += (size_t)sprintf(text + length, "%u", seed % 100000); break;
+      case 1: length += (size_t)sprintf(text + length, "%u.%u", seed % 977, seed % 100); break;
+      case 2: length += (size_t)sprintf(text + length, "%u.%02u", seed % 1000000, seed % 100); break;
+      case 3: length += (size_t)sprintf(text + length, "0x%X", seed & 0xffff); break;
+      default: length += (size_t)sprintf(text + length, "0.%u%u", seed, seed / 7); break;
+    }
+    lengths[i] = (int)length - starts[i];
+    text[length++] = ' ';
+  }
+  text[length] = '\0';
+  return text;
+}
+
+int main(void){
+  int* starts = (int*)malloc(sizeof(int) * LITERALS);
+  int* lengths = (int*)malloc(sizeof(int) * LITERALS);
+  if(starts == NULL || lengths == NULL) return 74;
+  char* text = generate(starts, lengths);
+
+  //both must agree on every literal before either is timed
+  for (int i = 0; i < LITERALS; i++) {
+    double value;
+    if(!parse_number(text + starts[i], (size_t)lengths[i], &value) ||
+       value != old_number(text + starts[i], lengths[i])){
+      fprintf(stderr, "mismatch on %.*s\n", lengths[i], text + starts[i]);
+      return 1;
+    }
+  }
+
+  double sum = 0;
+  int rounds = 0;
+  double start = now();
+  double old_time = 0;
+  while (old_time < 1.0) {
+    for (int i = 0; i < LITERALS; i++) sum += old_number(text + starts[i], lengths[i]);
+    rounds++;
+    old_time = now() - start;
+  }
+  double old_rate = (double)LITERALS * rounds / old_time / 1e6;
+
+  rounds = 0;
+  start = now();
+  double new_time = 0;
+  while (new_time < 1.0) {
+    for (int i = 0; i < LITERALS; i++) {
+      double value;
+      parse_number(text + starts[i], (size_t)lengths[i], &value);
+      sum += value;
+    }
+    rounds++;
+    new_time = now() - start;
+  }
+  double new_rate = (double)LITERALS * rounds / new_time / 1e6;
+
+  printf("malloc + strtod  %.1f million literals/s\n", old_rate);
+  printf("parse_number     %.1f million literals/s, %.2fx\n", new_rate, new_rate / old_rate);
+  //keeps the loops from being thrown away
+  if(sum == 0) printf("\n");
+  free(text);
+  free(starts);
+  free(lengths);
+  return 0;
+}
@@ -0,0 +1,74 @@
+//tokens per second through the scanner alone, on a generated data script of
+//about the given size in megabytes (default 8). build with
+//  cmake --build build --target scan_benchmark
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+static double now(void){
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+//the mix a generated data script has: indented records of numbers,
+//strings and names, with the odd comment
+static char* generate(size_t size){
+  char* source = (char*)malloc(size + 256);
+  if(source == NULL) exit(74);
+  size_t length = 0;
+  unsigned seed = 12345;
+  int record = 0;
+  while (length < size) {
+    seed = seed * 1103515245 + 12345;
+    length += (size_t)sprintf(source + length,
+        "// record %d, generated from the nightly export. fields are id, weight,\n"
+        "// flags, label, short code and the derived score\n"
+        "var entry_%d = [\n"
+        "        %u, %u.%u, 0x%X,\n"
+        "        \"name_%u with a longer description of what this entry holds\", \"%u\",\n"
+        "        lookup(table, \"key_%d\") + offset * scale, true, nil\n"
+        "];\n",
+        record, record, seed % 100000, seed % 977, seed % 100, seed & 0xffff,
+        seed % 5000, seed % 10, record);
+    record++;
+  }
+  return source;
+}
+
+int main(int argc, char** argv){
+  size_t megabytes = argc > 1 ? (size_t)strtoul(argv[1], NULL, 10) : 8;
+  if(megabytes == 0) megabytes = 1;
+  char* source = generate(megabytes * 1024 * 1024);
+  size_t length = strlen(source);
+
+  long tokens = 0;
+  int rounds = 0;
+  double start = now();
+  double elapsed = 0;
+  //at least a second's worth, so small sizes still time well
+  while (elapsed < 1.0) {
+    Scanner scanner;
+    init_scanner(&scanner, source);
+    for (;;) {
+      Token token = scan_token(&scanner);
+      tokens++;
+      if(token.type == TOKEN_EOF) break;
+      if(token.type == TOKEN_ERROR){
+        fprintf(stderr, "line %d: %.*s\n", token.line, token.length, token.start);
+        return 1;
+      }
+    }
+    rounds++;
+    elapsed = now() - start;
+  }
+
+  printf("%zu bytes, %ld tokens a pass, %d passes\n", length, tokens / rounds, rounds);
+  printf("%.1f million tokens/s, %.1f MB/s\n",
+         (double)tokens / elapsed / 1e6, (double)length * rounds / elapsed / (1024 * 1024));
+  free(source);
+  return 0;
+}
@@ -1,6 +1,9 @@
 #ifndef file_roto_h
 #define file_roto_h
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef struct _rotoVM RotoVM;
 
 typedef void *(*RotoReallocFn)(void* memory, size_t old_size, size_t new_size);
@@ -13,7 +16,41 @@ typedef enum{
 }InterpretResult;
 
 
+//which bytecode functions are run as. stack code is what the compiler emits,
+//the register back end rewrites every function into three address form
+typedef enum{
+	BACKEND_STACK,
+	BACKEND_REGISTER
+}RotoBackend;
+
+//what the collector has done since the vm started
+typedef struct{
+	int minor_collections;
+	int major_collections;
+	double seconds;//spent in collections of either kind
+	double longest_pause;
+	double marking;//of seconds, what tracing from the gray objects took in major collections
+	size_t heap_bytes;//mapped for old objects at the time it's asked
+}RotoGcStats;
+
 RotoVM* init_vm(RotoReallocFn reallocfn);
+void set_backend(RotoVM* vm, RotoBackend backend);
+//off by default. when on, a script's functions are compiled as they're first
+//called, and errors in a body are only reported then
+void set_lazy_bodies(RotoVM* vm, bool lazy);
+//short lived objects start out in a nursery of this many bytes, 0 to allocate
+//everything in the old heap. only to be changed with no script running
+void set_nursery_size(RotoVM* vm, size_t size);
+//0, the default, marks in one pause and sweeps a little at a time as the
+//script allocates. otherwise marking is spread out like sweeping, work objects
+//or values at a time, and the pauses are bounded by that
+void set_gc_slice(RotoVM* vm, int work);
+//threads a major collection marks on once the heap is big enough to be worth
+//it, 1 by default. incremental slices stay on the script's thread
+void set_gc_threads(RotoVM* vm, int threads);
+RotoGcStats gc_stats(RotoVM* vm);
+RotoVM* init_vm_image(RotoReallocFn reallocfn, const void* image, size_t size);
+bool save_vm_image(RotoVM* vm, const char* path);
 void free_vm(RotoVM* vm);
 InterpretResult interpret(RotoVM* vm, const char* source);
 
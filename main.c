@@ -1,12 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
 
+#include "compiler.h"
+#include "serialize.h"
 #include "vm.h"
 
 static void repl(RotoVM* vm){
@@ -23,14 +33,11 @@ static void repl(RotoVM* vm){
     interpret(vm,line);
   }
 }
-//read binary file
-static char* read_file(const char* path){
+//read binary file, NULL when it can't be
+static char* try_read_file(const char* path, size_t* size){
   FILE *file = fopen(path, "rb");
 
-  if(file == NULL){
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
-    exit(74);
-  }
+  if(file == NULL) return NULL;
 
   fseek(file, 0L, SEEK_END);
   size_t file_size = ftell(file);
@@ -39,52 +46,429 @@ static char* read_file(const char* path){
   char *buffer = (char*)malloc(file_size +1);
 
   if(buffer == NULL){
-    fprintf(stderr, "Not enough memory to read \"%s\".\n",path);
-    exit(74);
+    fclose(file);
+    return NULL;
   }
   size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+  fclose(file);
 
   if(bytes_read < file_size){
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
+    free(buffer);
+    return NULL;
   }
 
   buffer[bytes_read] = '\0';
+  *size = bytes_read;
+  return buffer;
+}
 
-  fclose(file);
+static char* read_file(const char* path, size_t* size){
+  char* buffer = try_read_file(path, size);
+  if(buffer == NULL){
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+  }
   return buffer;
 }
 
+//a script, mapped read-only where possible so the compiler scans the file in
+//place and the pages are read in as it gets to them
+typedef struct{
+  char* text;//nul terminated
+  size_t size;
+  size_t mapped;//length of the mapping, 0 when text was read into the heap
+}Source;
 
-static void run_file(RotoVM* vm,const char* path){
-  char *source = read_file(path);
-  InterpretResult result = interpret(vm,source);
+static bool map_source(const char* path, Source* source){
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return false;
+  struct stat info;
+  long page = sysconf(_SC_PAGESIZE);
+  if(fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || page <= 0){
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)info.st_size;
+  //zeroed pages a byte longer than the file, with the file mapped over the start.
+  //the rest of the file's last page reads as zero too, so the text always ends
+  //in a terminator, and the scanner's 16 byte reads stay inside mapped pages
+  size_t mapped = (size / (size_t)page + 1) * (size_t)page;
+  char* text = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(text == MAP_FAILED){
+    close(fd);
+    return false;
+  }
+  if(size > 0 && mmap(text, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED){
+    munmap(text, mapped);
+    close(fd);
+    return false;
+  }
+  close(fd);
+  //one pass front to back: read ahead further and let pages go once scanned
+  madvise(text, mapped, MADV_SEQUENTIAL);
+  source->text = text;
+  source->size = size;
+  source->mapped = mapped;
+  return true;
+}
 
-  free(source);
+//falls back to reading what can't be mapped, such as a pipe
+static bool open_source(const char* path, Source* source){
+  if(map_source(path, source)) return true;
+  source->mapped = 0;
+  source->text = try_read_file(path, &source->size);
+  return source->text != NULL;
+}
+
+static void close_source(Source* source){
+  if(source->mapped != 0){
+    munmap(source->text, source->mapped);
+  }else{
+    free(source->text);
+  }
+  source->text = NULL;
+}
 
+//fnv-1a over the source and the back end it's compiled for, keys the compile cache
+static uint64_t hash_source(const char* source, size_t length, RotoBackend backend){
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 1099511628211ULL;
+  }
+  hash ^= (uint8_t)backend;
+  hash *= 1099511628211ULL;
+  return hash;
+}
+
+//create path and any missing parents. false when it still isn't there
+static bool make_dirs(char* path){
+  for (char* c = path + 1; *c != '\0'; c++) {
+    if(*c != '/') continue;
+    *c = '\0';
+    mkdir(path, 0777);
+    *c = '/';
+  }
+  struct stat info;
+  mkdir(path, 0777);
+  return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+//compiled scripts are cached in $ROTO_CACHE_DIR, else $XDG_CACHE_HOME/roto,
+//else ~/.cache/roto, one file per source hash. an empty ROTO_CACHE_DIR turns it off
+static bool cache_path(char* path, size_t size, uint64_t hash){
+  char dir[4096];
+  const char* env = getenv("ROTO_CACHE_DIR");
+  int length;
+  if(env != NULL){
+    if(env[0] == '\0') return false;
+    length = snprintf(dir, sizeof(dir), "%s", env);
+  }else if((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0'){
+    length = snprintf(dir, sizeof(dir), "%s/roto", env);
+  }else if((env = getenv("HOME")) != NULL && env[0] != '\0'){
+    length = snprintf(dir, sizeof(dir), "%s/.cache/roto", env);
+  }else{
+    return false;
+  }
+  if(length < 0 || (size_t)length >= sizeof(dir) || !make_dirs(dir)) return false;
+  length = snprintf(path, size, "%s/%016" PRIx64 ".rtc", dir, hash);
+  return length > 0 && (size_t)length < size;
+}
+
+//the cached compile of the source with this hash, NULL when there's no usable one
+static ObjFunction* load_cached(RotoVM* vm, const char* path, uint64_t hash){
+  size_t size;
+  char* data = try_read_file(path, &size);
+  if(data == NULL) return NULL;
+  uint64_t cached_hash;
+  ObjFunction* function = read_bytecode(vm, (uint8_t*)data, size, &cached_hash);
+  free(data);
+  if(function == NULL || cached_hash != hash) return NULL;
+  return function;
+}
+
+//written beside the final name and renamed over it, so a reader never sees half a file.
+//failing to cache isn't an error, the script still runs
+static void store_cached(RotoVM* vm, ObjFunction* function, const char* path, uint64_t hash){
+  char temp[4200];
+  int length = snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+  if(length < 0 || (size_t)length >= sizeof(temp)) return;
+  FILE* file = fopen(temp, "wb");
+  if(file == NULL) return;
+  bool ok = write_bytecode(vm, function, hash, file);
+  if(fclose(file) != 0) ok = false;
+  if(!ok || rename(temp, path) != 0) remove(temp);
+}
+
+//0 once out is written, else the exit status to report
+static int compile_file(RotoVM* vm, const char* path, const char* out){
+  Source source;
+  if(!open_source(path, &source)){
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    return 74;
+  }
+  ObjFunction* function = source.mapped != 0 ? compile_mapped(vm, source.text) : compile(vm, source.text);
+  if(function == NULL){
+    close_source(&source);
+    return 65;
+  }
+
+  FILE* file = fopen(out, "wb");
+  bool ok = file != NULL && write_bytecode(vm, function, hash_source(source.text, source.size, vm->backend), file);
+  if(file != NULL && fclose(file) != 0) ok = false;
+  close_source(&source);
+  if(!ok){
+    fprintf(stderr, "Could not write bytecode to \"%s\".\n", out);
+    return 74;
+  }
+  return 0;
+}
+
+//runs bytecode files as they are. source goes through the compile cache when use_cache is set
+static void run_file(RotoVM* vm,const char* path, bool use_cache){
+  Source source;
+  if(!open_source(path, &source)){
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+  }
+  ObjFunction* function = NULL;
+
+  if(is_bytecode((uint8_t*)source.text, source.size)){
+    uint64_t hash;
+    function = read_bytecode(vm, (uint8_t*)source.text, source.size, &hash);
+    if(function == NULL){
+      fprintf(stderr, "\"%s\" is corrupt or was compiled by another version.\n", path);
+      exit(65);
+    }
+  }else{
+    char cache[4096];
+    uint64_t hash = 0;
+    bool cached = false;
+    //hashing reads the whole file before anything compiles, so only when the cache is on
+    if(use_cache){
+      hash = hash_source(source.text, source.size, vm->backend);
+      cached = cache_path(cache, sizeof(cache), hash);
+    }
+    if(cached) function = load_cached(vm, cache, hash);
+    if(function == NULL){
+      function = source.mapped != 0 ? compile_mapped(vm, source.text) : compile(vm, source.text);
+      if(function == NULL) exit(65);
+      if(cached) store_cached(vm, function, cache, hash);
+    }
+  }
+  //the compiled code copied out every string and name it needs
+  close_source(&source);
+
+  InterpretResult result = interpret_function(vm, function);
   if(result == INTERPRET_COMPILE_ERROR) exit(65);
   if(result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
+
+//script.rt compiles to script.rtc, anything else gets .rtc added
+static char* bytecode_path(const char* path){
+  size_t length = strlen(path);
+  char* out = (char*)malloc(length + 5);
+  if(out == NULL) exit(74);
+  memcpy(out, path, length + 1);
+  if(length > 3 && strcmp(path + length - 3, ".rt") == 0){
+    strcat(out, "c");
+  }else{
+    strcat(out, ".rtc");
+  }
+  return out;
+}
+
 static void* reallocate(void* memory, size_t old_size, size_t new_size){
 
     return realloc(memory, new_size);
 }
 
+//files for --compile-all, handed out one at a time to whichever worker is free
+typedef struct{
+  char** paths;
+  int count;
+  int next;
+  RotoBackend backend;
+  int status;//highest exit status of any file so far
+  pthread_mutex_t lock;
+}CompileBatch;
+
+static void* compile_worker(void* arg){
+  CompileBatch* batch = (CompileBatch*)arg;
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    int index = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if(index >= batch->count) break;
+
+    //a vm per file, so each output only names the globals and methods its own script uses
+    RotoVM* vm = init_vm(reallocate);
+    set_backend(vm, batch->backend);
+    char* out = bytecode_path(batch->paths[index]);
+    int status = compile_file(vm, batch->paths[index], out);
+    free(out);
+    free_vm(vm);
+
+    pthread_mutex_lock(&batch->lock);
+    if(status > batch->status) batch->status = status;
+    pthread_mutex_unlock(&batch->lock);
+  }
+  return NULL;
+}
+
+//compiles every path to its .rtc on jobs threads. a failed file doesn't stop
+//the rest, its status is what's returned
+static int compile_all(char** paths, int count, int jobs, RotoBackend backend){
+  CompileBatch batch;
+  batch.paths = paths;
+  batch.count = count;
+  batch.next = 0;
+  batch.backend = backend;
+  batch.status = 0;
+  pthread_mutex_init(&batch.lock, NULL);
+
+  //the calling thread is one of the jobs
+  int threads = (jobs < count ? jobs : count) - 1;
+  pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * (threads > 0 ? threads : 1));
+  if(workers == NULL) exit(74);
+  int started = 0;
+  for (; started < threads; started++) {
+    if(pthread_create(&workers[started], NULL, compile_worker, &batch) != 0) break;
+  }
+  //a thread that fails to start only costs speed, this one works through the queue too
+  compile_worker(&batch);
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  pthread_mutex_destroy(&batch.lock);
+  return batch.status;
+}
+
+static void usage(void){
+  fprintf(stderr, "Usage: croto [--stack|--register] [--no-cache] [--lazy] [--nursery kb]\n"
+                  "             [--gc-slice work] [--gc-threads n] [--gc-stats]\n"
+                  "             [--image path] [--save-image path] [path]\n"
+                  "       croto [--stack|--register] --compile path [out]\n"
+                  "       croto [--stack|--register] [--jobs n] --compile-all path...\n");
+  exit(64);
+}
+
+//vm to run in: a fresh one, or the heap saved in image_path
+static RotoVM* start_vm(const char* image_path){
+  if(image_path == NULL) return init_vm(reallocate);
+  size_t size;
+  char* image = read_file(image_path, &size);
+  RotoVM* vm = init_vm_image(reallocate, image, size);
+  free(image);
+  if(vm == NULL){
+    fprintf(stderr, "\"%s\" is corrupt or was saved by another version.\n", image_path);
+    exit(65);
+  }
+  return vm;
+}
+
 int main(int argc, char **argv){
-  RotoVM* vm =  init_vm(reallocate);
-  Chunk ch;
-  init_chunk(&ch);
-
-  if(argc == 1){
-    repl(vm);
-  }else if(argc == 2){
-    run_file(vm,argv[1]);
+  //options come before the script path
+  int arg = 1;
+  bool use_cache = true;
+  bool lazy = false;
+  bool compile_only = false;
+  bool compile_many = false;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  bool set = false;
+  RotoBackend backend = BACKEND_STACK;
+  const char* image_path = NULL;
+  const char* save_path = NULL;
+  long nursery = -1;
+  long slice = 0;
+  long gc_threads = 1;
+  bool print_gc = false;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if(strcmp(argv[arg], "--register") == 0){
+      backend = BACKEND_REGISTER;
+      set = true;
+    }else if(strcmp(argv[arg], "--stack") == 0){
+      backend = BACKEND_STACK;
+      set = true;
+    }else if(strcmp(argv[arg], "--no-cache") == 0){
+      use_cache = false;
+    }else if(strcmp(argv[arg], "--lazy") == 0){
+      //a cached compile has every body in it, which is what lazy is avoiding
+      lazy = true;
+      use_cache = false;
+    }else if(strcmp(argv[arg], "--compile") == 0){
+      compile_only = true;
+    }else if(strcmp(argv[arg], "--compile-all") == 0){
+      compile_many = true;
+    }else if(strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc){
+      jobs = strtol(argv[++arg], NULL, 10);
+      if(jobs < 1) usage();
+    }else if(strcmp(argv[arg], "--nursery") == 0 && arg + 1 < argc){
+      nursery = strtol(argv[++arg], NULL, 10);
+      if(nursery < 0) usage();
+    }else if(strcmp(argv[arg], "--gc-slice") == 0 && arg + 1 < argc){
+      slice = strtol(argv[++arg], NULL, 10);
+      if(slice < 0 || slice > INT_MAX) usage();
+    }else if(strcmp(argv[arg], "--gc-threads") == 0 && arg + 1 < argc){
+      gc_threads = strtol(argv[++arg], NULL, 10);
+      if(gc_threads < 1 || gc_threads > 1024) usage();
+    }else if(strcmp(argv[arg], "--gc-stats") == 0){
+      print_gc = true;
+    }else if(strcmp(argv[arg], "--image") == 0 && arg + 1 < argc){
+      image_path = argv[++arg];
+    }else if(strcmp(argv[arg], "--save-image") == 0 && arg + 1 < argc){
+      save_path = argv[++arg];
+    }else{
+      usage();
+    }
+  }
+
+  if(compile_many){
+    if(argc == arg || image_path != NULL || save_path != NULL) usage();
+    if(jobs < 1) jobs = 1;
+    return compile_all(argv + arg, argc - arg, (int)jobs, backend);
+  }
+
+  RotoVM* vm = start_vm(image_path);
+  //an image keeps the back end it was saved with unless told otherwise
+  if(set) set_backend(vm, backend);
+  set_lazy_bodies(vm, lazy);
+  if(nursery >= 0) set_nursery_size(vm, (size_t)nursery * 1024);
+  set_gc_slice(vm, (int)slice);
+  set_gc_threads(vm, (int)gc_threads);
+
+  if(compile_only){
+    if(argc != arg + 1 && argc != arg + 2) usage();
+    char* out = argc == arg + 2 ? NULL : bytecode_path(argv[arg]);
+    int status = compile_file(vm, argv[arg], out != NULL ? out : argv[arg + 1]);
+    free(out);
+    if(status != 0) exit(status);
+  }else if(argc == arg){
+    //with an image to save there's nothing to run, it's saved as loaded
+    if(save_path == NULL) repl(vm);
+  }else if(argc == arg + 1){
+    run_file(vm,argv[arg], use_cache);
   }else{
-    fprintf(stderr, "Usage: croto [path]\n");
-    exit(64);
+    usage();
+  }
+
+  if(save_path != NULL && !save_vm_image(vm, save_path)){
+    fprintf(stderr, "Could not save the heap image to \"%s\".\n", save_path);
+    exit(74);
+  }
+  if(print_gc){
+    RotoGcStats stats = gc_stats(vm);
+    fprintf(stderr, "gc: %d minor and %d major collections, %.3f ms in all, %.3f ms marking, longest pause %.3f ms\n",
+            stats.minor_collections, stats.major_collections,
+            stats.seconds * 1000, stats.marking * 1000, stats.longest_pause * 1000);
+    //ru_maxrss is in kilobytes on linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "memory: %zu kb of heap pages at the end, peak rss %ld kb\n",
+            stats.heap_bytes / 1024, usage.ru_maxrss);
   }
   free_vm(vm);
-  // free_chunk(&ch);
 
   return 0;
 }
@@ -1,4 +1,9 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
@@ -12,6 +17,11 @@
 
 //tune this later
 #define GC_HEAP_GROW_FACTOR 2
+//young objects start on 8 byte boundaries, so the nursery can be walked
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+//room kept above the limit for what is allocated between the limit being
+//passed and the interpreter reaching a safepoint
+#define NURSERY_HEADROOM(size) ((size) / 8)
 
 /*
  * Start off with all objects white.
@@ -19,17 +29,17 @@
  * As long as there are still gray objects:
     - Pick a gray object. Turn any white objects that the object mentions to gray.
     - Mark the original gray object black.
+ * Free the objects still white.
+ * An incremental collection traces and frees a slice at a time between the
+ * script's allocations, with write_barrier keeping it from missing anything.
  */
 
+static void pace_collection(RotoVM* vm, size_t size);
+
 void *reallocate(RotoVM* vm, void* prev, size_t old_size, size_t new_size){
     vm->bytes_alocated += new_size - old_size;
-    if (new_size > old_size){
-#ifdef DEBUG_STRESS_GC
-        collect_garbage();
-#endif
-        if (vm->bytes_alocated > vm->next_gc){
-            collect_garbage(vm);
-        }
+    if (new_size > old_size && !vm->gc_paused){
+        pace_collection(vm, new_size - old_size);
     }
   if(new_size == 0){
     free(prev);
@@ -38,9 +48,25 @@ void *reallocate(RotoVM* vm, void* prev, size_t old_size, size_t new_size){
   return realloc(prev, new_size);
 }
 
-void mark_object(RotoVM* vm,Obj* object){
+static void push_gray(GrayStack* gray, Obj* object){
+    if(gray->capacity < gray->count + 1){
+        gray->capacity = GROW_CAPACITY(gray->capacity);
+        gray->stack = realloc(gray->stack,sizeof(Obj*) * gray->capacity);
+        if (gray->stack == NULL) exit(1);
+    }
+    gray->stack[gray->count++] = object;
+}
+
+//marks object and pushes it to be traced, unless it's marked already. with
+//other threads marking, only the one whose exchange sets the mark pushes it
+static void gray_object(GrayStack* gray, Obj* object){
     if (object == NULL) return;
-    if(object->is_marked) return;
+    if(__atomic_load_n(&object->is_marked, __ATOMIC_RELAXED)) return;
+    if(gray->shared){
+        if(__atomic_exchange_n(&object->is_marked, true, __ATOMIC_RELAXED)) return;
+    }else{
+        object->is_marked = true;
+    }
 #ifdef DEBUG_LOG_GC
     //for readability
 //    printf("\x1B[31m");
@@ -52,26 +78,35 @@ void mark_object(RotoVM* vm,Obj* object){
 
     printf(_RESET);
 #endif
-    object->is_marked = true;
-    if(vm->gray_capacity < vm->gray_count + 1){
-        vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
-        vm->gray_stack = realloc(vm->gray_stack,sizeof(Obj*) * vm->gray_capacity);
-        if (vm->gray_stack == NULL) exit(1);
-    }
-
-    vm->gray_stack[vm->gray_count++] = object;
+    push_gray(gray, object);
 }
 
-void mark_value(RotoVM* vm,Value value){
+static void gray_value(GrayStack* gray, Value value){
     if(!IS_OBJ(value)) return;
-    mark_object(vm,AS_OBJ(value));
+    gray_object(gray, AS_OBJ(value));
 }
-static void mark_array(RotoVM* vm,ValueArray* array){
+static void gray_array(GrayStack* gray, ValueArray* array){
     for (int i = 0; i < array->count; i++) {
-        mark_value(vm,array->values[i]);
+        gray_value(gray, array->values[i]);
     }
 }
-static void blacken_object(RotoVM* vm,Obj* object){
+static void gray_table(GrayStack* gray, Table* table){
+    for (int i = 0; i <= table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        gray_object(gray, (Obj*)entry->key);
+        gray_value(gray, entry->value);
+    }
+}
+
+void mark_object(RotoVM* vm,Obj* object){
+    gray_object(&vm->gray, object);
+}
+
+void mark_value(RotoVM* vm,Value value){
+    gray_value(&vm->gray, value);
+}
+//returns the work it took: one for the object and one for each reference in it
+static long blacken_object(GrayStack* gray, Obj* object){
 #ifdef DEBUG_LOG_GC
     __print_with_color(_YELLOW, "%p blacken ", (void*)object);
     print_value(OBJ_VAL(object));
@@ -82,188 +117,789 @@ static void blacken_object(RotoVM* vm,Obj* object){
         case OBJ_LIST:{
             ObjList* list = (ObjList*)object;
             for (int i = 0; i < list->values.count; i++) {
-                mark_value(vm,list->values.values[i]);
+                gray_value(gray, list->values.values[i]);
             }
-            break;
+            return 1 + list->values.count;
         }
 
         case OBJ_BOUND_METHOD:{
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            mark_value(vm,bound->receiver);
-            mark_object(vm,(Obj*)bound->method);
-            break;
+            gray_value(gray, bound->receiver);
+            gray_object(gray, (Obj*)bound->method);
+            return 3;
         }
         case OBJ_CLASS:{
             ObjClass* klass = (ObjClass*)object;
-            mark_object(vm,(Obj*)klass->name);
-            mark_table(vm,&klass->methods);
-            break;
+            gray_object(gray, (Obj*)klass->name);
+            gray_array(gray, &klass->methods);
+            gray_value(gray, klass->initializer);
+            gray_object(gray, (Obj*)klass->shape);
+            return 4 + klass->methods.count;
         }
         case OBJ_CLOSURE:{
             ObjClosure* closure = (ObjClosure*)object;
-            mark_object(vm,(Obj*)closure->function);
+            gray_object(gray, (Obj*)closure->function);
             for (int i = 0; i < closure->upvalue_count; i++) {
-                mark_object(vm,(Obj*)closure->upvalues[i]);
+                gray_object(gray, (Obj*)closure->upvalues[i]);
             }
-            break;
+            return 2 + closure->upvalue_count;
         }
         case OBJ_FUNCTION:{
             ObjFunction* function = (ObjFunction*)object;
-            mark_object(vm,(Obj*)function->name);
-            mark_array(vm,&function->chunk.constants);
-            break;
+            gray_object(gray, (Obj*)function->name);
+            gray_object(gray, (Obj*)function->source);
+            if(function->upvalue_names != NULL){
+                for(int i = 0; i < function->upvalue_count; i++){
+                    gray_object(gray, (Obj*)function->upvalue_names[i]);
+                }
+            }
+            gray_array(gray, &function->chunk.constants);
+            for(int i = 0; i < function->chunk.cache_count; i++){
+                for(int way = 0; way < CACHE_WAYS; way++){
+                    CacheWay* cached = &function->chunk.caches[i].ways[way];
+                    gray_object(gray, cached->key);
+                    gray_object(gray, cached->transition);
+                    gray_value(gray, cached->method);
+                }
+            }
+            return 3 + function->upvalue_count + function->chunk.constants.count +
+                   function->chunk.cache_count * CACHE_WAYS;
         }
         case OBJ_INSTANCE:{
             ObjInstance* instance = (ObjInstance*)object;
-            mark_object(vm,(Obj*)instance->klass);
-            mark_table(vm,&instance->fields);
-            break;
+            gray_object(gray, (Obj*)instance->klass);
+            gray_object(gray, (Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->field_count; i++) {
+                gray_value(gray, instance->fields[i]);
+            }
+            return 3 + instance->shape->field_count;
+        }
+        case OBJ_SHAPE:{
+            ObjShape* shape = (ObjShape*)object;
+            gray_table(gray, &shape->slots);
+            gray_table(gray, &shape->transitions);
+            return 1 + shape->slots.capacity + shape->transitions.capacity;
         }
         case OBJ_UPVALUE:
-            mark_value(vm,((ObjUpvalue*)object)->closed);
-            break;
+            gray_value(gray, ((ObjUpvalue*)object)->closed);
+            return 2;
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
     }
+    return 1;
 }
 
-static void free_object(RotoVM* vm,Obj *object) {
-#ifdef DEBUG_LOG_GC
-//    printf("\x1B[34m");
-//    printf("%p free type %d\n", (void*)object,object->type);
-
-    __print_with_color(_BLUE, "%p free type %d\n", (void*)object,object->type);
-    printf(_RESET);
-#endif
+//what an object owns outside its own slot. the slot goes back to its pool
+//page, or with the nursery when the object is young
+static void release_object(RotoVM* vm,Obj *object) {
   switch (object->type) {
-      case OBJ_LIST:{
-          ObjList* list = (ObjList*)object;
-          free_val_array(vm,&list->values);
-          FREE(vm, ObjList, object);
-          break;
-      }
-      case OBJ_BOUND_METHOD:
-          FREE(vm,ObjBoundMethod, object);
+      case OBJ_LIST:
+          free_val_array(vm,&((ObjList*)object)->values);
           break;
-
-      case OBJ_CLASS:{
-          ObjClass* klass = (ObjClass*)object;
-          free_table(vm,&klass->methods);
-          FREE(vm,ObjClass, object);
+      case OBJ_CLASS:
+          free_val_array(vm,&((ObjClass*)object)->methods);
           break;
-      }
       case OBJ_CLOSURE:{
           ObjClosure* closure = (ObjClosure*)object;
           FREE_ARRAY(vm,ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-          FREE(vm,ObjClosure, object);
           break;
       }
       case OBJ_FUNCTION:{
           ObjFunction* function = (ObjFunction*)object;
           free_chunk(vm,&function->chunk);
-          FREE(vm,ObjFunction, object);
+          if(function->upvalue_names != NULL){
+              FREE_ARRAY(vm,ObjString*, function->upvalue_names, function->upvalue_count);
+          }
           break;
       }
       case OBJ_INSTANCE:{
           ObjInstance* instance = (ObjInstance*)object;
-          free_table(vm,&instance->fields);
-          FREE(vm,ObjInstance, object);
+          if(instance->fields != instance->inline_fields){
+              FREE_ARRAY(vm,Value, instance->fields, instance->field_capacity);
+          }
           break;
       }
-      case OBJ_NATIVE:{
-          FREE(vm,ObjNative,object);
+      case OBJ_SHAPE:{
+          ObjShape* shape = (ObjShape*)object;
+          free_table(vm,&shape->slots);
+          free_table(vm,&shape->transitions);
           break;
       }
     case OBJ_STRING:{
       ObjString* string = (ObjString*)object;
       FREE_ARRAY(vm,char, string->chars, string->length + 1);
-      FREE(vm,ObjString, object);
       break;
     }
+      case OBJ_BOUND_METHOD:
+      case OBJ_NATIVE:
       case OBJ_UPVALUE:
-          FREE(vm,ObjUpvalue, object);
           break;
   }
 }
 
+//the sweep's release for a dead old object
+static void free_object(void* context, Obj* object){
+    RotoVM* vm = (RotoVM*)context;
+#ifdef DEBUG_LOG_GC
+    __print_with_color(_BLUE, "%p free type %d\n", (void*)object,object->type);
+    printf(_RESET);
+#endif
+    release_object(vm, object);
+    vm->bytes_alocated -= pool_slot_size(object);
+}
+
+static double gc_clock(void){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void record_pause(RotoVM* vm, double start){
+    double pause = gc_clock() - start;
+    vm->gc_stats.seconds += pause;
+    if(pause > vm->gc_stats.longest_pause) vm->gc_stats.longest_pause = pause;
+}
+
+//bytes the object was allocated with, for the types that can be young
+static size_t young_object_size(Obj* object){
+    switch (object->type) {
+        case OBJ_LIST: return sizeof(ObjList);
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)object)->inline_capacity;
+        case OBJ_STRING: return sizeof(ObjString);
+        default: return 0;
+    }
+}
+
+//the short lived kinds: concatenation results, bound methods, temporary lists
+//and instances. functions, classes, closures and the rest stay put for good,
+//so code and frames never see an object move
+Obj* allocate_young(RotoVM* vm, size_t size, ObjType type){
+    if(type != OBJ_STRING && type != OBJ_LIST && type != OBJ_BOUND_METHOD && type != OBJ_INSTANCE){
+        return NULL;
+    }
+    //what the compiler, the loaders and the vm's setup make lives as long as
+    //the code does, and only a running script's stores are barriered
+    if(vm->nursery == NULL || vm->frameCount == 0 || vm->parser != NULL || vm->gc_paused){
+        return NULL;
+    }
+    //counts toward an incremental collection's pace like any other allocation
+    pace_collection(vm, size);
+    size = NURSERY_ALIGN(size);
+    if(size > (size_t)(vm->nursery_end - vm->nursery_top)){
+        //full up, a minor collection is due at the next safepoint
+        vm->nursery_limit = vm->nursery;
+        return NULL;
+    }
+    Obj* object = (Obj*)vm->nursery_top;
+    vm->nursery_top += size;
+    object->type = type;
+    object->is_marked = false;
+    object->is_remembered = false;
+    object->next = NULL;
+    return object;
+}
+
+//a slot counts toward the collection's pace at its full size
+static Obj* allocate_slot(RotoVM* vm, size_t size){
+    size_t slot = POOL_SLOT_SIZE(size);
+    vm->bytes_alocated += slot;
+    if(!vm->gc_paused) pace_collection(vm, slot);
+    Obj* object = pool_allocate(&vm->pool, size);
+    if(object == NULL) exit(1);
+    return object;
+}
+
+//old objects made while marking start out gray, so their contents get traced
+//without barriers on every constructor. one made while sweeping is marked if
+//its page is still to be swept, else the sweep would take it for garbage
+static void color_new_object(RotoVM* vm, Obj* object){
+    object->is_marked = false;
+    if(vm->gc_phase == GC_MARKING){
+        mark_object(vm, object);
+    }else if(vm->gc_phase == GC_SWEEPING && pool_unswept(&vm->pool, object)){
+        object->is_marked = true;
+    }
+}
+
+Obj* allocate_old(RotoVM* vm, size_t size, ObjType type){
+    Obj* object = allocate_slot(vm, size);
+    object->type = type;
+    object->is_remembered = false;
+    object->next = NULL;
+    color_new_object(vm, object);
+    return object;
+}
+
+void remember_object(RotoVM* vm, Obj* object){
+    if(vm->remembered_capacity < vm->remembered_count + 1){
+        vm->remembered_capacity = GROW_CAPACITY(vm->remembered_capacity);
+        vm->remembered = realloc(vm->remembered, sizeof(Obj*) * vm->remembered_capacity);
+        if (vm->remembered == NULL) exit(1);
+    }
+    object->is_remembered = true;
+    vm->remembered[vm->remembered_count++] = object;
+}
+
+#define FOR_EACH_YOUNG(vm, object)\
+        for (Obj* object = (Obj*)(vm)->nursery; (uint8_t*)object < (vm)->nursery_top;\
+             object = (Obj*)((uint8_t*)object + NURSERY_ALIGN(young_object_size(object))))
+
+//a minor collection copies the young objects reachable from the roots and the
+//remembered set out to the old heap. moved objects wait on unscanned, linked
+//through next, until their own fields have been moved along
+typedef struct{
+    RotoVM* vm;
+    Obj* unscanned;
+}Evacuation;
+
+static Obj* evacuate(Evacuation* evacuation, Obj* object){
+    RotoVM* vm = evacuation->vm;
+    if(object == NULL || !is_young(vm, object)) return object;
+    if(object->next != NULL) return object->next;
+
+    size_t size = young_object_size(object);
+    Obj* moved = allocate_slot(vm, size);
+    memcpy(moved, object, size);
+    //it's gray if marking is under way: it might have been traced already,
+    //but its fields were young ones
+    color_new_object(vm, moved);
+    if(object->type == OBJ_INSTANCE){
+        ObjInstance* instance = (ObjInstance*)moved;
+        if(((ObjInstance*)object)->fields == ((ObjInstance*)object)->inline_fields){
+            instance->fields = instance->inline_fields;
+        }
+    }
+    object->next = moved;
+    moved->next = evacuation->unscanned;
+    evacuation->unscanned = moved;
+    return moved;
+}
+
+static void evacuate_value(Evacuation* evacuation, Value* value){
+    if(IS_OBJ(*value)) *value = OBJ_VAL(evacuate(evacuation, AS_OBJ(*value)));
+}
+
+static void evacuate_array(Evacuation* evacuation, ValueArray* array){
+    for (int i = 0; i < array->count; i++) {
+        evacuate_value(evacuation, &array->values[i]);
+    }
+}
+
+//keys keep their entries: a moved string hashes the same
+static void evacuate_table(Evacuation* evacuation, Table* table){
+    for (int i = 0; i <= table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        entry->key = (ObjString*)evacuate(evacuation, (Obj*)entry->key);
+        evacuate_value(evacuation, &entry->value);
+    }
+}
+
+//only fields that can hold a young object: closures, functions, upvalues,
+//shapes and classes are never young
+static void evacuate_fields(Evacuation* evacuation, Obj* object){
+    switch (object->type) {
+        case OBJ_LIST:
+            evacuate_array(evacuation, &((ObjList*)object)->values);
+            break;
+        case OBJ_BOUND_METHOD:
+            evacuate_value(evacuation, &((ObjBoundMethod*)object)->receiver);
+            break;
+        case OBJ_CLASS:{
+            ObjClass* klass = (ObjClass*)object;
+            klass->name = (ObjString*)evacuate(evacuation, (Obj*)klass->name);
+            evacuate_array(evacuation, &klass->methods);
+            evacuate_value(evacuation, &klass->initializer);
+            break;
+        }
+        case OBJ_FUNCTION:{
+            ObjFunction* function = (ObjFunction*)object;
+            function->name = (ObjString*)evacuate(evacuation, (Obj*)function->name);
+            function->source = (ObjString*)evacuate(evacuation, (Obj*)function->source);
+            if(function->upvalue_names != NULL){
+                for(int i = 0; i < function->upvalue_count; i++){
+                    function->upvalue_names[i] =
+                            (ObjString*)evacuate(evacuation, (Obj*)function->upvalue_names[i]);
+                }
+            }
+            evacuate_array(evacuation, &function->chunk.constants);
+            break;
+        }
+        case OBJ_INSTANCE:{
+            ObjInstance* instance = (ObjInstance*)object;
+            for (int i = 0; i < instance->shape->field_count; i++) {
+                evacuate_value(evacuation, &instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE:{
+            ObjShape* shape = (ObjShape*)object;
+            evacuate_table(evacuation, &shape->slots);
+            evacuate_table(evacuation, &shape->transitions);
+            break;
+        }
+        case OBJ_UPVALUE:
+            evacuate_value(evacuation, &((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_CLOSURE:
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+//the same roots a full collection marks, less the ones that are never young
+static void evacuate_roots(Evacuation* evacuation){
+    RotoVM* vm = evacuation->vm;
+    for(Value* slot = vm->stack; slot < vm->stack_top; slot++){
+        evacuate_value(evacuation, slot);
+    }
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame* frame = &vm->frames[i];
+        ObjFunction* function = frame->closure->function;
+        if (function->registers){
+            for (Value* slot = frame->slots; slot < frame->slots + function->max_slots; slot++) {
+                evacuate_value(evacuation, slot);
+            }
+        }
+    }
+    evacuate_table(evacuation, &vm->global_slots);
+    evacuate_array(evacuation, &vm->global_values);
+    evacuate_array(evacuation, &vm->global_names);
+    evacuate_table(evacuation, &vm->method_symbols);
+    evacuate_array(evacuation, &vm->method_names);
+    evacuate_table(evacuation, &vm->listMethods);
+    vm->init_string = (ObjString*)evacuate(evacuation, (Obj*)vm->init_string);
+    for (int i = 0; i < vm->remembered_count; i++) {
+        Obj* object = vm->remembered[i];
+        object->is_remembered = false;
+        evacuate_fields(evacuation, object);
+    }
+    vm->remembered_count = 0;
+}
+
+void collect_young(RotoVM* vm){
+    if(vm->nursery == NULL || vm->nursery_top == vm->nursery) return;
+    double start = gc_clock();
+    //copying out allocates, and a full collection halfway through would find
+    //the heap in pieces
+    bool paused = vm->gc_paused;
+    vm->gc_paused = true;
+
+    //gray young objects are about to move or die. what moves is grayed again
+    //as it's copied, if marking is under way
+    int gray = 0;
+    for (int i = 0; i < vm->gray.count; i++) {
+        if(!is_young(vm, vm->gray.stack[i])) vm->gray.stack[gray++] = vm->gray.stack[i];
+    }
+    vm->gray.count = gray;
+    if(vm->gray_list != NULL && is_young(vm, (Obj*)vm->gray_list)) vm->gray_list = NULL;
+
+    Evacuation evacuation;
+    evacuation.vm = vm;
+    evacuation.unscanned = NULL;
+    evacuate_roots(&evacuation);
+    while (evacuation.unscanned != NULL) {
+        Obj* object = evacuation.unscanned;
+        evacuation.unscanned = object->next;
+        object->next = NULL;
+        evacuate_fields(&evacuation, object);
+    }
+
+    //the intern table holds its strings weakly: moved ones are re-keyed, the
+    //rest dropped along with everything else left behind
+    FOR_EACH_YOUNG(vm, object) {
+        if(object->next != NULL){
+            if(object->type == OBJ_STRING){
+                Entry* entry = table_find(&vm->strings, (ObjString*)object);
+                if(entry != NULL) entry->key = (ObjString*)object->next;
+            }
+        }else{
+            if(object->type == OBJ_STRING) table_delete(&vm->strings, (ObjString*)object);
+            release_object(vm, object);
+        }
+    }
+    vm->nursery_top = vm->nursery;
+    vm->nursery_limit = vm->nursery_end - NURSERY_HEADROOM(vm->nursery_end - vm->nursery);
+
+    vm->gc_paused = paused;
+    vm->gc_stats.minor_collections++;
+    record_pause(vm, start);
+    //what was moved out counts as allocated old
+    if(!paused) pace_collection(vm, 0);
+}
+
+void set_nursery_size(RotoVM* vm, size_t size){
+    collect_young(vm);
+    free(vm->nursery);
+    vm->nursery = NULL;
+    size = NURSERY_ALIGN(size);
+    if(size > 0){
+        vm->nursery = malloc(size);
+        if(vm->nursery == NULL) exit(1);
+    }
+    vm->nursery_top = vm->nursery;
+    vm->nursery_end = vm->nursery == NULL ? NULL : vm->nursery + size;
+    vm->nursery_limit = vm->nursery == NULL ? NULL : vm->nursery_end - NURSERY_HEADROOM(size);
+}
+
 static void mark_roots(RotoVM* vm){
     for(Value* slot = vm->stack; slot < vm->stack_top; slot++){
         mark_value(vm,*slot);
     }
     for (int i = 0; i < vm->frameCount; i++) {
-        mark_object(vm,(Obj*)vm->frames[i].closure);
+        CallFrame* frame = &vm->frames[i];
+        mark_object(vm,(Obj*)frame->closure);
+        //register code keeps values above sp, its whole frame stays live
+        ObjFunction* function = frame->closure->function;
+        if (function->registers){
+            for (Value* slot = frame->slots; slot < frame->slots + function->max_slots; slot++) {
+                mark_value(vm,*slot);
+            }
+        }
     }
     for (ObjUpvalue* upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
         mark_object(vm,(Obj*)upvalue);
     }
-    mark_table(vm,&vm->globals);
+    mark_table(vm,&vm->global_slots);
+    gray_array(&vm->gray, &vm->global_values);
+    gray_array(&vm->gray, &vm->global_names);
+    mark_table(vm,&vm->method_symbols);
+    gray_array(&vm->gray, &vm->method_names);
+    mark_table(vm,&vm->listMethods);
     mark_compiler_roots(vm);
     mark_object(vm,(Obj*)vm->init_string);
 }
-static void trace_references(RotoVM* vm){
-    while (vm->gray_count > 0){
-        Obj* object = vm->gray_stack[--vm->gray_count];
-        blacken_object(vm,object);
-    }
-}
-static void sweep(RotoVM* vm){
-    Obj* previous = NULL;
-    Obj* object = vm->objects;
-    while(object != NULL){
-        if(object->is_marked){
-            object->is_marked = false;
-            previous = object;
-            object = object->next;
-        } else{
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL){
-                previous->next = object;
-            } else{
-                vm->objects = object;
+//traces gray objects until budget units of work are done or there are none
+//left, and returns what's left of budget. a list too long for what's left is
+//traced from the end down, a slice at a time: deleting from a list only moves
+//values down, onto what's still to trace
+static long trace_references(RotoVM* vm, long budget){
+    while (budget > 0){
+        if(vm->gray_list != NULL){
+            ObjList* list = vm->gray_list;
+            int next = vm->gray_list_next < list->values.count ? vm->gray_list_next : list->values.count;
+            int stop = next > budget ? next - (int)budget : 0;
+            budget -= next - stop;
+            while (next > stop) {
+                mark_value(vm,list->values.values[--next]);
             }
-            free_object(vm,unreached);
+            vm->gray_list_next = next;
+            if(next == 0) vm->gray_list = NULL;
+            continue;
         }
+        if(vm->gray.count == 0) break;
+        Obj* object = vm->gray.stack[--vm->gray.count];
+        if(object->type == OBJ_LIST && ((ObjList*)object)->values.count >= budget){
+            vm->gray_list = (ObjList*)object;
+            vm->gray_list_next = vm->gray_list->values.count;
+            budget--;
+            continue;
+        }
+        budget -= blacken_object(&vm->gray, object);
     }
+    return budget;
 }
-void free_objects(RotoVM* vm) {
-  /* code */
-  Obj* object = vm->objects;
 
-  while (object != NULL) {
-    Obj* next = object->next;
-    free_object(vm,object);
-    object = next;
-  }
-  free(vm->gray_stack);
+//parallel marking. each thread traces from a gray stack of its own and, when
+//that gets deep, moves the older half where the others can steal it. a thread
+//with nothing to trace or steal goes idle, and marking is over once all of
+//them are: only a thread that isn't idle can publish, and none goes idle
+//with work of its own published
+typedef struct{
+    GrayStack local;
+    pthread_mutex_t lock;
+    int published_count;//of published, under lock
+    int published_capacity;
+    Obj** published;
+    struct ParallelMark* mark;
+    int index;
+}MarkThread;
+
+typedef struct ParallelMark{
+    MarkThread* threads;
+    int count;
+    int idle;
+    int published;//objects waiting in any thread's published
+}ParallelMark;
+
+static void publish(MarkThread* thread){
+    GrayStack* local = &thread->local;
+    int moving = local->count / 2;
+    pthread_mutex_lock(&thread->lock);
+    if(thread->published_capacity < thread->published_count + moving){
+        thread->published_capacity = thread->published_count + moving;
+        thread->published = realloc(thread->published, sizeof(Obj*) * thread->published_capacity);
+        if(thread->published == NULL) exit(1);
+    }
+    memcpy(thread->published + thread->published_count, local->stack, sizeof(Obj*) * moving);
+    __atomic_store_n(&thread->published_count, thread->published_count + moving, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&thread->mark->published, moving, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&thread->lock);
+    local->count -= moving;
+    memmove(local->stack, local->stack + moving, sizeof(Obj*) * local->count);
 }
 
-void collect_garbage(RotoVM* vm){
+//half of what the first thread with anything published has, starting with
+//this one's own. false when there was none
+static bool steal(MarkThread* thread){
+    ParallelMark* mark = thread->mark;
+    for (int i = 0; i < mark->count; i++) {
+        MarkThread* victim = &mark->threads[(thread->index + i) % mark->count];
+        if(__atomic_load_n(&victim->published_count, __ATOMIC_RELAXED) == 0) continue;
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->published_count;
+        int taking = (left + 1) / 2;
+        for (int j = 0; j < taking; j++) {
+            push_gray(&thread->local, victim->published[--left]);
+        }
+        __atomic_store_n(&victim->published_count, left, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&mark->published, taking, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&victim->lock);
+        if(taking > 0) return true;
+    }
+    return false;
+}
+
+//deep enough a stack to be worth sharing
+#define PUBLISH_DEPTH 64
+
+static void* mark_thread(void* argument){
+    MarkThread* thread = (MarkThread*)argument;
+    ParallelMark* mark = thread->mark;
+    GrayStack* local = &thread->local;
+    for (;;) {
+        while (local->count > 0) {
+            blacken_object(local, local->stack[--local->count]);
+            if(local->count >= PUBLISH_DEPTH && __atomic_load_n(&mark->idle, __ATOMIC_RELAXED) > 0 &&
+               __atomic_load_n(&thread->published_count, __ATOMIC_RELAXED) == 0){
+                publish(thread);
+            }
+        }
+        if(steal(thread)) continue;
+        __atomic_add_fetch(&mark->idle, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if(__atomic_load_n(&mark->idle, __ATOMIC_SEQ_CST) == mark->count) return NULL;
+            if(__atomic_load_n(&mark->published, __ATOMIC_SEQ_CST) > 0){
+                __atomic_sub_fetch(&mark->idle, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+//the vm's gray objects, dealt out to gc_threads threads, the calling one included
+static void trace_parallel(RotoVM* vm){
+    ParallelMark mark;
+    mark.count = vm->gc_threads;
+    mark.idle = 0;
+    mark.published = 0;
+    mark.threads = calloc(mark.count, sizeof(MarkThread));
+    pthread_t* workers = malloc(sizeof(pthread_t) * mark.count);
+    if(mark.threads == NULL || workers == NULL) exit(1);
+    for (int i = 0; i < mark.count; i++) {
+        MarkThread* thread = &mark.threads[i];
+        thread->local.shared = true;
+        thread->mark = &mark;
+        thread->index = i;
+        pthread_mutex_init(&thread->lock, NULL);
+    }
+    for (int i = 0; i < vm->gray.count; i++) {
+        push_gray(&mark.threads[i % mark.count].local, vm->gray.stack[i]);
+    }
+    vm->gray.count = 0;
+
+    //a thread that can't be started leaves its share to the rest
+    int started = 1;
+    for (; started < mark.count; started++) {
+        if(pthread_create(&workers[started], NULL, mark_thread, &mark.threads[started]) != 0) break;
+    }
+    if(started < mark.count){
+        //the ones running count it as idle for good
+        __atomic_add_fetch(&mark.idle, mark.count - started, __ATOMIC_SEQ_CST);
+        for (int i = started; i < mark.count; i++) {
+            GrayStack* left = &mark.threads[i].local;
+            while (left->count > 0) push_gray(&mark.threads[0].local, left->stack[--left->count]);
+        }
+    }
+    mark_thread(&mark.threads[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (int i = 0; i < mark.count; i++) {
+        free(mark.threads[i].local.stack);
+        free(mark.threads[i].published);
+        pthread_mutex_destroy(&mark.threads[i].lock);
+    }
+    free(mark.threads);
+    free(workers);
+}
+
+//smaller heaps mark faster than threads start
+#ifndef PARALLEL_MARK_MIN
+#define PARALLEL_MARK_MIN (8 * 1024 * 1024)
+#endif
+
+//everything the gray objects reach, in one go
+static void trace_all(RotoVM* vm){
+    double start = gc_clock();
+    if(vm->gc_threads > 1 && vm->bytes_alocated >= PARALLEL_MARK_MIN){
+        //a list part traced by slices is finished off here, its values
+        //become ordinary gray objects
+        if(vm->gray_list != NULL){
+            for (int i = 0; i < vm->gray_list_next && i < vm->gray_list->values.count; i++) {
+                mark_value(vm, vm->gray_list->values.values[i]);
+            }
+            vm->gray_list = NULL;
+        }
+        trace_parallel(vm);
+    }else{
+        trace_references(vm, LONG_MAX);
+    }
+    vm->gc_stats.marking += gc_clock() - start;
+}
+
+//frees unmarked objects on the pages still to sweep and unmarks the rest,
+//about budget of them. true once every page has been swept
+static bool sweep(RotoVM* vm, long budget){
+    return pool_sweep(&vm->pool, &budget, free_object, vm);
+}
+
+//what's allocated from here on is either grayed at once or found through the
+//roots when marking finishes
+static void start_marking(RotoVM* vm){
 #ifdef DEBUG_LOG_GC
-//    printf("\x1B[32m");
-//    printf("-- gc begin\n");
     __print_with_color(_GREEN,"-- gc begin\n");
-    size_t before = vm.bytes_alocated;
     printf(_RESET);
-
 #endif
-    //mark
     mark_roots(vm);
-    //trace
-    trace_references(vm);
+    vm->gc_phase = GC_MARKING;
+    vm->gc_debt = 0;
+}
+
+//objects the lazy sweep after a stop-the-world mark goes through per slice
+#define LAZY_SWEEP_WORK 4096
+
+//the atomic end of marking. the roots are marked again for what the script
+//moved into them without a barrier, and what's white after that is garbage
+static void finish_marking(RotoVM* vm){
+    mark_roots(vm);
+    trace_all(vm);
 
     //weak references
     table_remove_white(&vm->strings);
-    //sweep
-    sweep(vm);
+    //remembered objects about to be freed
+    int kept = 0;
+    for (int i = 0; i < vm->remembered_count; i++) {
+        if(vm->remembered[i]->is_marked) vm->remembered[kept++] = vm->remembered[i];
+    }
+    vm->remembered_count = kept;
+    //young objects aren't in the pool, the nursery only loses its marks
+    FOR_EACH_YOUNG(vm, object) {
+        object->is_marked = false;
+    }
+    vm->gc_phase = GC_SWEEPING;
+    pool_start_sweep(&vm->pool);
+    vm->gc_stats.major_collections++;
+}
+
+static void finish_sweeping(RotoVM* vm){
+    vm->gc_phase = GC_IDLE;
+    //what's left is exact: the garbage has all been freed, and the bytes
+    //allocated since marking finished are live or to be seen by the next one
     vm->next_gc = vm->bytes_alocated * GC_HEAP_GROW_FACTOR;
 #ifdef DEBUG_LOG_GC
-//    printf("\x1B[32m");
-//    printf("-- gc end\n");
     __print_with_color(_GREEN,"-- gc end\n");
-    printf("    collected %zd bytes (from %zd to %zd) next at %zd\n",
-           before - vm.bytes_alocated, before, vm.bytes_alocated,vm.next_gc);
+    printf("    %zd bytes left, next at %zd\n", vm->bytes_alocated, vm->next_gc);
     printf(_RESET);
 #endif
 }
+
+//one bounded step of the collection under way: incremental marking or
+//sweeping, or the lazy sweep after a stop-the-world mark
+static void collect_slice(RotoVM* vm){
+    double start = gc_clock();
+    long budget = vm->gc_slice != 0 ? vm->gc_slice : LAZY_SWEEP_WORK;
+    //one falling behind the script's allocation takes bigger slices, another
+    //budget's worth for each quarter of next_gc the heap has grown past it
+    size_t over = vm->bytes_alocated > vm->next_gc ? vm->bytes_alocated - vm->next_gc : 0;
+    budget *= (long)(1 + over / (vm->next_gc / 4 + 1));
+    if(vm->gc_phase == GC_MARKING){
+        budget = trace_references(vm, budget);
+        vm->gc_stats.marking += gc_clock() - start;
+        if(vm->gray.count == 0 && vm->gray_list == NULL) finish_marking(vm);
+    }
+    if(vm->gc_phase == GC_SWEEPING && sweep(vm, budget)) finish_sweeping(vm);
+    record_pause(vm, start);
+}
+
+//called with each size bytes allocated: starts a collection once the heap has
+//grown enough, and keeps one going. without slices marking is done at once,
+//but the script carries on before the sweep, which follows its allocation
+static void pace_collection(RotoVM* vm, size_t size){
+    if(vm->gc_phase == GC_IDLE){
+#ifndef DEBUG_STRESS_GC
+        if(vm->bytes_alocated <= vm->next_gc) return;
+#endif
+        double start = gc_clock();
+        start_marking(vm);
+        if(vm->gc_slice == 0) finish_marking(vm);
+        record_pause(vm, start);
+        return;
+    }
+    vm->gc_debt += size;
+#ifndef DEBUG_STRESS_GC
+    if(vm->gc_debt < GC_SLICE_BYTES) return;
+#endif
+    vm->gc_debt = 0;
+    collect_slice(vm);
+}
+
+void free_objects(RotoVM* vm) {
+  for (Obj* object = pool_first(&vm->pool); object != NULL; object = pool_next(&vm->pool, object)) {
+    release_object(vm,object);
+  }
+  free_pool(&vm->pool);
+  FOR_EACH_YOUNG(vm, young) {
+    release_object(vm, young);
+  }
+  free(vm->nursery);
+  vm->nursery = NULL;
+  free(vm->remembered);
+  free(vm->gray.stack);
+}
+
+//the rest of the collection under way, in one go
+static void finish_collection(RotoVM* vm){
+    if(vm->gc_phase == GC_MARKING) finish_marking(vm);
+    if(vm->gc_phase == GC_SWEEPING){
+        sweep(vm, LONG_MAX);
+        finish_sweeping(vm);
+    }
+}
+
+//finishes the collection under way, if there is one, then does a whole one
+void collect_garbage(RotoVM* vm){
+    double start = gc_clock();
+    finish_collection(vm);
+    start_marking(vm);
+    finish_collection(vm);
+    record_pause(vm, start);
+}
+
+void set_gc_threads(RotoVM* vm, int threads){
+    vm->gc_threads = threads < 1 ? 1 : threads;
+}
+
+void set_gc_slice(RotoVM* vm, int work){
+    vm->gc_slice = work < 0 ? 0 : work;
+    //a sweep under way can go on lazily
+    if(vm->gc_slice == 0 && vm->gc_phase == GC_MARKING){
+        double start = gc_clock();
+        finish_marking(vm);
+        record_pause(vm, start);
+    }
+}
@@ -2,6 +2,8 @@
 #define file_memory_h
 
 #include "object.h"
+#include "vm.h"
+
 #define ALLOCATE(vm,type, count)\
         (type*)reallocate(vm,NULL, 0, sizeof(type)* (count))
 
@@ -22,4 +24,42 @@ void mark_object(RotoVM* vm,Obj* object);
 void mark_value(RotoVM* vm,Value value);
 void collect_garbage(RotoVM* vm);
 void free_objects(RotoVM* vm);
+
+//nursery the vm starts with
+#define NURSERY_SIZE (1024 * 1024)
+//allocation between two slices of an incremental collection
+#define GC_SLICE_BYTES (16 * 1024)
+
+//size bytes in the nursery, NULL when the object has to be allocated old
+Obj* allocate_young(RotoVM* vm, size_t size, ObjType type);
+//size bytes from the vm's pool, no more than POOL_MAX_SIZE
+Obj* allocate_old(RotoVM* vm, size_t size, ObjType type);
+//moves every live young object out to the old heap. no C local may hold a young
+//object across it, so the interpreter only calls it at its safepoints
+void collect_young(RotoVM* vm);
+void remember_object(RotoVM* vm, Obj* object);
+
+static inline bool is_young(RotoVM* vm, Obj* object){
+    return (uint8_t*)object >= vm->nursery && (uint8_t*)object < vm->nursery_end;
+}
+
+//while an incremental collection is marking, whatever is stored into the heap
+//gets marked, so an object that's already been traced never points at one
+//that won't be
+static inline void shade_object(RotoVM* vm, Obj* object){
+    if(UNLIKELY(vm->gc_phase == GC_MARKING) && object != NULL && !object->is_marked){
+        mark_object(vm, object);
+    }
+}
+
+//goes after every store of value into a field of owner. besides the above, an
+//old object that comes to point into the nursery is a root for the next minor
+//collection
+static inline void write_barrier(RotoVM* vm, Obj* owner, Value value){
+    if(!IS_OBJ(value)) return;
+    shade_object(vm, AS_OBJ(value));
+    if(is_young(vm, AS_OBJ(value)) && !owner->is_remembered && !is_young(vm, owner)){
+        remember_object(vm, owner);
+    }
+}
 #endif
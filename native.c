@@ -1,5 +1,7 @@
+#include <ctype.h>
 #include <stdlib.h>
 #include "value.h"
+#include "number.h"
 #include "memory.h"
 #include "native.h"
 #include "vm.h"
@@ -111,6 +113,67 @@ static Value readin_native(RotoVM* vm, int arg_count, Value* args){
     return OBJ_VAL(take_string(vm,line,length));
 }
 
+//the number a string spells, in the same syntax as a literal, with blanks
+//either side allowed. nil when it spells no number
+static Value number_native(RotoVM* vm, int arg_count, Value* args){
+    if(arg_count != 1){
+        runtime_error(vm,"Expected 1 argument but got %d.", arg_count);
+        return NIL_VAL;
+    }
+    if(!IS_STRING(args[0])){
+        runtime_error(vm,"Expected a string as the argument.");
+        return NIL_VAL;
+    }
+    ObjString* string = AS_STRING(args[0]);
+    const char* start = string->chars;
+    const char* end = start + string->length;
+    while (start < end && isspace((unsigned char)*start)) start++;
+    while (end > start && isspace((unsigned char)end[-1])) end--;
+
+    double value;
+    if(!parse_number(start, (size_t)(end - start), &value)) return NIL_VAL;
+    return exact_number(value);
+}
+
+//native methods
+Value length_method(RotoVM* vm, int arg_count, Value* args){
+    if(arg_count != 0){
+        runtime_error(vm,"Expected no arguments but got %d.", arg_count);
+        return NIL_VAL;
+    }
+    ObjList* list = AS_LIST(args[0]);
+    return NUMBER_VAL(list->values.count);
+}
+
+//every native function in the build. heap images refer to natives by their
+//index here, so new ones go on the end
+static const NativeFn registry[] = {
+        clock_native,
+        strlen_native,
+        print_native,
+        readin_native,
+        append_native,
+        lenList_native,
+        delete_native,
+        length_method,
+        number_native,
+};
+#define REGISTRY_COUNT ((int)(sizeof(registry) / sizeof(registry[0])))
+
+//-1 for a function that isn't a native of this build
+int native_number(NativeFn function){
+    for (int i = 0; i < REGISTRY_COUNT; i++) {
+        if(registry[i] == function) return i;
+    }
+    return -1;
+}
+
+//NULL when there's no native by that number
+NativeFn native_by_number(int number){
+    if(number < 0 || number >= REGISTRY_COUNT) return NULL;
+    return registry[number];
+}
+
 void define_all_natives(RotoVM* vm){
     char *nativeNames[] = {
             "clock",
@@ -120,6 +183,7 @@ void define_all_natives(RotoVM* vm){
             "append",
             "len",
             "delete",
+            "number",
 
     };
 
@@ -131,6 +195,7 @@ void define_all_natives(RotoVM* vm){
             append_native,
             lenList_native,
             delete_native,
+            number_native,
 
     };
 
@@ -8,4 +8,7 @@
 
 
 void define_all_natives(RotoVM* vm);
+Value length_method(RotoVM* vm, int arg_count, Value* args);
+int native_number(NativeFn function);
+NativeFn native_by_number(int number);
 #endif
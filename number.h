@@ -0,0 +1,12 @@
+#ifndef croto_number_h
+#define croto_number_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//parses all of start..start+length as a number: an optional sign, then 0x and
+//hex digits, or decimal digits with an optional fraction and exponent. '_' may
+//separate digits. false when it isn't one. never allocates below 128 characters
+bool parse_number(const char* start, size_t length, double* value);
+
+#endif
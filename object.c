@@ -12,11 +12,8 @@
         (type*)allocate_object(vm,sizeof(type), objType)
 
 static Obj* allocate_object(RotoVM* vm, size_t size, ObjType type){
-  Obj* object = (Obj*)reallocate(vm,NULL,0,size);
-  object->type = type;
-  object->is_marked = false;
-  object->next = vm->objects;
-  vm->objects = object;
+  Obj* object = allocate_young(vm, size, type);
+  if(object == NULL) object = allocate_old(vm, size, type);
 #ifdef DEBUG_LOG_GC
 //    printf("\x1B[36m");
 //  printf("%p allocate %ld for %d\n", (void*)object,size,type);
@@ -35,13 +32,18 @@ ObjBoundMethod* newBoundMethod(RotoVM* vm,Value receiver, ObjClosure* method){
     ObjBoundMethod* bound = ALLOCATE_OBJ(vm,ObjBoundMethod,OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
+    write_barrier(vm, (Obj*)bound, receiver);
     return bound;
 }
 
 ObjClass* newClass(RotoVM* vm,ObjString* name){
     ObjClass* klass = ALLOCATE_OBJ(vm,ObjClass,OBJ_CLASS);
     klass->name = name;
-    init_table(&klass->methods);
+    init_val_array(&klass->methods);
+    klass->initializer = NIL_VAL;
+    klass->shape = NULL;
+    klass->field_hint = 0;
+    klass->field_shadows_method = false;
     return klass;
 }
 
@@ -63,17 +65,115 @@ ObjFunction* newFunction(RotoVM* vm){
     function->arity = 0;
     function->upvalue_count = 0;
     function->name = NULL;
+    function->registers = false;
+    function->max_slots = 0;
+    function->source = NULL;
+    function->body_start = 0;
+    function->body_line = 0;
+    function->body_flags = 0;
+    function->upvalue_names = NULL;
     init_chunk(&function->chunk);
     return function;
 }
 
 ObjInstance* newInstance(RotoVM* vm,ObjClass* klass){
-    ObjInstance* instance = ALLOCATE_OBJ(vm,ObjInstance,OBJ_INSTANCE);
+    if(klass->shape == NULL) klass->shape = newShape(vm);
+    return newInstanceOf(vm, klass, klass->shape, klass->field_hint);
+}
+
+//instance of klass laid out by shape, with room for inline_capacity fields inline
+ObjInstance* newInstanceOf(RotoVM* vm, ObjClass* klass, ObjShape* shape, int inline_capacity){
+    ObjInstance* instance = (ObjInstance*)allocate_object(vm,
+            sizeof(ObjInstance) + sizeof(Value) * inline_capacity, OBJ_INSTANCE);
     instance->klass = klass;
-    init_table(&instance->fields);
+    instance->shape = shape;
+    instance->fields = instance->inline_fields;
+    instance->field_capacity = inline_capacity;
+    instance->inline_capacity = inline_capacity;
     return instance;
 }
 
+ObjShape* newShape(RotoVM* vm){
+    ObjShape* shape = ALLOCATE_OBJ(vm,ObjShape,OBJ_SHAPE);
+    init_table(&shape->slots);
+    init_table(&shape->transitions);
+    shape->field_count = 0;
+    shape->dictionary = false;
+    return shape;
+}
+
+//slot of the field name, -1 when the shape has no such field
+int shape_slot(ObjShape* shape, ObjString* name){
+    Value slot;
+    if(!table_get(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+static void note_field(RotoVM* vm, ObjClass* klass, ObjString* name){
+    Value method = class_method(klass, find_method_symbol(vm, name));
+    if(!IS_NIL(method)) klass->field_shadows_method = true;
+}
+
+//shape reached from shape by adding name, made on first use
+static ObjShape* shape_transition(RotoVM* vm, ObjClass* klass, ObjShape* shape, ObjString* name){
+    Value next;
+    if(table_get(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    ObjShape* child = newShape(vm);
+    push(vm,OBJ_VAL(child));
+    table_add_all(vm,&shape->slots, &child->slots);
+    //the copied keys are the parent's, marked along with it
+    shade_object(vm, (Obj*)shape);
+    table_set(vm,&child->slots, name, NUMBER_VAL(shape->field_count));
+    //keys copied from a shape that points into the nursery do too
+    if(shape->obj.is_remembered && !child->obj.is_remembered) remember_object(vm, (Obj*)child);
+    write_barrier(vm, (Obj*)child, OBJ_VAL(name));
+    child->field_count = shape->field_count + 1;
+    if(shape->field_count >= SHAPE_MAX_FIELDS || shape->transitions.count >= SHAPE_MAX_TRANSITIONS){
+        //objects used as maps would otherwise grow the tree without bound
+        child->dictionary = true;
+    }else{
+        table_set(vm,&shape->transitions, name, OBJ_VAL(child));
+        write_barrier(vm, (Obj*)shape, OBJ_VAL(name));
+    }
+    note_field(vm, klass, name);
+    pop(vm);
+    return child;
+}
+
+//store value under a field the instance doesn't have yet and return its slot.
+//value must be reachable by the GC
+int instance_add_field(RotoVM* vm, ObjInstance* instance, ObjString* name, Value value){
+    ObjShape* shape = instance->shape;
+    int slot = shape->field_count;
+    if(slot == instance->field_capacity){
+        int capacity = GROW_CAPACITY(instance->field_capacity);
+        Value* fields = ALLOCATE(vm,Value, capacity);
+        memcpy(fields, instance->fields, sizeof(Value) * slot);
+        if(instance->fields != instance->inline_fields){
+            FREE_ARRAY(vm,Value, instance->fields, instance->field_capacity);
+        }
+        instance->fields = fields;
+        instance->field_capacity = capacity;
+    }
+    instance->fields[slot] = value;
+    write_barrier(vm, (Obj*)instance, value);
+
+    if(shape->dictionary){
+        table_set(vm,&shape->slots, name, NUMBER_VAL(slot));
+        write_barrier(vm, (Obj*)shape, OBJ_VAL(name));
+        shape->field_count++;
+        note_field(vm, instance->klass, name);
+    }else{
+        instance->shape = shape_transition(vm, instance->klass, shape, name);
+    }
+    ObjClass* klass = instance->klass;
+    if(slot < INSTANCE_INLINE_MAX && klass->field_hint <= slot){
+        klass->field_hint = slot + 1;
+    }
+    return slot;
+}
+
 ObjNative* newNative(RotoVM* vm,NativeFn function){
     ObjNative* native = ALLOCATE_OBJ(vm,ObjNative,OBJ_NATIVE);
     native->function = function;
@@ -110,6 +210,8 @@ ObjString* take_string(RotoVM* vm,char* chars, int length){
   ObjString* interned = table_find_string(&vm->strings, chars, length, hash);
   if(interned != NULL){
     FREE_ARRAY(vm,char, chars, length + 1);
+    //the table's hold is weak, the caller's is about to be a real one
+    shade_object(vm, (Obj*)interned);
     return interned;
   }
   return allocate_string(vm,chars, length, hash);
@@ -120,7 +222,10 @@ ObjString* copy_string(RotoVM* vm,const char* chars, int length){
   uint32_t hash = hash_string(chars, length);
   ObjString* interned = table_find_string(&vm->strings, chars, length, hash);
 
-  if(interned != NULL) return interned;
+  if(interned != NULL){
+    shade_object(vm, (Obj*)interned);
+    return interned;
+  }
 
   char* heap_chars = ALLOCATE(vm,char, length + 1);
   memcpy(heap_chars, chars, length);
@@ -186,6 +291,9 @@ void print_object(Value value){
       case OBJ_NATIVE:
           printf("<native fn>");
           break;
+      case OBJ_SHAPE:
+          printf("shape");
+          break;
       case OBJ_FUNCTION:
           printFunction(AS_FUNCTION(value));
           break;
@@ -13,7 +13,7 @@
 #define IS_BOUND_METHOD(value) is_obj_type(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) is_obj_type(value,OBJ_CLASS)
 #define IS_CLOSURE(value)  is_obj_type(value, OBJ_CLOSURE)
-#define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNTION)
+#define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
@@ -25,6 +25,7 @@
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
 #define AS_NATIVE(value) \
 (((ObjNative*)AS_OBJ(value))->function)\
 
@@ -40,6 +41,7 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 }ObjType;
@@ -48,6 +50,9 @@ typedef enum {
 struct sObj{
   ObjType type;
   bool is_marked;
+  bool is_remembered;//old object on the vm's remembered set
+  //a young object's is NULL until a minor collection moves it, then where it
+  //moved to. moved ones are linked through it until their fields are moved
   struct sObj* next;
 };
 
@@ -61,6 +66,15 @@ typedef struct{
     int upvalue_count;
     Chunk chunk;
     ObjString* name;
+    bool registers;//chunk holds register code
+    int max_slots;//most stack slots the body uses, its own slot and arguments included
+    //a body the compiler only skimmed is compiled by its first call. until then
+    //source is the script it's in, NULL once the function has code
+    ObjString* source;
+    int body_start;//offset of the parameter list in source
+    int body_line;
+    uint8_t body_flags;//what compiler.c needs to know to compile it alone
+    ObjString** upvalue_names;//what each upvalue is called inside the body
 } ObjFunction;
 
 typedef Value (*NativeFn)(RotoVM* vm,int arg_count, Value* args);
@@ -91,16 +105,41 @@ typedef struct{
     int upvalue_count;//for GC
 }ObjClosure;
 
+//a shape past this many fields, or with this many transitions already, hands
+//out shapes owned by a single instance instead of growing the shared tree
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_TRANSITIONS 16
+//most fields an instance is allocated room for inline
+#define INSTANCE_INLINE_MAX 16
+
+//layout of an instance's fields. instances of a class that add the same fields
+//in the same order share a shape
+typedef struct ObjShape{
+    Obj obj;
+    Table slots;//field name -> slot index
+    Table transitions;//field name -> shape with that field added
+    int field_count;
+    bool dictionary;//owned by one instance and grown in place
+}ObjShape;
+
 typedef struct{
     Obj obj;
     ObjString* name;
-    Table methods;
+    ValueArray methods;//closures by method symbol, NIL_VAL where there's none
+    Value initializer;//init out of methods, kept in step with it
+    ObjShape* shape;//empty shape instances start from, created with the first one
+    int field_hint;//fields instances tend to end up with
+    bool field_shadows_method;//some instance has a field named like a method
 } ObjClass;
 
 typedef struct{
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;
+    Value* fields;//values by slot: inline_fields until they outgrow it
+    int field_capacity;
+    int inline_capacity;
+    Value inline_fields[];
 }ObjInstance;
 
 typedef struct{
@@ -109,13 +148,23 @@ typedef struct{
     ObjClosure* method;
 }ObjBoundMethod;
 
+//method of klass for the symbol, NIL_VAL when it has none
+static inline Value class_method(ObjClass* klass, int symbol){
+    if(symbol < 0 || symbol >= klass->methods.count) return NIL_VAL;
+    return klass->methods.values[symbol];
+}
+
 ObjList* newList(RotoVM* vm);
 ObjBoundMethod* newBoundMethod(RotoVM* vm,Value receiver, ObjClosure* method);
 ObjClass* newClass(RotoVM* vm,ObjString* name);
 ObjClosure* newClosure(RotoVM* vm,ObjFunction* function);
 ObjFunction* newFunction(RotoVM* vm);
 ObjInstance* newInstance(RotoVM* vm,ObjClass* klass);
+ObjInstance* newInstanceOf(RotoVM* vm, ObjClass* klass, ObjShape* shape, int inline_capacity);
 ObjNative* newNative(RotoVM* vm,NativeFn function);
+ObjShape* newShape(RotoVM* vm);
+int shape_slot(ObjShape* shape, ObjString* name);
+int instance_add_field(RotoVM* vm, ObjInstance* instance, ObjString* name, Value value);
 ObjString* take_string(RotoVM* vm,char* chars, int length);
 ObjString* copy_string(RotoVM* vm,const char* chars, int length);
 ObjUpvalue* newUpvalue(RotoVM* vm,Value* slot);
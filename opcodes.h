@@ -1,11 +1,14 @@
+//master list of instructions. included wherever the opcode set is needed
+//(the Opcode enum in chunk.h, the dispatch table in vm.c) so they stay in sync.
+//define OPCODE(name) before including this file.
 OPCODE(CONSTANT)
-OPCODE(NILL)
+OPCODE(NIL)
 OPCODE(TRUE)
 OPCODE(FALSE)
 OPCODE(POP)
 OPCODE(GET_LOCAL)
 OPCODE(SET_LOCAL)
-OPCODE(OP_GET_GLOBAL)
+OPCODE(GET_GLOBAL)
 OPCODE(DEFINE_GLOBAL)
 OPCODE(SET_GLOBAL)
 OPCODE(GET_UPVALUE)
@@ -43,8 +46,60 @@ OPCODE(RETURN)
 OPCODE(CLASS)
 OPCODE(INHERIT)
 OPCODE(METHOD)
-
-
-
-
-
+//superinstructions, picked by the compiler for common sequences
+OPCODE(GET_THIS_PROPERTY)
+OPCODE(INC_LOCAL)
+OPCODE(JUMP_IF_NOT_LESS)
+OPCODE(JUMP_IF_NOT_GREATER)
+OPCODE(JUMP_IF_NOT_EQUAL)
+OPCODE(JUMP_IF_LESS)
+OPCODE(JUMP_IF_GREATER)
+OPCODE(JUMP_IF_EQUAL)
+OPCODE(TAIL_CALL)
+OPCODE(TAIL_INVOKE)
+OPCODE(TAIL_SUPER_INVOKE)
+//number-only forms the interpreter rewrites generic instructions into once
+//it has seen number operands. they fall back to the generic form on any other type.
+//the _INT forms are picked when both operands were integers and take only those
+OPCODE(ADD_NUM)
+OPCODE(SUB_NUM)
+OPCODE(MUL_NUM)
+OPCODE(DIV_NUM)
+OPCODE(LESS_NUM)
+OPCODE(GREATER_NUM)
+OPCODE(EQUAL_NUM)
+OPCODE(NEGATE_NUM)
+OPCODE(ADD_INT)
+OPCODE(SUB_INT)
+OPCODE(MUL_INT)
+OPCODE(LESS_INT)
+OPCODE(GREATER_INT)
+OPCODE(EQUAL_INT)
+//register instructions, emitted by the register back end (registers.c).
+//operands name frame slots directly; rk operands with the top bit set name a constant.
+//the last operand byte of most of them is the stack height to leave behind.
+OPCODE(R_MOVE)
+OPCODE(R_LOADK)
+OPCODE(R_LOADNIL)
+OPCODE(R_LOADTRUE)
+OPCODE(R_LOADFALSE)
+OPCODE(R_ADD)
+OPCODE(R_SUB)
+OPCODE(R_MUL)
+OPCODE(R_DIV)
+OPCODE(R_LESS)
+OPCODE(R_GREATER)
+OPCODE(R_EQUAL)
+OPCODE(R_NOT)
+OPCODE(R_NEGATE)
+OPCODE(R_GET_UPVALUE)
+OPCODE(R_SET_UPVALUE)
+OPCODE(R_GET_GLOBAL)
+OPCODE(R_JUMP_IF_NOT_LESS)
+OPCODE(R_JUMP_IF_NOT_GREATER)
+OPCODE(R_JUMP_IF_NOT_EQUAL)
+OPCODE(R_JUMP_IF_LESS)
+OPCODE(R_JUMP_IF_GREATER)
+OPCODE(R_JUMP_IF_EQUAL)
+OPCODE(R_SETTOP)
+OPCODE(R_RETURN)
@@ -0,0 +1,259 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+//a bit for each granule of a page, set where an allocated slot starts
+#define BITMAP_WORDS (POOL_PAGE_SIZE / POOL_GRANULE / 64)
+
+struct PoolPage{
+    PoolPage* next;//in its class's pages
+    PoolPage* previous;
+    PoolPage* next_available;
+    PoolPage* previous_available;
+    bool is_available;
+    uint32_t epoch;//of the last sweep that went through it
+    int size_class;
+    int size;
+    int slots;
+    int unused;//slots from here on have never been handed out
+    int live;
+    void* free;//freed slots, linked through their first word
+    uint64_t allocated[BITMAP_WORDS];
+};
+
+//the slots start past the header, granule aligned
+#define SLOTS_OFFSET ((sizeof(PoolPage) + POOL_GRANULE - 1) & ~(size_t)(POOL_GRANULE - 1))
+#define PAGE_OF(object) ((PoolPage*)((uintptr_t)(object) & ~(uintptr_t)(POOL_PAGE_SIZE - 1)))
+#define GRANULE_OF(page, object)\
+        ((int)(((uint8_t*)(object) - (uint8_t*)(page) - SLOTS_OFFSET) / POOL_GRANULE))
+#define AT_GRANULE(page, granule)\
+        ((Obj*)((uint8_t*)(page) + SLOTS_OFFSET + (size_t)(granule) * POOL_GRANULE))
+
+void init_pool(ObjectPool* pool){
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        pool->classes[i].pages = NULL;
+        pool->classes[i].available = NULL;
+    }
+    pool->spare = NULL;
+    pool->spare_count = 0;
+    pool->page_count = 0;
+    pool->epoch = 0;
+    pool->sweep_class = POOL_CLASSES;
+    pool->sweep_page = NULL;
+}
+
+//a page aligned to its size, so an object's page is found by masking its
+//address. mmap only promises the os page size, the rest of twice as much
+//is unmapped again
+static PoolPage* map_page(ObjectPool* pool){
+    if(pool->spare != NULL){
+        PoolPage* page = pool->spare;
+        pool->spare = page->next;
+        pool->spare_count--;
+        return page;
+    }
+    uint8_t* memory = mmap(NULL, POOL_PAGE_SIZE * 2, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED) return NULL;
+    uint8_t* start = (uint8_t*)(((uintptr_t)memory + POOL_PAGE_SIZE - 1) & ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+    if(start > memory) munmap(memory, start - memory);
+    if(start < memory + POOL_PAGE_SIZE) munmap(start + POOL_PAGE_SIZE, memory + POOL_PAGE_SIZE - start);
+    pool->page_count++;
+    return (PoolPage*)start;
+}
+
+static void unmap_page(ObjectPool* pool, PoolPage* page){
+    if(pool->spare_count < POOL_SPARE_PAGES){
+        page->next = pool->spare;
+        pool->spare = page;
+        pool->spare_count++;
+        return;
+    }
+    munmap(page, POOL_PAGE_SIZE);
+    pool->page_count--;
+}
+
+static void add_available(PoolClass* size_class, PoolPage* page){
+    page->is_available = true;
+    page->previous_available = NULL;
+    page->next_available = size_class->available;
+    if(size_class->available != NULL) size_class->available->previous_available = page;
+    size_class->available = page;
+}
+
+static void remove_available(PoolClass* size_class, PoolPage* page){
+    page->is_available = false;
+    if(page->previous_available != NULL){
+        page->previous_available->next_available = page->next_available;
+    }else{
+        size_class->available = page->next_available;
+    }
+    if(page->next_available != NULL) page->next_available->previous_available = page->previous_available;
+}
+
+//a new page goes on the front, where a sweep under way has been already. it
+//counts as swept, nothing on it is garbage yet
+static PoolPage* new_page(ObjectPool* pool, int index){
+    PoolPage* page = map_page(pool);
+    if(page == NULL) return NULL;
+    PoolClass* size_class = &pool->classes[index];
+    page->size_class = index;
+    page->size = (index + 1) * POOL_GRANULE;
+    page->slots = (int)((POOL_PAGE_SIZE - SLOTS_OFFSET) / page->size);
+    page->unused = 0;
+    page->live = 0;
+    page->free = NULL;
+    page->epoch = pool->epoch;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    page->previous = NULL;
+    page->next = size_class->pages;
+    if(size_class->pages != NULL) size_class->pages->previous = page;
+    size_class->pages = page;
+    add_available(size_class, page);
+    return page;
+}
+
+Obj* pool_allocate(ObjectPool* pool, size_t size){
+    int index = (int)((size + POOL_GRANULE - 1) / POOL_GRANULE) - 1;
+    PoolClass* size_class = &pool->classes[index];
+    PoolPage* page = size_class->available;
+    if(page == NULL){
+        page = new_page(pool, index);
+        if(page == NULL) return NULL;
+    }
+    Obj* object;
+    if(page->free != NULL){
+        object = (Obj*)page->free;
+        page->free = *(void**)object;
+    }else{
+        object = AT_GRANULE(page, page->unused++ * (page->size / POOL_GRANULE));
+    }
+    int granule = GRANULE_OF(page, object);
+    page->allocated[granule / 64] |= (uint64_t)1 << (granule % 64);
+    page->live++;
+    if(page->free == NULL && page->unused == page->slots) remove_available(size_class, page);
+    return object;
+}
+
+size_t pool_slot_size(Obj* object){
+    return (size_t)PAGE_OF(object)->size;
+}
+
+bool pool_unswept(ObjectPool* pool, Obj* object){
+    return PAGE_OF(object)->epoch != pool->epoch;
+}
+
+void pool_start_sweep(ObjectPool* pool){
+    pool->epoch++;
+    pool->sweep_class = 0;
+    pool->sweep_page = pool->classes[0].pages;
+}
+
+//a dead object's slot goes on the page's free list, and a page left empty
+//goes back. returns the objects looked at
+static long sweep_page(ObjectPool* pool, PoolPage* page, PoolReleaseFn release, void* context){
+    long seen = 0;
+    page->epoch = pool->epoch;
+    for (int word = 0; word < BITMAP_WORDS; word++) {
+        uint64_t bits = page->allocated[word];
+        while (bits != 0) {
+            int bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            Obj* object = AT_GRANULE(page, word * 64 + bit);
+            seen++;
+            if(object->is_marked){
+                object->is_marked = false;
+                continue;
+            }
+            release(context, object);
+            page->allocated[word] &= ~((uint64_t)1 << bit);
+            *(void**)object = page->free;
+            page->free = object;
+            page->live--;
+        }
+    }
+
+    PoolClass* size_class = &pool->classes[page->size_class];
+    if(page->live == 0){
+        if(page->is_available) remove_available(size_class, page);
+        if(page->previous != NULL){
+            page->previous->next = page->next;
+        }else{
+            size_class->pages = page->next;
+        }
+        if(page->next != NULL) page->next->previous = page->previous;
+        unmap_page(pool, page);
+    }else if(!page->is_available && page->free != NULL){
+        add_available(size_class, page);
+    }
+    //a page of garbage still costs something
+    return seen + 1;
+}
+
+bool pool_sweep(ObjectPool* pool, long* budget, PoolReleaseFn release, void* context){
+    while (pool->sweep_class < POOL_CLASSES) {
+        PoolPage* page = pool->sweep_page;
+        if(page == NULL){
+            pool->sweep_class++;
+            if(pool->sweep_class < POOL_CLASSES) pool->sweep_page = pool->classes[pool->sweep_class].pages;
+            continue;
+        }
+        if(*budget <= 0) return false;
+        pool->sweep_page = page->next;
+        if(page->epoch != pool->epoch) *budget -= sweep_page(pool, page, release, context);
+    }
+    return true;
+}
+
+//the first allocated slot at granule start or past it, NULL when there's none
+static Obj* first_in_page(PoolPage* page, int start){
+    for (int word = start / 64; word < BITMAP_WORDS; word++) {
+        uint64_t bits = page->allocated[word];
+        if(word == start / 64) bits &= ~(uint64_t)0 << (start % 64);
+        if(bits != 0) return AT_GRANULE(page, word * 64 + __builtin_ctzll(bits));
+    }
+    return NULL;
+}
+
+static Obj* first_from(ObjectPool* pool, int index, PoolPage* page){
+    for (;;) {
+        while (page == NULL) {
+            if(++index >= POOL_CLASSES) return NULL;
+            page = pool->classes[index].pages;
+        }
+        Obj* object = first_in_page(page, 0);
+        if(object != NULL) return object;
+        page = page->next;
+    }
+}
+
+Obj* pool_first(ObjectPool* pool){
+    return first_from(pool, 0, pool->classes[0].pages);
+}
+
+Obj* pool_next(ObjectPool* pool, Obj* object){
+    PoolPage* page = PAGE_OF(object);
+    int start = GRANULE_OF(page, object) + page->size / POOL_GRANULE;
+    Obj* next = start < BITMAP_WORDS * 64 ? first_in_page(page, start) : NULL;
+    if(next != NULL) return next;
+    return first_from(pool, page->size_class, page->next);
+}
+
+void free_pool(ObjectPool* pool){
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        PoolPage* page = pool->classes[i].pages;
+        while (page != NULL) {
+            PoolPage* next = page->next;
+            munmap(page, POOL_PAGE_SIZE);
+            page = next;
+        }
+    }
+    while (pool->spare != NULL) {
+        PoolPage* next = pool->spare->next;
+        munmap(pool->spare, POOL_PAGE_SIZE);
+        pool->spare = next;
+    }
+    init_pool(pool);
+}
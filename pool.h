@@ -0,0 +1,56 @@
+#ifndef file_pool_h
+#define file_pool_h
+
+#include "common.h"
+#include "object.h"
+
+//old objects live in pages of equal slots, one size to a page. sizes go up in
+//steps of POOL_GRANULE to POOL_MAX_SIZE, and every object fits: the biggest is
+//an instance with all its inline fields
+#define POOL_PAGE_SIZE (64 * 1024)
+#define POOL_GRANULE 16
+#define POOL_CLASSES 16
+#define POOL_MAX_SIZE (POOL_GRANULE * POOL_CLASSES)
+#define POOL_SLOT_SIZE(size) (((size) + POOL_GRANULE - 1) & ~(size_t)(POOL_GRANULE - 1))
+//empty pages kept for reuse before they're given back to the os
+#define POOL_SPARE_PAGES 4
+
+typedef struct PoolPage PoolPage;
+
+typedef struct{
+    PoolPage* pages;//every page of this size
+    PoolPage* available;//the ones with a free slot
+}PoolClass;
+
+typedef struct{
+    PoolClass classes[POOL_CLASSES];
+    PoolPage* spare;
+    int spare_count;
+    size_t page_count;//mapped, spares included
+    //bumped as a sweep starts, so the pages from before it are the ones it
+    //has still to reach
+    uint32_t epoch;
+    int sweep_class;
+    PoolPage* sweep_page;
+}ObjectPool;
+
+//what the sweep does with a dead object, before its slot is reused
+typedef void (*PoolReleaseFn)(void* context, Obj* object);
+
+void init_pool(ObjectPool* pool);
+//what the objects own must have been released already
+void free_pool(ObjectPool* pool);
+//a slot for size bytes, NULL when no page can be mapped
+Obj* pool_allocate(ObjectPool* pool, size_t size);
+size_t pool_slot_size(Obj* object);
+//true while object's page is still to be swept
+bool pool_unswept(ObjectPool* pool, Obj* object);
+void pool_start_sweep(ObjectPool* pool);
+//sweeps pages until budget objects have been looked at, freeing the unmarked
+//ones and unmarking the rest. true once every page has been swept
+bool pool_sweep(ObjectPool* pool, long* budget, PoolReleaseFn release, void* context);
+//every allocated object, page by page. NULL after the last
+Obj* pool_first(ObjectPool* pool);
+Obj* pool_next(ObjectPool* pool, Obj* object);
+
+#endif
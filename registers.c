@@ -0,0 +1,406 @@
+#include <stdlib.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "memory.h"
+#include "registers.h"
+
+/*
+register back end.
+the compiler always produces stack code. when the vm runs with the register
+back end every finished function is rewritten here into three address form:
+the stack slot at height n is register n of the frame, so locals already are
+registers and a temporary lives in the slot it would have been pushed to.
+values that stack code only pushes to feed the next instruction (locals and
+constants) are tracked symbolically and read in place instead of copied,
+and an instruction whose result goes straight into a local writes it there.
+instructions with no register form (calls, properties, classes ...) are copied
+unchanged once the symbolic stack has been written out, so both forms share
+the frame layout and the interpreter loop, and a function the rewrite cannot
+handle simply keeps its stack code.
+*/
+
+typedef enum{
+    OPERAND_SLOT,//the value sits in its own stack slot
+    OPERAND_REGISTER,//not written yet, a copy of another slot
+    OPERAND_CONSTANT//not written yet, a constant
+}OperandType;
+
+typedef struct{
+    OperandType type;
+    int index;
+}Operand;
+
+typedef struct{
+    int from;//offset of the jump distance in the new code
+    int end;//offset just past the jump in the new code
+    int target;//offset it lands on in the old code
+    bool backward;
+}Fixup;
+
+typedef struct{
+    RotoVM* vm;
+    Chunk* in;
+    Chunk out;
+    int line;
+
+    Operand stack[REGISTERS_MAX];
+    int depth;//height of the symbolic stack
+    int top;//height the last emitted instruction left sp at
+    int max_depth;
+    int producer;//offset of the instruction that wrote the top slot, -1 if it can't be retargeted
+    int top_byte;//offset of the stack height operand ending the last instruction, -1 if none
+
+    int* depth_at;//stack height before each old instruction, -1 if unreachable
+    bool* is_target;
+    int* new_offset;
+    Fixup* fixups;
+    int fixup_count;
+    bool failed;
+}RegCompiler;
+
+static void emit(RegCompiler* rc, uint8_t byte){
+    write_chunk(rc->vm, &rc->out, byte, rc->line);
+}
+
+//the stack height operand closes most register instructions; remembering
+//where it went lets a following pop lower it instead of adding a R_SETTOP
+static void emit_top(RegCompiler* rc, int top){
+    emit(rc, (uint8_t)top);
+    rc->top_byte = rc->out.count - 1;
+    rc->top = top;
+}
+
+static uint8_t rk(Operand operand){
+    if(operand.type == OPERAND_CONSTANT) return (uint8_t)(0x80 | operand.index);
+    return (uint8_t)operand.index;
+}
+
+static void push_operand(RegCompiler* rc, OperandType type, int index){
+    Operand* operand = &rc->stack[rc->depth++];
+    operand->type = type;
+    operand->index = type == OPERAND_SLOT ? rc->depth - 1 : index;
+    if(rc->depth > rc->max_depth) rc->max_depth = rc->depth;
+}
+
+static Operand pop_operand(RegCompiler* rc){
+    return rc->stack[--rc->depth];
+}
+
+//write a pending value into its slot
+static bool materialize(RegCompiler* rc, int slot, int top){
+    Operand* operand = &rc->stack[slot];
+    if(operand->type == OPERAND_SLOT) return false;
+    emit(rc, operand->type == OPERAND_REGISTER ? OP_R_MOVE : OP_R_LOADK);
+    emit(rc, (uint8_t)slot);
+    emit(rc, (uint8_t)operand->index);
+    emit_top(rc, top);
+    operand->type = OPERAND_SLOT;
+    operand->index = slot;
+    return true;
+}
+
+//bring the real stack in line with the symbolic one, as stack code expects
+static void flush(RegCompiler* rc){
+    for (int i = 0; i < rc->depth; i++) {
+        materialize(rc, i, rc->depth);
+    }
+    if(rc->top != rc->depth){
+        emit(rc, OP_R_SETTOP);
+        emit_top(rc, rc->depth);
+    }
+    rc->producer = -1;
+}
+
+//pending copies of a slot must be written out before the slot changes
+static void before_write(RegCompiler* rc, int slot){
+    for (int i = 0; i < rc->depth; i++) {
+        if(rc->stack[i].type == OPERAND_REGISTER && rc->stack[i].index == slot){
+            materialize(rc, i, rc->top);
+        }
+    }
+    rc->producer = -1;
+}
+
+static void add_fixup(RegCompiler* rc, int from, int end, int target, bool backward){
+    //a function never has more jumps than bytes of code
+    Fixup* fixup = &rc->fixups[rc->fixup_count++];
+    fixup->from = from;
+    fixup->end = end;
+    fixup->target = target;
+    fixup->backward = backward;
+}
+
+static void copy_instruction(RegCompiler* rc, int offset){
+    int length = instruction_length(rc->in, offset);
+    int start = rc->out.count;
+    for (int i = 0; i < length; i++) {
+        emit(rc, rc->in->code[offset + i]);
+    }
+    if(is_jump(rc->in->code[offset])){
+        add_fixup(rc, start + 1, start + 3, jump_target(rc->in, offset),
+                  rc->in->code[offset] == OP_LOOP);
+    }
+}
+
+//an instruction without a register form runs on the real stack
+static void stack_instruction(RegCompiler* rc, int offset){
+    flush(rc);
+    int depth = rc->depth + stack_effect(rc->in, offset);
+    copy_instruction(rc, offset);
+    rc->depth = 0;
+    for (int i = 0; i < depth; i++) {
+        push_operand(rc, OPERAND_SLOT, i);
+    }
+    rc->top = depth;
+}
+
+static void binary(RegCompiler* rc, uint8_t op){
+    Operand b = pop_operand(rc);
+    Operand a = pop_operand(rc);
+    int dest = rc->depth;
+    int start = rc->out.count;
+    emit(rc, op);
+    emit(rc, (uint8_t)dest);
+    emit(rc, rk(a));
+    emit(rc, rk(b));
+    emit_top(rc, dest + 1);
+    push_operand(rc, OPERAND_SLOT, dest);
+    rc->producer = start;
+}
+
+static void unary(RegCompiler* rc, uint8_t op){
+    Operand a = pop_operand(rc);
+    int dest = rc->depth;
+    int start = rc->out.count;
+    emit(rc, op);
+    emit(rc, (uint8_t)dest);
+    emit(rc, rk(a));
+    emit_top(rc, dest + 1);
+    push_operand(rc, OPERAND_SLOT, dest);
+    rc->producer = start;
+}
+
+//load an operand-less value or one looked up by a one or two byte index into a fresh slot
+static void load(RegCompiler* rc, uint8_t op, int operand, int operand_bytes){
+    int dest = rc->depth;
+    int start = rc->out.count;
+    emit(rc, op);
+    emit(rc, (uint8_t)dest);
+    if(operand_bytes == 2) emit(rc, (uint8_t)(operand >> 8));
+    if(operand_bytes > 0) emit(rc, (uint8_t)operand);
+    emit_top(rc, dest + 1);
+    push_operand(rc, OPERAND_SLOT, dest);
+    rc->producer = start;
+}
+
+static void set_local(RegCompiler* rc, int slot){
+    Operand value = rc->stack[rc->depth - 1];
+    if(value.type == OPERAND_REGISTER && value.index == slot) return;
+
+    int producer = rc->producer;
+    before_write(rc, slot);
+    if(value.type == OPERAND_SLOT && producer != -1 && value.index == rc->depth - 1
+       && producer + instruction_length(&rc->out, producer) == rc->out.count
+       && rc->out.code[producer + 1] == value.index){
+        //nothing was emitted since the producer, so it can write the local itself
+        rc->out.code[producer + 1] = (uint8_t)slot;
+        rc->stack[rc->depth - 1].type = OPERAND_REGISTER;
+        rc->stack[rc->depth - 1].index = slot;
+    }else{
+        emit(rc, value.type == OPERAND_CONSTANT ? OP_R_LOADK : OP_R_MOVE);
+        emit(rc, (uint8_t)slot);
+        emit(rc, (uint8_t)value.index);
+        emit_top(rc, rc->top);
+    }
+    rc->stack[slot].type = OPERAND_SLOT;
+    rc->stack[slot].index = slot;
+}
+
+static void compare_jump(RegCompiler* rc, int offset, uint8_t op){
+    Operand b = pop_operand(rc);
+    Operand a = pop_operand(rc);
+    for (int i = 0; i < rc->depth; i++) {
+        materialize(rc, i, rc->top);
+    }
+    int start = rc->out.count;
+    emit(rc, op);
+    emit(rc, rk(a));
+    emit(rc, rk(b));
+    emit(rc, (uint8_t)rc->depth);
+    emit(rc, 0xff);
+    emit(rc, 0xff);
+    add_fixup(rc, start + 4, start + 6, jump_target(rc->in, offset), false);
+    rc->top = rc->depth;
+    rc->producer = -1;
+}
+
+static void translate(RegCompiler* rc, int offset){
+    uint8_t* code = rc->in->code + offset;
+    switch (code[0]) {
+        case OP_CONSTANT:
+            if(code[1] < REGISTERS_MAX){
+                push_operand(rc, OPERAND_CONSTANT, code[1]);
+                rc->producer = -1;
+            }else{
+                load(rc, OP_R_LOADK, code[1], 1);
+            }
+            break;
+        case OP_NIL: load(rc, OP_R_LOADNIL, 0, 0); break;
+        case OP_TRUE: load(rc, OP_R_LOADTRUE, 0, 0); break;
+        case OP_FALSE: load(rc, OP_R_LOADFALSE, 0, 0); break;
+        case OP_GET_LOCAL:{
+            Operand local = rc->stack[code[1]];
+            if(local.type == OPERAND_SLOT){
+                push_operand(rc, OPERAND_REGISTER, code[1]);
+            }else{
+                push_operand(rc, local.type, local.index);
+            }
+            rc->producer = -1;
+            break;
+        }
+        case OP_SET_LOCAL: set_local(rc, code[1]); break;
+        case OP_POP:
+            rc->depth--;
+            rc->producer = -1;
+            if(rc->top_byte == rc->out.count - 1 && rc->top > rc->depth){
+                rc->out.code[rc->top_byte] = (uint8_t)rc->depth;
+                rc->top = rc->depth;
+            }
+            break;
+        case OP_GET_UPVALUE: load(rc, OP_R_GET_UPVALUE, code[1], 1); break;
+        case OP_GET_GLOBAL: load(rc, OP_R_GET_GLOBAL, (code[1] << 8) | code[2], 2); break;
+        case OP_SET_UPVALUE:
+            emit(rc, OP_R_SET_UPVALUE);
+            emit(rc, code[1]);
+            emit(rc, rk(rc->stack[rc->depth - 1]));
+            rc->producer = -1;
+            break;
+        case OP_ADD: binary(rc, OP_R_ADD); break;
+        case OP_SUB: binary(rc, OP_R_SUB); break;
+        case OP_MUL: binary(rc, OP_R_MUL); break;
+        case OP_DIV: binary(rc, OP_R_DIV); break;
+        case OP_LESS: binary(rc, OP_R_LESS); break;
+        case OP_GREATER: binary(rc, OP_R_GREATER); break;
+        case OP_EQUAL: binary(rc, OP_R_EQUAL); break;
+        case OP_NOT: unary(rc, OP_R_NOT); break;
+        case OP_NEGATE: unary(rc, OP_R_NEGATE); break;
+        case OP_INC_LOCAL:
+            before_write(rc, code[1]);
+            materialize(rc, code[1], rc->top);
+            copy_instruction(rc, offset);
+            break;
+        case OP_JUMP_IF_NOT_LESS: compare_jump(rc, offset, OP_R_JUMP_IF_NOT_LESS); break;
+        case OP_JUMP_IF_NOT_GREATER: compare_jump(rc, offset, OP_R_JUMP_IF_NOT_GREATER); break;
+        case OP_JUMP_IF_NOT_EQUAL: compare_jump(rc, offset, OP_R_JUMP_IF_NOT_EQUAL); break;
+        case OP_JUMP_IF_LESS: compare_jump(rc, offset, OP_R_JUMP_IF_LESS); break;
+        case OP_JUMP_IF_GREATER: compare_jump(rc, offset, OP_R_JUMP_IF_GREATER); break;
+        case OP_JUMP_IF_EQUAL: compare_jump(rc, offset, OP_R_JUMP_IF_EQUAL); break;
+        case OP_RETURN:
+            emit(rc, OP_R_RETURN);
+            emit(rc, rk(pop_operand(rc)));
+            break;
+        default:
+            stack_instruction(rc, offset);
+            break;
+    }
+}
+
+static void patch_jumps(RegCompiler* rc){
+    for (int i = 0; i < rc->fixup_count; i++) {
+        Fixup* fixup = &rc->fixups[i];
+        int target = rc->new_offset[fixup->target];
+        int distance = fixup->backward ? fixup->end - target : target - fixup->end;
+        if(target < 0 || distance < 0 || distance > UINT16_MAX){
+            rc->failed = true;
+            return;
+        }
+        rc->out.code[fixup->from] = (distance >> 8) & 0xff;
+        rc->out.code[fixup->from + 1] = distance & 0xff;
+    }
+}
+
+void compile_registers(RotoVM* vm, ObjFunction* function){
+    RegCompiler rc;
+    Chunk* in = &function->chunk;
+    int old_count = in->count;
+    rc.vm = vm;
+    rc.in = in;
+    init_chunk(&rc.out);
+    rc.line = 0;
+    rc.depth = 0;
+    rc.top = 0;
+    rc.max_depth = 0;
+    rc.producer = -1;
+    rc.top_byte = -1;
+    rc.fixup_count = 0;
+    rc.failed = false;
+    rc.depth_at = ALLOCATE(vm, int, in->count);
+    rc.is_target = ALLOCATE(vm, bool, in->count);
+    rc.new_offset = ALLOCATE(vm, int, in->count);
+    rc.fixups = ALLOCATE(vm, Fixup, in->count);
+    for (int i = 0; i < in->count; i++) {
+        rc.is_target[i] = false;
+        rc.new_offset[i] = -1;
+    }
+
+    //stack heights, and where jumps land
+    int max_height = stack_heights(vm, in, function->arity + 1, rc.depth_at);
+    if(max_height == -1 || max_height >= REGISTERS_MAX) rc.failed = true;
+    for (int offset = 0; offset < in->count && !rc.failed;
+         offset += instruction_length(in, offset)) {
+        if(rc.depth_at[offset] != -1 && is_jump(in->code[offset])){
+            rc.is_target[jump_target(in, offset)] = true;
+        }
+    }
+
+    bool falls_through = false;
+    for (int offset = 0; offset < in->count && !rc.failed;
+         offset += instruction_length(in, offset)) {
+        if(rc.depth_at[offset] == -1){
+            falls_through = false;
+            continue;
+        }
+        rc.line = in->lines[offset];
+        if(!falls_through){
+            //only reached by jumps, which leave everything in its slot
+            rc.depth = 0;
+            for (int i = 0; i < rc.depth_at[offset]; i++) {
+                push_operand(&rc, OPERAND_SLOT, i);
+            }
+            rc.top = rc.depth;
+            rc.producer = -1;
+            rc.top_byte = -1;
+        }else if(rc.is_target[offset]){
+            flush(&rc);
+            rc.top_byte = -1;
+        }
+        if(rc.depth != rc.depth_at[offset]){
+            rc.failed = true;
+            break;
+        }
+        rc.new_offset[offset] = rc.out.count;
+        translate(&rc, offset);
+
+        uint8_t op = in->code[offset];
+        falls_through = op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+    }
+    if(!rc.failed) patch_jumps(&rc);
+
+    if(rc.failed){
+        free_chunk(vm, &rc.out);
+    }else{
+        FREE_ARRAY(vm, uint8_t, in->code, in->capacity);
+        FREE_ARRAY(vm, int, in->lines, in->capacity);
+        in->code = rc.out.code;
+        in->lines = rc.out.lines;
+        in->count = rc.out.count;
+        in->capacity = rc.out.capacity;
+        function->max_slots = rc.max_depth;
+        function->registers = true;
+    }
+    FREE_ARRAY(vm, int, rc.depth_at, old_count);
+    FREE_ARRAY(vm, bool, rc.is_target, old_count);
+    FREE_ARRAY(vm, int, rc.new_offset, old_count);
+    FREE_ARRAY(vm, Fixup, rc.fixups, old_count);
+}
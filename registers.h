@@ -0,0 +1,12 @@
+#ifndef croto_registers_h
+#define croto_registers_h
+
+#include "object.h"
+#include "vm.h"
+
+//largest frame the register form can address; rk operands use the top bit for constants
+#define REGISTERS_MAX 128
+
+void compile_registers(RotoVM* vm, ObjFunction* function);
+
+#endif
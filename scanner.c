@@ -1,26 +1,23 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "common.h"
 #include "scanner.h"
 
-//scanner: identify char from string and store each char as token
-
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define SCAN_SSE2
+#endif
 
-//gives us improvements to the tokenizer we wrote
-typedef struct{
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
+//scanner: identify char from string and store each char as token
 
-Scanner scanner;
 
-void init_scanner(const char* source) {
+void init_scanner(Scanner* scanner, const char* source) {
   /* code */
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = 1;
 
 }
 
@@ -36,222 +33,274 @@ static bool isDigit(char c){
 static bool isHex(char c){
     return ((c>= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f') || (c == '_'));
 }
-static bool is_at_end(){
-  return *scanner.current == '\0';
+static bool is_at_end(Scanner* scanner){
+  return *scanner->current == '\0';
 }
-static char advance(){
-  scanner.current++;
-  return scanner.current[-1];
+static char advance(Scanner* scanner){
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static char peek(){
-  return *scanner.current;
+static char peek(Scanner* scanner){
+  return *scanner->current;
 }
 
-static char peek_next(){
-  if(is_at_end()) return '\0';
-  return scanner.current[1];
+static char peek_next(Scanner* scanner){
+  if(is_at_end(scanner)) return '\0';
+  return scanner->current[1];
 }
 
-static bool match(char expected){
-  if(is_at_end()) return false;
-  if(*scanner.current != expected) return false;
-  scanner.current++;
+static bool match(Scanner* scanner, char expected){
+  if(is_at_end(scanner)) return false;
+  if(*scanner->current != expected) return false;
+  scanner->current++;
   return true;
 }
 
-static Token make_token(TokenType type){
+static Token make_token(Scanner* scanner, TokenType type){
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
   return token;
 }
-static Token error_token(const char *message){
+static Token error_token(Scanner* scanner, const char *message){
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
-static void skip_whitespace(){
-  for(;;){
-    char c = peek();
+//the runs of characters long enough to be worth skipping over in bulk.
+//identifiers and numbers are mostly too short to gain from it
+typedef enum{
+  RUN_BLANK,//spaces, tabs and newlines
+  RUN_LINE,//rest of a comment
+  RUN_STRING//inside a string literal
+}RunKind;
 
-    switch (c) {
-      case ' ':
-      case '\r':
-      case '\t':
-        advance();
-        break;
-      case '\n':
-        scanner.line++;
-        advance();
-        break;
-      case '/':
-        if(peek_next() == '/'){
-          while (peek() != '\n' && !is_at_end()) {
-            /* code */
-            advance();
-          }
-        }else{
-          return;
-        }
-        break;
-      default:
-        return;
-    }
+//none of the runs take in the terminator, so every run stops at the end of the source
+static inline bool in_run(char c, RunKind kind){
+  switch (kind) {
+    case RUN_BLANK: return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    case RUN_LINE: return c != '\n' && c != '\0';
+    case RUN_STRING: return c != '"' && c != '\0';
   }
+  return false;
 }
 
-static TokenType check_keyword(int start, int length, const char* rest, TokenType type){
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    /* code */
-    return type;
-  }
-  return TOKEN_IDENTIFIER;
+#ifdef SCAN_SSE2
+static inline __m128i byte_is(__m128i block, char c){
+  return _mm_cmpeq_epi8(block, _mm_set1_epi8(c));
 }
-//trie implementation to match reserved words
-static TokenType identifier_type(){
-  switch (scanner.start[0]) {
-    case 'a': return check_keyword(1,2, "nd", TOKEN_AND);
-    case 'c': return check_keyword(1,4, "lass", TOKEN_CLASS);
-    case 'e': return check_keyword(1,3, "lse", TOKEN_ELSE);
-    case 'f':
-      if(scanner.current - scanner.start > 1){
-        switch (scanner.start[1]) {
-          case 'a': return check_keyword(2,3, "lse", TOKEN_FALSE);
-          case 'o': return check_keyword(2,1, "r", TOKEN_FOR);
-          case 'u': return check_keyword(2,2, "nc", TOKEN_FUN);
-        }
-      }
+
+//a bit for each of the 16 bytes that ends the run
+static inline unsigned stop_mask(__m128i block, RunKind kind){
+  __m128i stop;
+  switch (kind) {
+    case RUN_BLANK:
+      stop = _mm_or_si128(_mm_or_si128(byte_is(block, ' '), byte_is(block, '\t')),
+                          _mm_or_si128(byte_is(block, '\r'), byte_is(block, '\n')));
+      return ~(unsigned)_mm_movemask_epi8(stop) & 0xffff;
+    case RUN_LINE:
+      stop = _mm_or_si128(byte_is(block, '\n'), byte_is(block, '\0'));
       break;
-    case 'i': return check_keyword(1,1, "f", TOKEN_IF);
-    case 'n': return check_keyword(1,2, "il", TOKEN_NIL);
-    case 'o': return check_keyword(1,1, "r", TOKEN_OR);
-//    case 'p': return check_keyword(1,4, "rint", TOKEN_PRINT);
-    case 'r': return check_keyword(1,5, "eturn", TOKEN_RETURN);
-    case 's': return check_keyword(1,4, "uper", TOKEN_SUPER);
-    case 't':
-      if(scanner.current - scanner.start > 1){
-        switch (scanner.start[1]) {
-          case 'h': return check_keyword(2,2, "is", TOKEN_THIS);
-          case 'r': return check_keyword(2,2, "ue", TOKEN_TRUE);
-        }
-      }
+    case RUN_STRING:
+    default:
+      stop = _mm_or_si128(byte_is(block, '"'), byte_is(block, '\0'));
       break;
-    case 'v': return check_keyword(1,2, "ar", TOKEN_VAR);
-    case 'w': return check_keyword(1,4, "hile", TOKEN_WHILE);
+  }
+  return (unsigned)_mm_movemask_epi8(stop);
+}
+
+//16 bytes at a time, reading past the terminator as long as it stays in the same
+//page, which is safe, but still a read outside the string as far as the address
+//sanitizer is concerned. the first couple of bytes go one at a time, most runs
+//between tokens are over by then
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((no_sanitize_address))
+#endif
+static inline const char* scan_run(const char* at, RunKind kind, int* lines){
+  for (int i = 0; i < 2; i++) {
+    if (!in_run(*at, kind)) return at;
+    if (lines != NULL && *at == '\n') (*lines)++;
+    at++;
+  }
+  for (;;) {
+    if (((uintptr_t)at & 4095) > 4096 - 16) {
+      //the block would reach into the next page
+      if (!in_run(*at, kind)) return at;
+      if (lines != NULL && *at == '\n') (*lines)++;
+      at++;
+      continue;
+    }
+    __m128i bytes = _mm_loadu_si128((const __m128i*)at);
+    unsigned stop = stop_mask(bytes, kind);
+    unsigned newlines = lines != NULL ? (unsigned)_mm_movemask_epi8(byte_is(bytes, '\n')) : 0;
+    if (stop != 0) {
+      int end = __builtin_ctz(stop);
+      if (lines != NULL) *lines += __builtin_popcount(newlines & ((1u << end) - 1));
+      return at + end;
+    }
+    if (lines != NULL) *lines += __builtin_popcount(newlines);
+    at += 16;
+  }
+}
+#else
+static inline const char* scan_run(const char* at, RunKind kind, int* lines){
+  while (in_run(*at, kind)) {
+    if (lines != NULL && *at == '\n') (*lines)++;
+    at++;
+  }
+  return at;
+}
+#endif
+
+static void skip_whitespace(Scanner* scanner){
+  for(;;){
+    scanner->current = scan_run(scanner->current, RUN_BLANK, &scanner->line);
+    if(scanner->current[0] != '/' || scanner->current[1] != '/') return;
+    scanner->current = scan_run(scanner->current, RUN_LINE, NULL);
+  }
+}
+
+//reserved words by a perfect hash of first letter, last letter and length
+typedef struct{
+  const char* word;
+  int length;
+  TokenType type;
+}Keyword;
+
+#define KEYWORD_HASH(start, length) (((start)[0] + (start)[(length) - 1] * 5 + (length)) & 31)
+
+static const Keyword keywords[32] = {
+  [2] = {"else", 4, TOKEN_ELSE},
+  [3] = {"for", 3, TOKEN_FOR},
+  [4] = {"false", 5, TOKEN_FALSE},
+  [7] = {"class", 5, TOKEN_CLASS},
+  [9] = {"if", 2, TOKEN_IF},
+  [11] = {"or", 2, TOKEN_OR},
+  [13] = {"nil", 3, TOKEN_NIL},
+  [17] = {"true", 4, TOKEN_TRUE},
+  [18] = {"super", 5, TOKEN_SUPER},
+  [19] = {"var", 3, TOKEN_VAR},
+  [21] = {"while", 5, TOKEN_WHILE},
+  [23] = {"this", 4, TOKEN_THIS},
+  [24] = {"and", 3, TOKEN_AND},
+  [25] = {"func", 4, TOKEN_FUN},
+  [30] = {"return", 6, TOKEN_RETURN},
+};
+
+static TokenType identifier_type(Scanner* scanner){
+  int length = (int)(scanner->current - scanner->start);
+  const Keyword* keyword = &keywords[KEYWORD_HASH(scanner->start, length)];
+  if (keyword->length == length && memcmp(scanner->start, keyword->word, length) == 0) {
+    return keyword->type;
   }
   return TOKEN_IDENTIFIER;
 }
 //Keywords or identifiers
-static Token identifier(){
-  while (is_alpha(peek()) || isDigit(peek())) {
+static Token identifier(Scanner* scanner){
+  while (is_alpha(peek(scanner)) || isDigit(peek(scanner))) {
     /* consume */
-    advance();
+    advance(scanner);
   }
-  return make_token(identifier_type());
+  return make_token(scanner, identifier_type(scanner));
 }
 
 //number
-static Token number(){
-  while (isDigit(peek())) {
+static Token number(Scanner* scanner){
+  while (isDigit(peek(scanner))) {
     /* code */
-    advance();
+    advance(scanner);
   }
-  if(peek() == '.' && isDigit(peek_next())){
-    advance();
-    while (isDigit(peek())) {
+  if(peek(scanner) == '.' && isDigit(peek_next(scanner))){
+    advance(scanner);
+    while (isDigit(peek(scanner))) {
       /* code */
-      advance();
+      advance(scanner);
     }
   }
-  return make_token(TOKEN_NUMBER);
+  return make_token(scanner, TOKEN_NUMBER);
 }
 //hex
-static Token hex_number(){
-    while (peek() == '_'){
-        advance();
+static Token hex_number(Scanner* scanner){
+    while (peek(scanner) == '_'){
+        advance(scanner);
     }
-    if (peek() == '0') advance();
-    if (peek() == 'x' || peek() == 'X'){
-        advance();
-        if (!isHex(peek())) return error_token("Invalid hex literal");
-        while (isHex(peek())) advance();
-        return make_token(TOKEN_NUMBER);
-    } else return number();
+    if (peek(scanner) == '0') advance(scanner);
+    if (peek(scanner) == 'x' || peek(scanner) == 'X'){
+        advance(scanner);
+        if (!isHex(peek(scanner))) return error_token(scanner, "Invalid hex literal");
+        while (isHex(peek(scanner))) advance(scanner);
+        return make_token(scanner, TOKEN_NUMBER);
+    } else return number(scanner);
 }
 
 //string
-Token string(){
-  while (peek() != '"' && !is_at_end()){
-    /* code */
-    if(peek() == '\n') scanner.line++;
-    advance();
-  }
-  if(is_at_end()) return error_token("Unterminated string.");
+static Token string(Scanner* scanner){
+  scanner->current = scan_run(scanner->current, RUN_STRING, &scanner->line);
+  if(is_at_end(scanner)) return error_token(scanner, "Unterminated string.");
 
   //closing quote
-  advance();
-  return make_token(TOKEN_STRING);
+  advance(scanner);
+  return make_token(scanner, TOKEN_STRING);
 }
 
 //tokenizer
 //TODO: add '&', '^', '|' and possibly bit shifting
-Token scan_token(){
-  skip_whitespace();
-  scanner.start = scanner.current;
+Token scan_token(Scanner* scanner){
+  skip_whitespace(scanner);
+  scanner->start = scanner->current;
 
-  if(is_at_end()) return make_token(TOKEN_EOF);
+  if(is_at_end(scanner)) return make_token(scanner, TOKEN_EOF);
 
-  char c = advance(); //next token
-  if(is_alpha(c)) return identifier();//reserved words and identifiers
-  if(isDigit(c)) return hex_number();//digits
+  char c = advance(scanner); //next token
+  if(is_alpha(c)) return identifier(scanner);//reserved words and identifiers
+  if(isDigit(c)) return hex_number(scanner);//digits
 
   switch(c){
-    case '(': return make_token(TOKEN_LEFT_PAREN);
-    case ')': return make_token(TOKEN_RIGHT_PAREN);
-    case '{': return make_token(TOKEN_LEFT_BRACE);
-    case '}': return make_token(TOKEN_RIGHT_BRACE);
-    case '[': return make_token(TOKEN_LEFT_BRACKET);
-    case ']': return make_token(TOKEN_RIGHT_BRACKET);
-    case ';': return make_token(TOKEN_SEMICOLON);
-    case ',': return make_token(TOKEN_COMMA);
-    case '.': return make_token(TOKEN_DOT);
-    case '-': return make_token(TOKEN_MINUS);
-    case '+': return make_token(TOKEN_PLUS);
-    case '/': return make_token(TOKEN_SLASH);
-    case '*': return make_token(TOKEN_STAR);
-    case '|': return make_token(TOKEN_PIPE);
-    case '^': return make_token(TOKEN_CARET);
-    case '&': return make_token(TOKEN_AMPERSAND);
-    case '!': return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-    case '=': return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    case '(': return make_token(scanner, TOKEN_LEFT_PAREN);
+    case ')': return make_token(scanner, TOKEN_RIGHT_PAREN);
+    case '{': return make_token(scanner, TOKEN_LEFT_BRACE);
+    case '}': return make_token(scanner, TOKEN_RIGHT_BRACE);
+    case '[': return make_token(scanner, TOKEN_LEFT_BRACKET);
+    case ']': return make_token(scanner, TOKEN_RIGHT_BRACKET);
+    case ';': return make_token(scanner, TOKEN_SEMICOLON);
+    case ',': return make_token(scanner, TOKEN_COMMA);
+    case '.': return make_token(scanner, TOKEN_DOT);
+    case '-': return make_token(scanner, TOKEN_MINUS);
+    case '+': return make_token(scanner, TOKEN_PLUS);
+    case '/': return make_token(scanner, TOKEN_SLASH);
+    case '*': return make_token(scanner, TOKEN_STAR);
+    case '|': return make_token(scanner, TOKEN_PIPE);
+    case '^': return make_token(scanner, TOKEN_CARET);
+    case '&': return make_token(scanner, TOKEN_AMPERSAND);
+    case '!': return make_token(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    case '=': return make_token(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<': {
-        if (match('=')) {
-            return make_token(TOKEN_LESS_EQUAL);
-        } else if (match('<')) {
-            return make_token(TOKEN_LEFT_SHIFT);
+        if (match(scanner, '=')) {
+            return make_token(scanner, TOKEN_LESS_EQUAL);
+        } else if (match(scanner, '<')) {
+            return make_token(scanner, TOKEN_LEFT_SHIFT);
         } else {
-            return make_token(TOKEN_LESS);
+            return make_token(scanner, TOKEN_LESS);
         }
     }
     case '>': {
-        if (match('=')) {
-            return make_token(TOKEN_GREATER_EQUAL);
-        } else if (match('>')) {
-            return make_token(TOKEN_RIGHT_SHIFT);
+        if (match(scanner, '=')) {
+            return make_token(scanner, TOKEN_GREATER_EQUAL);
+        } else if (match(scanner, '>')) {
+            return make_token(scanner, TOKEN_RIGHT_SHIFT);
         } else {
-            return make_token(TOKEN_GREATER);
+            return make_token(scanner, TOKEN_GREATER);
         }
-        //return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        //return make_token(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     }
-    case '"': return string();
+    case '"': return string(scanner);
   }
 
-  return error_token("Unexpected character.");
+  return error_token(scanner, "Unexpected character.");
 }
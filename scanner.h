@@ -40,6 +40,13 @@ typedef struct token {
   int length;
   int line;
 }Token;
-void init_scanner(const char* source);
-Token scan_token();
+//position in the source being scanned. each compile has its own
+typedef struct{
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
+void init_scanner(Scanner* scanner, const char* source);
+Token scan_token(Scanner* scanner);
 #endif
@@ -0,0 +1,920 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "serialize.h"
+#include "compiler.h"
+#include "memory.h"
+#include "native.h"
+
+#define MAGIC "ROTO"
+#define MAGIC_LENGTH 4
+
+//opcode numbering is part of the format, files from a build with another set are refused
+static const int opcode_count = 0
+#define OPCODE(name) + 1
+#include "opcodes.h"
+#undef OPCODE
+;
+
+//function flags
+#define FUNCTION_REGISTERS 0x1
+#define FUNCTION_NAMED 0x2
+
+//constant tags
+typedef enum{
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+}ConstantTag;
+
+//nested functions the loader follows. each one is rooted on the vm stack while it's read
+#define FUNCTION_DEPTH_MAX 128
+
+bool is_bytecode(const uint8_t* data, size_t size){
+    return size >= MAGIC_LENGTH && memcmp(data, MAGIC, MAGIC_LENGTH) == 0;
+}
+
+//fnv-1a, checks the file end to end so a damaged one is refused rather than run
+#define CHECKSUM_SEED 14695981039346656037ULL
+#define CHECKSUM_PRIME 1099511628211ULL
+#define CHECKSUM_LENGTH 8
+
+typedef struct ObjectIndex ObjectIndex;
+
+typedef struct{
+    FILE* file;
+    uint64_t checksum;//of everything written so far
+    ObjectIndex* index;//image objects sorted by address
+    int object_count;
+}Writer;
+
+static void write_bytes(Writer* writer, const void* data, size_t length){
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++) {
+        writer->checksum = (writer->checksum ^ bytes[i]) * CHECKSUM_PRIME;
+    }
+    fwrite(bytes, sizeof(uint8_t), length, writer->file);
+}
+static void write_u8(Writer* writer, uint8_t value){
+    write_bytes(writer, &value, 1);
+}
+static void write_u16(Writer* writer, uint16_t value){
+    write_u8(writer, (uint8_t)value);
+    write_u8(writer, (uint8_t)(value >> 8));
+}
+static void write_u32(Writer* writer, uint32_t value){
+    write_u16(writer, (uint16_t)value);
+    write_u16(writer, (uint16_t)(value >> 16));
+}
+static void write_u64(Writer* writer, uint64_t value){
+    write_u32(writer, (uint32_t)value);
+    write_u32(writer, (uint32_t)(value >> 32));
+}
+static void write_string(Writer* writer, ObjString* string){
+    write_u32(writer, (uint32_t)string->length);
+    write_bytes(writer, string->chars, string->length);
+}
+static void write_names(Writer* writer, ValueArray* names){
+    write_u32(writer, (uint32_t)names->count);
+    for (int i = 0; i < names->count; i++) {
+        write_string(writer, AS_STRING(names->values[i]));
+    }
+}
+
+//code and its lines, as runs of instruction bytes on the same line
+static void write_code(Writer* writer, Chunk* chunk){
+    write_u32(writer, (uint32_t)chunk->count);
+    write_bytes(writer, chunk->code, chunk->count);
+
+    int runs = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        if(i == 0 || chunk->lines[i] != chunk->lines[i - 1]) runs++;
+    }
+    write_u32(writer, (uint32_t)runs);
+    for (int start = 0; start < chunk->count;) {
+        int end = start + 1;
+        while (end < chunk->count && chunk->lines[end] == chunk->lines[start]) end++;
+        write_u32(writer, (uint32_t)chunk->lines[start]);
+        write_u32(writer, (uint32_t)(end - start));
+        start = end;
+    }
+}
+
+static bool write_function(Writer* writer, ObjFunction* function){
+    Chunk* chunk = &function->chunk;
+    uint8_t flags = 0;
+    if(function->registers) flags |= FUNCTION_REGISTERS;
+    if(function->name != NULL) flags |= FUNCTION_NAMED;
+    write_u8(writer, flags);
+    if(function->name != NULL) write_string(writer, function->name);
+    write_u16(writer, (uint16_t)function->arity);
+    write_u16(writer, (uint16_t)function->upvalue_count);
+    write_u32(writer, (uint32_t)function->max_slots);
+    write_u32(writer, (uint32_t)chunk->cache_count);
+
+    //constants come before the code so the loader knows each closure's upvalue count
+    write_u32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if(IS_NIL(value)){
+            write_u8(writer, CONSTANT_NIL);
+        }else if(IS_BOOL(value)){
+            write_u8(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+        }else if(IS_NUMBER(value)){
+            double number = AS_NUMBER(value);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(double));
+            write_u8(writer, CONSTANT_NUMBER);
+            write_u64(writer, bits);
+        }else if(IS_STRING(value)){
+            write_u8(writer, CONSTANT_STRING);
+            write_string(writer, AS_STRING(value));
+        }else if(IS_FUNCTION(value)){
+            write_u8(writer, CONSTANT_FUNCTION);
+            if(!write_function(writer, AS_FUNCTION(value))) return false;
+        }else{
+            return false;
+        }
+    }
+
+    write_code(writer, chunk);
+    return true;
+}
+
+//skimmed bodies are written compiled. with no collections meanwhile, nothing the
+//caller holds unrooted goes away
+static bool compile_skimmed(RotoVM* vm, ObjFunction* function){
+    bool paused = vm->gc_paused;
+    vm->gc_paused = true;
+    bool ok = true;
+    if(function != NULL){
+        ok = compile_bodies(vm, function);
+    }else{
+        //functions the compiles make are nested in the one being compiled, so
+        //compile_bodies has them already. the walk may still come across them,
+        //compiled ones have no source left
+        for (Obj* object = pool_first(&vm->pool); object != NULL && ok; object = pool_next(&vm->pool, object)) {
+            if(object->type == OBJ_FUNCTION) ok = compile_bodies(vm, (ObjFunction*)object);
+        }
+    }
+    vm->gc_paused = paused;
+    return ok;
+}
+
+bool write_bytecode(RotoVM* vm, ObjFunction* function, uint64_t source_hash, FILE* file){
+    //before the names are written, the bodies may use some the script doesn't
+    if(!compile_skimmed(vm, function)) return false;
+    Writer writer;
+    writer.file = file;
+    writer.checksum = CHECKSUM_SEED;
+    writer.index = NULL;
+    writer.object_count = 0;
+    write_bytes(&writer, MAGIC, MAGIC_LENGTH);
+    write_u16(&writer, BYTECODE_VERSION);
+    write_u16(&writer, (uint16_t)opcode_count);
+    write_u64(&writer, source_hash);
+    write_names(&writer, &vm->global_names);
+    write_names(&writer, &vm->method_names);
+    if(!write_function(&writer, function)) return false;
+    write_u64(&writer, writer.checksum);
+    return !ferror(file);
+}
+
+typedef struct{
+    RotoVM* vm;
+    const uint8_t* at;
+    const uint8_t* end;
+    bool ok;//cleared by the first read that fails, later reads return zeroes
+    int depth;
+    int* globals;//this vm's slot for each global in the file
+    int global_count;
+    int* methods;//this vm's symbol for each method name in the file
+    int method_count;
+    Obj** objects;//image objects by index
+    int object_count;
+}Reader;
+
+//true when the checksum at the end of data matches, size is then cut to the part before it
+static bool check_sum(const uint8_t* data, size_t* size){
+    if(*size < MAGIC_LENGTH + CHECKSUM_LENGTH) return false;
+    uint64_t checksum = CHECKSUM_SEED;
+    *size -= CHECKSUM_LENGTH;
+    for (size_t i = 0; i < *size; i++) {
+        checksum = (checksum ^ data[i]) * CHECKSUM_PRIME;
+    }
+    for (int i = 0; i < CHECKSUM_LENGTH; i++) {
+        if(data[*size + i] != (uint8_t)(checksum >> (8 * i))) return false;
+    }
+    return true;
+}
+
+static const uint8_t* read_bytes(Reader* reader, size_t length){
+    if(!reader->ok || (size_t)(reader->end - reader->at) < length){
+        reader->ok = false;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->at;
+    reader->at += length;
+    return bytes;
+}
+static uint8_t read_u8(Reader* reader){
+    const uint8_t* bytes = read_bytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+static uint16_t read_u16(Reader* reader){
+    uint16_t low = read_u8(reader);
+    return (uint16_t)(low | (read_u8(reader) << 8));
+}
+static uint32_t read_u32(Reader* reader){
+    uint32_t low = read_u16(reader);
+    return low | ((uint32_t)read_u16(reader) << 16);
+}
+static uint64_t read_u64(Reader* reader){
+    uint64_t low = read_u32(reader);
+    return low | ((uint64_t)read_u32(reader) << 32);
+}
+//a count of things that each take at least one more byte, so a bad one fails before it's allocated
+static int read_count(Reader* reader, int max){
+    uint32_t count = read_u32(reader);
+    if(count > (uint32_t)max || count > (size_t)(reader->end - reader->at)){
+        reader->ok = false;
+        return 0;
+    }
+    return (int)count;
+}
+static ObjString* read_string(Reader* reader){
+    uint32_t length = read_u32(reader);
+    if(length > INT32_MAX) reader->ok = false;
+    const char* chars = (const char*)read_bytes(reader, length);
+    if(chars == NULL) return NULL;
+    return copy_string(reader->vm, chars, (int)length);
+}
+
+//vm numbers for names the file refers to by index, into map. false when the vm has run out
+static bool read_names(Reader* reader, int max, bool global, int** map, int* count){
+    *count = read_count(reader, max);
+    *map = ALLOCATE(reader->vm, int, *count);
+    for (int i = 0; i < *count; i++) {
+        ObjString* name = read_string(reader);
+        if(name == NULL) return false;
+        int index = global ? global_slot(reader->vm, name) : method_symbol(reader->vm, name);
+        if(index == -1) return false;
+        (*map)[i] = index;
+    }
+    return reader->ok;
+}
+
+static void relink_operand(Reader* reader, uint8_t* operand, int* map, int count){
+    int index = (operand[0] << 8) | operand[1];
+    if(index >= count){
+        reader->ok = false;
+        return;
+    }
+    operand[0] = (uint8_t)(map[index] >> 8);
+    operand[1] = (uint8_t)map[index];
+}
+
+//point the code's global slot and method symbol operands at this vm's numbers,
+//checking on the way that every instruction is whole
+static void relink(Reader* reader, Chunk* chunk){
+    for (int offset = 0; offset < chunk->count && reader->ok;) {
+        uint8_t instr = chunk->code[offset];
+        if(instr >= opcode_count){
+            reader->ok = false;
+            return;
+        }
+        if(instr == OP_CLOSURE){
+            if(offset + 1 >= chunk->count ||
+               chunk->code[offset + 1] >= chunk->constants.count ||
+               !IS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]])){
+                reader->ok = false;
+                return;
+            }
+        }
+        int length = instruction_length(chunk, offset);
+        if(offset + length > chunk->count){
+            reader->ok = false;
+            return;
+        }
+        uint8_t* code = chunk->code + offset;
+        switch (instr) {
+            case OP_GET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_GLOBAL:
+                relink_operand(reader, code + 1, reader->globals, reader->global_count);
+                break;
+            case OP_R_GET_GLOBAL:
+                relink_operand(reader, code + 2, reader->globals, reader->global_count);
+                break;
+            case OP_GET_SUPER:
+            case OP_METHOD:
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+            case OP_SUPER_INVOKE:
+            case OP_TAIL_SUPER_INVOKE:
+                relink_operand(reader, code + 1, reader->methods, reader->method_count);
+                break;
+            default:
+                break;
+        }
+        offset += length;
+    }
+}
+
+static void read_code(Reader* reader, Chunk* chunk){
+    RotoVM* vm = reader->vm;
+    int count = read_count(reader, INT32_MAX);
+    const uint8_t* code = read_bytes(reader, count);
+    if(code != NULL && count > 0){
+        uint8_t* bytes = ALLOCATE(vm, uint8_t, count);
+        int* lines = ALLOCATE(vm, int, count);
+        memcpy(bytes, code, count);
+        chunk->code = bytes;
+        chunk->lines = lines;
+        chunk->count = count;
+        chunk->capacity = count;
+    }
+
+    int runs = read_count(reader, count);
+    int filled = 0;
+    for (int i = 0; i < runs && reader->ok; i++) {
+        int line = (int)read_u32(reader);
+        uint32_t length = read_u32(reader);
+        if(length > (uint32_t)(count - filled)){
+            reader->ok = false;
+            break;
+        }
+        for (uint32_t j = 0; j < length; j++) {
+            chunk->lines[filled++] = line;
+        }
+    }
+    if(filled != count) reader->ok = false;
+}
+
+static ObjFunction* read_function(Reader* reader){
+    RotoVM* vm = reader->vm;
+    if(++reader->depth > FUNCTION_DEPTH_MAX) reader->ok = false;
+    if(!reader->ok) return NULL;
+
+    ObjFunction* function = newFunction(vm);
+    push(vm, OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+
+    uint8_t flags = read_u8(reader);
+    function->registers = (flags & FUNCTION_REGISTERS) != 0;
+    if(flags & FUNCTION_NAMED) function->name = read_string(reader);
+    function->arity = read_u16(reader);
+    function->upvalue_count = read_u16(reader);
+    function->max_slots = (int)read_u32(reader);
+    uint32_t caches = read_u32(reader);
+    if(caches > NO_CACHE) reader->ok = false;
+    init_caches(vm, chunk, reader->ok ? (int)caches : 0);
+
+    int constant_count = read_count(reader, UINT8_COUNT);
+    for (int i = 0; i < constant_count && reader->ok; i++) {
+        Value value = NIL_VAL;
+        switch (read_u8(reader)) {
+            case CONSTANT_NIL: break;
+            case CONSTANT_FALSE: value = BOOL_VAL(false); break;
+            case CONSTANT_TRUE: value = BOOL_VAL(true); break;
+            case CONSTANT_NUMBER:{
+                uint64_t bits = read_u64(reader);
+                double number;
+                memcpy(&number, &bits, sizeof(double));
+                value = exact_number(number);
+                break;
+            }
+            case CONSTANT_STRING:{
+                ObjString* string = read_string(reader);
+                if(string != NULL) value = OBJ_VAL(string);
+                break;
+            }
+            case CONSTANT_FUNCTION:{
+                ObjFunction* nested = read_function(reader);
+                if(nested != NULL) value = OBJ_VAL(nested);
+                break;
+            }
+            default:
+                reader->ok = false;
+                break;
+        }
+        if(reader->ok) add_constant(vm, chunk, value);
+    }
+
+    read_code(reader, chunk);
+
+    relink(reader, chunk);
+    pop(vm);
+    reader->depth--;
+    return reader->ok ? function : NULL;
+}
+
+ObjFunction* read_bytecode(RotoVM* vm, const uint8_t* data, size_t size, uint64_t* source_hash){
+    if(!is_bytecode(data, size) || !check_sum(data, &size)) return NULL;
+
+    Reader reader;
+    reader.vm = vm;
+    reader.at = data + MAGIC_LENGTH;
+    reader.end = data + size;
+    reader.ok = true;
+    reader.depth = 0;
+    reader.globals = NULL;
+    reader.global_count = 0;
+    reader.methods = NULL;
+    reader.method_count = 0;
+    reader.objects = NULL;
+    reader.object_count = 0;
+
+    if(read_u16(&reader) != BYTECODE_VERSION || read_u16(&reader) != opcode_count) return NULL;
+    *source_hash = read_u64(&reader);
+
+    ObjFunction* function = NULL;
+    if(read_names(&reader, GLOBALS_MAX, true, &reader.globals, &reader.global_count) &&
+       read_names(&reader, METHODS_MAX, false, &reader.methods, &reader.method_count)){
+        function = read_function(&reader);
+    }
+    FREE_ARRAY(vm, int, reader.globals, reader.global_count);
+    FREE_ARRAY(vm, int, reader.methods, reader.method_count);
+
+    if(!reader.ok || reader.at != reader.end) return NULL;
+    return function;
+}
+
+//heap images: every object the vm can reach between scripts, plus its globals,
+//method names and list methods. objects refer to each other by index
+#define IMAGE_MAGIC "RIMG"
+//reference to no object
+#define NO_OBJECT UINT32_MAX
+
+typedef enum{
+    IMAGE_NIL,
+    IMAGE_FALSE,
+    IMAGE_TRUE,
+    IMAGE_UNDEFINED,
+    IMAGE_INT,
+    IMAGE_DOUBLE,
+    IMAGE_OBJECT
+}ImageTag;
+
+//objects are written in this order of types, so the few a shell needs
+//(a closure's function, an instance's class and shape) come before it
+static const ObjType image_order[] = {
+    OBJ_STRING, OBJ_NATIVE, OBJ_FUNCTION, OBJ_SHAPE, OBJ_CLASS,
+    OBJ_CLOSURE, OBJ_INSTANCE, OBJ_LIST, OBJ_BOUND_METHOD, OBJ_UPVALUE,
+};
+#define IMAGE_TYPES ((int)(sizeof(image_order) / sizeof(image_order[0])))
+
+struct ObjectIndex{
+    Obj* object;
+    uint32_t index;
+};
+
+static int compare_objects(const void* a, const void* b){
+    uintptr_t left = (uintptr_t)((const ObjectIndex*)a)->object;
+    uintptr_t right = (uintptr_t)((const ObjectIndex*)b)->object;
+    return left < right ? -1 : left > right;
+}
+
+static void write_ref(Writer* writer, Obj* object){
+    if(object == NULL){
+        write_u32(writer, NO_OBJECT);
+        return;
+    }
+    ObjectIndex key = {object, 0};
+    ObjectIndex* found = bsearch(&key, writer->index, writer->object_count,
+                                 sizeof(ObjectIndex), compare_objects);
+    write_u32(writer, found->index);
+}
+
+static void write_value(Writer* writer, Value value){
+    if(IS_OBJ(value)){
+        write_u8(writer, IMAGE_OBJECT);
+        write_ref(writer, AS_OBJ(value));
+    }else if(IS_NIL(value)){
+        write_u8(writer, IMAGE_NIL);
+    }else if(IS_BOOL(value)){
+        write_u8(writer, AS_BOOL(value) ? IMAGE_TRUE : IMAGE_FALSE);
+    }else if(IS_UNDEFINED(value)){
+        write_u8(writer, IMAGE_UNDEFINED);
+    }else if(IS_INT(value)){
+        write_u8(writer, IMAGE_INT);
+        write_u64(writer, (uint64_t)AS_INT(value));
+    }else{
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(double));
+        write_u8(writer, IMAGE_DOUBLE);
+        write_u64(writer, bits);
+    }
+}
+
+static void write_values(Writer* writer, ValueArray* array){
+    write_u32(writer, (uint32_t)array->count);
+    for (int i = 0; i < array->count; i++) {
+        write_value(writer, array->values[i]);
+    }
+}
+
+static void write_table(Writer* writer, Table* table){
+    uint32_t count = 0;
+    for (int i = 0; i <= table->capacity && table->entries != NULL; i++) {
+        if(table->entries[i].key != NULL) count++;
+    }
+    write_u32(writer, count);
+    for (int i = 0; i <= table->capacity && table->entries != NULL; i++) {
+        Entry* entry = &table->entries[i];
+        if(entry->key == NULL) continue;
+        write_ref(writer, (Obj*)entry->key);
+        write_value(writer, entry->value);
+    }
+}
+
+//what it takes to allocate the object before anything it refers to exists
+static bool write_shell(Writer* writer, Obj* object){
+    write_u8(writer, (uint8_t)object->type);
+    switch (object->type) {
+        case OBJ_STRING:
+            write_string(writer, (ObjString*)object);
+            break;
+        case OBJ_NATIVE:{
+            int number = native_number(((ObjNative*)object)->function);
+            if(number == -1) return false;
+            write_u32(writer, (uint32_t)number);
+            break;
+        }
+        case OBJ_FUNCTION:
+            write_u16(writer, (uint16_t)((ObjFunction*)object)->upvalue_count);
+            break;
+        case OBJ_CLOSURE:
+            write_ref(writer, (Obj*)((ObjClosure*)object)->function);
+            break;
+        case OBJ_INSTANCE:{
+            ObjInstance* instance = (ObjInstance*)object;
+            write_ref(writer, (Obj*)instance->klass);
+            write_ref(writer, (Obj*)instance->shape);
+            write_u32(writer, (uint32_t)instance->inline_capacity);
+            break;
+        }
+        default:
+            break;
+    }
+    return true;
+}
+
+static void write_contents(Writer* writer, Obj* object){
+    switch (object->type) {
+        case OBJ_FUNCTION:{
+            ObjFunction* function = (ObjFunction*)object;
+            write_u8(writer, function->registers ? FUNCTION_REGISTERS : 0);
+            write_ref(writer, (Obj*)function->name);
+            write_u16(writer, (uint16_t)function->arity);
+            write_u32(writer, (uint32_t)function->max_slots);
+            write_u32(writer, (uint32_t)function->chunk.cache_count);
+            write_values(writer, &function->chunk.constants);
+            write_code(writer, &function->chunk);
+            break;
+        }
+        case OBJ_SHAPE:{
+            ObjShape* shape = (ObjShape*)object;
+            write_u32(writer, (uint32_t)shape->field_count);
+            write_u8(writer, shape->dictionary);
+            write_table(writer, &shape->slots);
+            write_table(writer, &shape->transitions);
+            break;
+        }
+        case OBJ_CLASS:{
+            ObjClass* klass = (ObjClass*)object;
+            write_ref(writer, (Obj*)klass->name);
+            write_values(writer, &klass->methods);
+            write_value(writer, klass->initializer);
+            write_ref(writer, (Obj*)klass->shape);
+            write_u32(writer, (uint32_t)klass->field_hint);
+            write_u8(writer, klass->field_shadows_method);
+            break;
+        }
+        case OBJ_CLOSURE:{
+            ObjClosure* closure = (ObjClosure*)object;
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                write_ref(writer, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_INSTANCE:{
+            ObjInstance* instance = (ObjInstance*)object;
+            write_u32(writer, (uint32_t)instance->shape->field_count);
+            for (int i = 0; i < instance->shape->field_count; i++) {
+                write_value(writer, instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_LIST:
+            write_values(writer, &((ObjList*)object)->values);
+            break;
+        case OBJ_BOUND_METHOD:{
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            write_value(writer, bound->receiver);
+            write_ref(writer, (Obj*)bound->method);
+            break;
+        }
+        case OBJ_UPVALUE:
+            write_value(writer, ((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+bool write_image(RotoVM* vm, FILE* file){
+    if(!compile_skimmed(vm, NULL)) return false;
+    int count = 0;
+    for (Obj* object = pool_first(&vm->pool); object != NULL; object = pool_next(&vm->pool, object)) count++;
+    Obj** order = malloc(sizeof(Obj*) * (count + 1));
+    ObjectIndex* index = malloc(sizeof(ObjectIndex) * (count + 1));
+    if(order == NULL || index == NULL){
+        free(order);
+        free(index);
+        return false;
+    }
+    int placed = 0;
+    for (int type = 0; type < IMAGE_TYPES; type++) {
+        for (Obj* object = pool_first(&vm->pool); object != NULL; object = pool_next(&vm->pool, object)) {
+            if(object->type == image_order[type]) order[placed++] = object;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        index[i].object = order[i];
+        index[i].index = (uint32_t)i;
+    }
+    qsort(index, count, sizeof(ObjectIndex), compare_objects);
+
+    Writer writer;
+    writer.file = file;
+    writer.checksum = CHECKSUM_SEED;
+    writer.index = index;
+    writer.object_count = count;
+    write_bytes(&writer, IMAGE_MAGIC, MAGIC_LENGTH);
+    write_u16(&writer, BYTECODE_VERSION);
+    write_u16(&writer, (uint16_t)opcode_count);
+    write_u8(&writer, (uint8_t)vm->backend);
+
+    bool ok = true;
+    write_u32(&writer, (uint32_t)count);
+    for (int i = 0; i < count && ok; i++) {
+        ok = write_shell(&writer, order[i]);
+    }
+    for (int i = 0; i < count && ok; i++) {
+        write_contents(&writer, order[i]);
+    }
+    if(ok){
+        write_values(&writer, &vm->global_names);
+        write_values(&writer, &vm->global_values);
+        write_values(&writer, &vm->method_names);
+        write_ref(&writer, (Obj*)vm->init_string);
+        write_table(&writer, &vm->listMethods);
+        write_u64(&writer, writer.checksum);
+    }
+    free(order);
+    free(index);
+    return ok && !ferror(file);
+}
+
+//object the index names, which must be of type when that isn't -1. NULL for no object
+static Obj* read_ref(Reader* reader, int type){
+    uint32_t index = read_u32(reader);
+    if(!reader->ok || index == NO_OBJECT) return NULL;
+    if(index >= (uint32_t)reader->object_count ||
+       (type != -1 && reader->objects[index]->type != (ObjType)type)){
+        reader->ok = false;
+        return NULL;
+    }
+    return reader->objects[index];
+}
+
+static Value read_value(Reader* reader){
+    switch (read_u8(reader)) {
+        case IMAGE_NIL: return NIL_VAL;
+        case IMAGE_FALSE: return BOOL_VAL(false);
+        case IMAGE_TRUE: return BOOL_VAL(true);
+        case IMAGE_UNDEFINED: return UNDEFINED_VAL;
+        case IMAGE_INT: return int_value((int64_t)read_u64(reader));
+        case IMAGE_DOUBLE:{
+            uint64_t bits = read_u64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(double));
+            return NUMBER_VAL(number);
+        }
+        case IMAGE_OBJECT:{
+            Obj* object = read_ref(reader, -1);
+            if(object != NULL) return OBJ_VAL(object);
+            reader->ok = false;
+            return NIL_VAL;
+        }
+        default:
+            reader->ok = false;
+            return NIL_VAL;
+    }
+}
+
+static void read_values(Reader* reader, ValueArray* array){
+    int count = read_count(reader, INT32_MAX);
+    for (int i = 0; i < count && reader->ok; i++) {
+        write_val_array(reader->vm, array, read_value(reader));
+    }
+}
+
+static void read_table(Reader* reader, Table* table){
+    int count = read_count(reader, INT32_MAX);
+    for (int i = 0; i < count && reader->ok; i++) {
+        ObjString* key = (ObjString*)read_ref(reader, OBJ_STRING);
+        Value value = read_value(reader);
+        if(key == NULL) reader->ok = false;
+        if(reader->ok) table_set(reader->vm, table, key, value);
+    }
+}
+
+static Obj* read_shell(Reader* reader){
+    RotoVM* vm = reader->vm;
+    switch (read_u8(reader)) {
+        case OBJ_STRING: return (Obj*)read_string(reader);
+        case OBJ_NATIVE:{
+            NativeFn function = native_by_number((int)read_u32(reader));
+            return function == NULL ? NULL : (Obj*)newNative(vm, function);
+        }
+        case OBJ_FUNCTION:{
+            ObjFunction* function = newFunction(vm);
+            function->upvalue_count = read_u16(reader);
+            return (Obj*)function;
+        }
+        case OBJ_SHAPE: return (Obj*)newShape(vm);
+        case OBJ_CLASS: return (Obj*)newClass(vm, NULL);
+        case OBJ_CLOSURE:{
+            ObjFunction* function = (ObjFunction*)read_ref(reader, OBJ_FUNCTION);
+            return function == NULL ? NULL : (Obj*)newClosure(vm, function);
+        }
+        case OBJ_INSTANCE:{
+            ObjClass* klass = (ObjClass*)read_ref(reader, OBJ_CLASS);
+            ObjShape* shape = (ObjShape*)read_ref(reader, OBJ_SHAPE);
+            uint32_t inline_capacity = read_u32(reader);
+            if(klass == NULL || shape == NULL || inline_capacity > INSTANCE_INLINE_MAX) return NULL;
+            return (Obj*)newInstanceOf(vm, klass, shape, (int)inline_capacity);
+        }
+        case OBJ_LIST: return (Obj*)newList(vm);
+        case OBJ_BOUND_METHOD: return (Obj*)newBoundMethod(vm, NIL_VAL, NULL);
+        case OBJ_UPVALUE:{
+            ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+            upvalue->location = &upvalue->closed;
+            return (Obj*)upvalue;
+        }
+        default:
+            return NULL;
+    }
+}
+
+static void read_contents(Reader* reader, Obj* object){
+    RotoVM* vm = reader->vm;
+    switch (object->type) {
+        case OBJ_FUNCTION:{
+            ObjFunction* function = (ObjFunction*)object;
+            function->registers = (read_u8(reader) & FUNCTION_REGISTERS) != 0;
+            function->name = (ObjString*)read_ref(reader, OBJ_STRING);
+            function->arity = read_u16(reader);
+            function->max_slots = (int)read_u32(reader);
+            uint32_t caches = read_u32(reader);
+            if(caches > NO_CACHE) reader->ok = false;
+            //caches start out empty, they'd point at shapes and classes of the old heap
+            init_caches(vm, &function->chunk, reader->ok ? (int)caches : 0);
+            read_values(reader, &function->chunk.constants);
+            read_code(reader, &function->chunk);
+            break;
+        }
+        case OBJ_SHAPE:{
+            ObjShape* shape = (ObjShape*)object;
+            shape->field_count = (int)read_u32(reader);
+            shape->dictionary = read_u8(reader) != 0;
+            read_table(reader, &shape->slots);
+            read_table(reader, &shape->transitions);
+            break;
+        }
+        case OBJ_CLASS:{
+            ObjClass* klass = (ObjClass*)object;
+            klass->name = (ObjString*)read_ref(reader, OBJ_STRING);
+            read_values(reader, &klass->methods);
+            klass->initializer = read_value(reader);
+            klass->shape = (ObjShape*)read_ref(reader, OBJ_SHAPE);
+            klass->field_hint = (int)read_u32(reader);
+            klass->field_shadows_method = read_u8(reader) != 0;
+            if(klass->field_hint > INSTANCE_INLINE_MAX) reader->ok = false;
+            break;
+        }
+        case OBJ_CLOSURE:{
+            ObjClosure* closure = (ObjClosure*)object;
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                closure->upvalues[i] = (ObjUpvalue*)read_ref(reader, OBJ_UPVALUE);
+            }
+            break;
+        }
+        case OBJ_INSTANCE:{
+            ObjInstance* instance = (ObjInstance*)object;
+            int count = read_count(reader, INT32_MAX);
+            if(count > instance->inline_capacity){
+                instance->fields = ALLOCATE(vm, Value, count);
+                instance->field_capacity = count;
+            }
+            for (int i = 0; i < instance->field_capacity; i++) {
+                instance->fields[i] = i < count && reader->ok ? read_value(reader) : NIL_VAL;
+            }
+            break;
+        }
+        case OBJ_LIST:
+            read_values(reader, &((ObjList*)object)->values);
+            break;
+        case OBJ_BOUND_METHOD:{
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            bound->receiver = read_value(reader);
+            bound->method = (ObjClosure*)read_ref(reader, OBJ_CLOSURE);
+            if(bound->method == NULL) reader->ok = false;
+            break;
+        }
+        case OBJ_UPVALUE:
+            ((ObjUpvalue*)object)->closed = read_value(reader);
+            break;
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+//the shells are made first so references in the contents can be resolved as
+//they're read. the collector stays off until the heap is whole
+bool read_image(RotoVM* vm, const uint8_t* data, size_t size){
+    if(size < MAGIC_LENGTH || memcmp(data, IMAGE_MAGIC, MAGIC_LENGTH) != 0 ||
+       !check_sum(data, &size)) return false;
+    Reader reader;
+    reader.vm = vm;
+    reader.at = data + MAGIC_LENGTH;
+    reader.end = data + size;
+    reader.ok = true;
+    reader.depth = 0;
+    reader.globals = NULL;
+    reader.global_count = 0;
+    reader.methods = NULL;
+    reader.method_count = 0;
+    reader.objects = NULL;
+    reader.object_count = 0;
+
+    if(read_u16(&reader) != BYTECODE_VERSION || read_u16(&reader) != opcode_count) return false;
+    uint8_t backend = read_u8(&reader);
+    if(backend != BACKEND_STACK && backend != BACKEND_REGISTER) return false;
+    vm->backend = (RotoBackend)backend;
+
+    vm->gc_paused = true;
+    int count = read_count(&reader, INT32_MAX);
+    reader.objects = malloc(sizeof(Obj*) * (count + 1));
+    if(reader.objects == NULL) reader.ok = false;
+    for (int i = 0; i < count && reader.ok; i++) {
+        Obj* object = read_shell(&reader);
+        if(object == NULL){
+            reader.ok = false;
+            break;
+        }
+        reader.objects[reader.object_count++] = object;
+    }
+    for (int i = 0; i < reader.object_count && reader.ok; i++) {
+        read_contents(&reader, reader.objects[i]);
+    }
+    //shapes are checked once they're all filled in
+    for (int i = 0; i < reader.object_count && reader.ok; i++) {
+        Obj* object = reader.objects[i];
+        if(object->type != OBJ_INSTANCE) continue;
+        ObjInstance* instance = (ObjInstance*)object;
+        if(instance->shape->field_count > instance->field_capacity) reader.ok = false;
+    }
+
+    read_values(&reader, &vm->global_names);
+    read_values(&reader, &vm->global_values);
+    read_values(&reader, &vm->method_names);
+    if(vm->global_names.count != vm->global_values.count ||
+       vm->global_names.count > GLOBALS_MAX || vm->method_names.count > METHODS_MAX){
+        reader.ok = false;
+    }
+    for (int i = 0; i < vm->global_names.count && reader.ok; i++) {
+        if(!IS_STRING(vm->global_names.values[i])) reader.ok = false;
+        else table_set(vm, &vm->global_slots, AS_STRING(vm->global_names.values[i]), NUMBER_VAL(i));
+    }
+    for (int i = 0; i < vm->method_names.count && reader.ok; i++) {
+        if(!IS_STRING(vm->method_names.values[i])) reader.ok = false;
+        else table_set(vm, &vm->method_symbols, AS_STRING(vm->method_names.values[i]), NUMBER_VAL(i));
+    }
+    vm->init_string = (ObjString*)read_ref(&reader, OBJ_STRING);
+    if(vm->init_string == NULL) reader.ok = false;
+    else vm->init_symbol = find_method_symbol(vm, vm->init_string);
+    read_table(&reader, &vm->listMethods);
+
+    free(reader.objects);
+    vm->gc_paused = false;
+    return reader.ok && reader.at == reader.end && vm->init_symbol != -1;
+}
@@ -0,0 +1,35 @@
+#ifndef croto_serialize_h
+#define croto_serialize_h
+
+#include "object.h"
+#include "vm.h"
+
+//precompiled bytecode files. the layout, all integers little endian:
+//  header   "ROTO", u16 format version, u16 opcode count, u64 source hash
+//  globals  u32 count, then each global name the code may refer to by slot
+//  methods  u32 count, then each method name the code may refer to by symbol
+//  function the script, written as below
+//  checksum u64 over everything before it
+//function: u8 flags, name if it has one, u16 arity, u16 upvalue count,
+//u32 max slots, u32 inline caches, constants, code, line runs.
+//global slots and method symbols are numbered per vm, so the loader maps
+//every such operand through the names in the file.
+//strings are a u32 length and the bytes, numbers the bits of a double.
+#define BYTECODE_VERSION 1
+
+//true when data starts like a bytecode file, whatever its version
+bool is_bytecode(const uint8_t* data, size_t size);
+//function must not have run yet: quickened instructions aren't written out
+bool write_bytecode(RotoVM* vm, ObjFunction* function, uint64_t source_hash, FILE* file);
+//NULL when the data is truncated, corrupt or from another version
+ObjFunction* read_bytecode(RotoVM* vm, const uint8_t* data, size_t size, uint64_t* source_hash);
+
+//heap images use the same encoding: "RIMG", u16 format version, u16 opcode count,
+//u8 back end, the objects, then the vm's globals, method names, init string and
+//list methods. each object is written twice, first what it takes to allocate it,
+//then once every object exists, its contents, with references as object indices.
+bool write_image(RotoVM* vm, FILE* file);
+//vm must be fresh from new_vm, with nothing defined yet
+bool read_image(RotoVM* vm, const uint8_t* data, size_t size);
+
+#endif
@@ -52,6 +52,15 @@ bool table_get(Table* table, ObjString* key, Value* value){
   return true;
 }
 
+//entry holding key, NULL when absent. the entry moves if the table grows
+Entry* table_find(Table* table, ObjString* key){
+  if(table->count == 0) return NULL;
+
+  Entry* entry = find_entry(table->entries, table->capacity, key);
+  if(entry->key == NULL) return NULL;
+  return entry;
+}
+
 static void adjust_capacity(RotoVM* vm,Table* table, int capacity) {
   Entry* entries = ALLOCATE(vm,Entry, capacity + 1);
   for (int i = 0; i <= capacity; i++) {
@@ -19,6 +19,7 @@ typedef struct{//ratio of count to capacity gives loadfactor of table
 void init_table(Table* table);
 void free_table(RotoVM* vm,Table* table);
 bool table_get(Table* table, ObjString* key, Value* value);
+Entry* table_find(Table* table, ObjString* key);
 bool table_set(RotoVM* vm,Table* table, ObjString* key, Value value);
 bool table_delete(Table* table, ObjString* key);
 void table_add_all(RotoVM* vm,Table* from, Table* to);
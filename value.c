@@ -44,6 +44,7 @@ void print_value(Value value){
     case VAL_NIL: break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
     case VAL_OBJ: print_object(value); break;
+    case VAL_UNDEFINED: break;
   }
 #endif
 }
@@ -62,6 +63,7 @@ bool vals_equal(Value a, Value b){
     case VAL_NIL: return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_UNDEFINED: return true;
   }
 #endif
 }
@@ -17,16 +17,31 @@ typedef struct sObjString ObjString;
 #define TAG_NIL   1    //01.
 #define TAG_FALSE 2  //10.
 #define TAG_TRUE  3 //11.
+#define TAG_UNDEFINED 4 //100. only ever in unassigned global slots
+//integers: quiet nan with bit 49 set and a 48 bit two's complement payload,
+//so the top 16 bits of an integer are always INT_TOP
+#define TAG_INT ((uint64_t)1 << 49)
+#define INT_TOP ((QNAN | TAG_INT) >> 48)
+#define INT_MAX_VALUE (((int64_t)1 << 47) - 1)
+#define INT_MIN_VALUE (-((int64_t)1 << 47))
+//fits the payload when sign extending its low 48 bits gives it back
+#define IN_INT_RANGE(i) ((int64_t)((uint64_t)(i) << 16) >> 16 == (i))
 typedef uint64_t Value;
 
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)      ((value) == NIL_VAL)
-#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_DOUBLE(value)  (((value) & QNAN) != QNAN)
+#define IS_INT(value) ((value) >> 48 == INT_TOP)
+#define IS_NUMBER(value)  (IS_DOUBLE(value) || IS_INT(value))
+#define IS_INTS(a, b) (IS_INT(a) && IS_INT(b))
 #define IS_OBJ(value) \
         (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)  ((value) == TRUE_VAL)
 #define AS_NUMBER(value) value_to_num(value)
+#define AS_DOUBLE(value) value_to_double(value)
+#define AS_INT(value) ((int64_t)((value) << 16) >> 16)
 #define AS_OBJ(value) \
         ((Obj*) (uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -34,7 +49,9 @@ typedef uint64_t Value;
 #define FALSE_VAL     ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL     ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL     ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) num_to_value(num)
+#define INT_VAL(i) ((Value)(QNAN | TAG_INT | ((uint64_t)(i) << 16 >> 16)))
 #define OBJ_VAL(obj) \
         (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -44,7 +61,7 @@ static inline Value num_to_value(double num){
     return value;
 }
 
-static inline double value_to_num(Value value){
+static inline double value_to_double(Value value){
 #if 0
     union {
         uint64_t bits;
@@ -57,13 +74,19 @@ static inline double value_to_num(Value value){
     memcpy(&num,&value,sizeof(Value));
     return num;
 }
+
+static inline double value_to_num(Value value){
+    if(!IS_DOUBLE(value)) return (double)AS_INT(value);
+    return value_to_double(value);
+}
 #else
 
 typedef enum{
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
-  VAL_OBJ
+  VAL_OBJ,
+  VAL_UNDEFINED//only ever in unassigned global slots
 }ValueType;
 
 /*
@@ -83,6 +106,7 @@ typedef struct {
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
@@ -92,11 +116,38 @@ typedef struct {
 
 #define BOOL_VAL(value)   ((Value){ VAL_BOOL, {.boolean = value } })
 #define NIL_VAL           ((Value){ VAL_NIL, {.number = 0 } })
+#define UNDEFINED_VAL     ((Value){ VAL_UNDEFINED, {.number = 0 } })
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, {.number = value } })
 #define OBJ_VAL(object)   ((Value){ VAL_OBJ, {.obj = (Obj*)object}})
 
+//without nan boxing every number is a double
+#define INT_MAX_VALUE ((int64_t)1 << 53)
+#define INT_MIN_VALUE (-((int64_t)1 << 53))
+#define IN_INT_RANGE(i) ((i) >= INT_MIN_VALUE && (i) <= INT_MAX_VALUE)
+#define IS_DOUBLE(value) IS_NUMBER(value)
+#define IS_INT(value) false
+#define IS_INTS(a, b) false
+#define AS_DOUBLE(value) AS_NUMBER(value)
+#define AS_INT(value) ((int64_t)AS_NUMBER(value))
+#define INT_VAL(i) NUMBER_VAL((double)(i))
+
 #endif
 
+//integer result of integer operands, a double once it leaves the integer range
+static inline Value int_value(int64_t i){
+  if(!IN_INT_RANGE(i)) return NUMBER_VAL((double)i);
+  return INT_VAL(i);
+}
+
+//number as an integer when it is one and fits, so literals start out exact
+static inline Value exact_number(double num){
+  if(num >= (double)INT_MIN_VALUE && num <= (double)INT_MAX_VALUE &&
+     num == (double)(int64_t)num && !(num == 0 && 1 / num < 0)){
+    return INT_VAL((int64_t)num);
+  }
+  return NUMBER_VAL(num);
+}
+
 typedef struct{
   /* data */
   int capacity;
@@ -9,6 +9,7 @@
 #include "compiler.h"
 #include "memory.h"
 #include "native.h"
+#include "serialize.h"
 
 
 
@@ -48,15 +49,6 @@ void runtime_error(RotoVM* vm,const char *format, ...){
     reset_stack(vm);
 }
 
-//native methods
-static Value length_method(RotoVM* vm, int arg_count, Value* args){
-    if(arg_count != 0){
-        runtime_error(vm,"Expected no arguments but got %d.", arg_count);
-        return NIL_VAL;
-    }
-    ObjList* list = AS_LIST(args[0]);
-    return NUMBER_VAL(list->values.count);
-}
 
 
 
@@ -69,24 +61,70 @@ static void define_ntv_methods(RotoVM* vm, const char* name, NativeFn function)
     pop(vm);
 }
 
-RotoVM* init_vm(RotoReallocFn reallocfn){
+//vm with nothing defined in it yet
+static RotoVM* new_vm(RotoReallocFn reallocfn){
 
     RotoVM *vm = reallocfn(NULL, 0, sizeof(RotoVM));
 
+    vm->stack = NULL;
+    vm->stack_capacity = 0;
+    vm->frames = NULL;
+    vm->frame_capacity = 0;
     reset_stack(vm);
-    vm->objects = NULL;
+    init_pool(&vm->pool);
+    vm->gc_paused = false;
+    vm->parser = NULL;
     vm->bytes_alocated = 0;
     vm->next_gc = 1024 * 1024;
-    vm->gray_count = 0;
-    vm->gray_capacity = 0;
-    vm->gray_stack = NULL;
+    vm->gray.count = 0;
+    vm->gray.capacity = 0;
+    vm->gray.stack = NULL;
+    vm->gray.shared = false;
+    vm->gc_threads = 1;
+    vm->gc_phase = GC_IDLE;
+    vm->gc_slice = 0;
+    vm->gc_debt = 0;
+    vm->gray_list = NULL;
+    vm->gray_list_next = 0;
+    vm->nursery = NULL;
+    vm->nursery_top = NULL;
+    vm->nursery_limit = NULL;
+    vm->nursery_end = NULL;
+    vm->remembered_count = 0;
+    vm->remembered_capacity = 0;
+    vm->remembered = NULL;
+    memset(&vm->gc_stats, 0, sizeof(vm->gc_stats));
 
     vm->next_op_wide--;
-    init_table(&vm->globals);
+    vm->backend = BACKEND_STACK;
+    vm->lazy_bodies = false;
+    vm->tail_call = false;
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    vm->instruction_count = 0;
+#endif
+    init_table(&vm->global_slots);
+    init_val_array(&vm->global_values);
+    init_val_array(&vm->global_names);
+    init_table(&vm->method_symbols);
+    init_val_array(&vm->method_names);
     init_table(&vm->strings);
     init_table(&vm->listMethods);
     vm->init_string = NULL;
+
+    vm->stack = GROW_ARRAY(vm, vm->stack, Value, 0, STACK_INITIAL);
+    vm->stack_capacity = STACK_INITIAL;
+    vm->frames = GROW_ARRAY(vm, vm->frames, CallFrame, 0, FRAMES_INITIAL);
+    vm->frame_capacity = FRAMES_INITIAL;
+    reset_stack(vm);
+    set_nursery_size(vm, NURSERY_SIZE);
+    return vm;
+}
+
+RotoVM* init_vm(RotoReallocFn reallocfn){
+    RotoVM* vm = new_vm(reallocfn);
+
     vm->init_string = copy_string(vm,"init",4);
+    vm->init_symbol = method_symbol(vm, vm->init_string);
 
 
     //native function definition
@@ -98,11 +136,98 @@ RotoVM* init_vm(RotoReallocFn reallocfn){
 
 }
 
+//vm rebuilt from a heap image instead of running the setup above. NULL when
+//the image is damaged or from another build
+RotoVM* init_vm_image(RotoReallocFn reallocfn, const void* image, size_t size){
+    RotoVM* vm = new_vm(reallocfn);
+    if(!read_image(vm, (const uint8_t*)image, size)){
+        free_vm(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+//write everything the vm holds between scripts to path. only the heap is
+//kept, so it has to be called with no script running
+bool save_vm_image(RotoVM* vm, const char* path){
+    if(vm->frameCount != 0 || vm->open_upvalues != NULL) return false;
+    reset_stack(vm);
+    //the image is written from the old heap's list
+    collect_young(vm);
+    collect_garbage(vm);
+    FILE* file = fopen(path, "wb");
+    if(file == NULL) return false;
+    bool ok = write_image(vm, file);
+    if(fclose(file) != 0) ok = false;
+    if(!ok) remove(path);
+    return ok;
+}
+
+//number name in symbols, the next free one the first time it's seen. -1 when
+//all max are taken
+static int add_symbol(RotoVM* vm, Table* symbols, ValueArray* names, ObjString* name, int max){
+    Value symbol;
+    if(table_get(symbols, name, &symbol)) return (int)AS_NUMBER(symbol);
+    if(names->count == max) return -1;
+
+    int index = names->count;
+    push(vm,OBJ_VAL(name));
+    write_val_array(vm,names, OBJ_VAL(name));
+    table_set(vm,symbols, name, NUMBER_VAL(index));
+    pop(vm);
+    return index;
+}
+
+//slot of the global name, handed out undefined the first time the name is seen.
+//-1 once every slot is taken
+int global_slot(RotoVM* vm, ObjString* name){
+    int slot = add_symbol(vm, &vm->global_slots, &vm->global_names, name, GLOBALS_MAX);
+    if(slot == vm->global_values.count){
+        write_val_array(vm,&vm->global_values, UNDEFINED_VAL);
+    }
+    return slot;
+}
+
+//methods are stored by symbol rather than name, so dispatch is an array index
+int method_symbol(RotoVM* vm, ObjString* name){
+    return add_symbol(vm, &vm->method_symbols, &vm->method_names, name, METHODS_MAX);
+}
+
+//symbol of a name some class may have as a method, -1 when none can
+int find_method_symbol(RotoVM* vm, ObjString* name){
+    Value symbol;
+    if(!table_get(&vm->method_symbols, name, &symbol)) return -1;
+    return (int)AS_NUMBER(symbol);
+}
+
+void set_backend(RotoVM* vm, RotoBackend backend){
+    vm->backend = backend;
+}
+
+void set_lazy_bodies(RotoVM* vm, bool lazy){
+    vm->lazy_bodies = lazy;
+}
+
+RotoGcStats gc_stats(RotoVM* vm){
+    RotoGcStats stats = vm->gc_stats;
+    stats.heap_bytes = vm->pool.page_count * POOL_PAGE_SIZE;
+    return stats;
+}
+
 void free_vm(RotoVM* vm) {
   /* code */
-  free_table(vm,&vm->globals);
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+  fprintf(stderr, "instructions executed: %lu\n", vm->instruction_count);
+#endif
+  free_table(vm,&vm->global_slots);
+  free_val_array(vm,&vm->global_values);
+  free_val_array(vm,&vm->global_names);
+  free_table(vm,&vm->method_symbols);
+  free_val_array(vm,&vm->method_names);
   free_table(vm,&vm->strings);
   free_table(vm,&vm->listMethods);
+  FREE_ARRAY(vm, Value, vm->stack, vm->stack_capacity);
+  FREE_ARRAY(vm, CallFrame, vm->frames, vm->frame_capacity);
   vm->init_string = NULL;
   free_objects(vm);
 }
@@ -122,20 +247,89 @@ static Value peek(RotoVM* vm, int distance){
   return vm->stack_top[-1 - distance];
 }
 
+static void close_upvalues(RotoVM* vm, Value* last);
+
+//makes room for count more values above slots, moving the whole stack when it
+//has to grow. everything pointing into it (frames, open upvalues) is moved along
+static bool ensure_stack(RotoVM* vm, Value** slots, int count){
+    int needed = (int)(*slots - vm->stack) + count;
+    if(needed <= vm->stack_capacity) return true;
+    if(needed > STACK_MAX){
+        runtime_error(vm,"Stack overflow.");
+        return false;
+    }
+    int capacity = vm->stack_capacity;
+    while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+    if(capacity > STACK_MAX) capacity = STACK_MAX;
+
+    Value* old = vm->stack;
+    vm->stack = GROW_ARRAY(vm, vm->stack, Value, vm->stack_capacity, capacity);
+    vm->stack_capacity = capacity;
+    if(vm->stack == old) return true;
+
+    vm->stack_top = vm->stack + (vm->stack_top - old);
+    *slots = vm->stack + (*slots - old);
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = vm->stack + (vm->frames[i].slots - old);
+    }
+    for (ObjUpvalue* upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = vm->stack + (upvalue->location - old);
+    }
+    return true;
+}
+
+static bool grow_frames(RotoVM* vm){
+    if(vm->frame_capacity == FRAMES_MAX){
+        runtime_error(vm,"Stack overflow.");
+        return false;
+    }
+    int capacity = GROW_CAPACITY(vm->frame_capacity);
+    if(capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+    vm->frames = GROW_ARRAY(vm, vm->frames, CallFrame, vm->frame_capacity, capacity);
+    vm->frame_capacity = capacity;
+    return true;
+}
+
 static bool call(RotoVM* vm, ObjClosure* closure, int arg_count){
+    if(closure->function->source != NULL && !compile_body(vm, closure->function)){
+        runtime_error(vm,"Could not compile %s.", closure->function->name->chars);
+        return false;
+    }
     if(arg_count != closure->function->arity) {
         runtime_error(vm,"Expected %d arguments but got %d.", closure->function->arity, arg_count);
         return false;
     }
-    if (vm->frameCount == FRAMES_MAX){
-        runtime_error(vm,"Stack overflow.");
+    Value* slots = vm->stack_top - arg_count - 1;
+    ObjFunction* function = closure->function;
+    if (vm->tail_call){
+        //the caller is returning this call's result, so the callee takes over
+        //its frame: callee and arguments slide down to where the caller began
+        CallFrame* frame = &vm->frames[vm->frameCount - 1];
+        vm->tail_call = false;
+        close_upvalues(vm, frame->slots);
+        memmove(frame->slots, slots, sizeof(Value) * (arg_count + 1));
+        slots = frame->slots;
+        vm->stack_top = slots + arg_count + 1;
+        vm->frameCount--;
+    }else if (vm->frameCount == vm->frame_capacity && !grow_frames(vm)){
+        return false;
+    }
+    //the only bounds check the call makes: nothing the body pushes goes past max_slots
+    if (!ensure_stack(vm, &slots, function->max_slots + STACK_RESERVE)){
         return false;
     }
+    if (function->registers){
+        //register code reads its slots in place, so they have to start out
+        //holding values the GC can look at
+        for (Value* slot = vm->stack_top; slot < slots + function->max_slots; slot++) {
+            *slot = NIL_VAL;
+        }
+    }
     CallFrame* frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = function->chunk.code;
 
-    frame->slots = vm->stack_top - arg_count - 1;
+    frame->slots = slots;
     return true;
 
 }
@@ -151,9 +345,8 @@ static bool call_value(RotoVM* vm, Value callee, int arg_count) {
             case OBJ_CLASS:{
                 ObjClass* klass = AS_CLASS(callee);
                 vm->stack_top[-arg_count - 1] = OBJ_VAL(newInstance(vm,klass));
-                Value initializer;
-                if(table_get(&klass->methods, vm->init_string,&initializer)){
-                    return call(vm, AS_CLOSURE(initializer), arg_count);
+                if(!IS_NIL(klass->initializer)){
+                    return call(vm, AS_CLOSURE(klass->initializer), arg_count);
                 }else if (arg_count != 0){
                     runtime_error(vm,"Expected 0 arguments but got %d.", arg_count);
                     return false;
@@ -188,10 +381,12 @@ static bool call_native_methods(RotoVM* vm,Value val, int arg_count){
 
 void append_to_list(RotoVM* vm,ObjList* list, Value value){
     write_val_array(vm,&list->values,value);
+    write_barrier(vm, (Obj*)list, value);
 }
 
-void store_to_list(ObjList* list, int index, Value value){
+static void store_to_list(RotoVM* vm, ObjList* list, int index, Value value){
     list->values.values[index] = value;
+    write_barrier(vm, (Obj*)list, value);
 }
 Value index_from_list(ObjList* list, int index){
     return list->values.values[index];
@@ -211,17 +406,124 @@ bool is_valid_list_index(ObjList* list, int index){
     return true;
 }
 
-static bool invoke_from_class(RotoVM* vm,ObjClass* klass, ObjString* name, int arg_count){
-    Value method;
-    if (!table_get(&klass->methods, name, &method)){
-        runtime_error(vm, "Undefined property '%s'.", name->chars);
+static bool invoke_from_class(RotoVM* vm,ObjClass* klass, int symbol, int arg_count){
+    Value method = class_method(klass, symbol);
+    if (IS_NIL(method)){
+        runtime_error(vm, "Undefined property '%s'.", METHOD_NAME(vm, symbol)->chars);
         return false;
     }
     return call(vm, AS_CLOSURE(method),arg_count);
 }
 
-static bool invoke(RotoVM* vm, ObjString* name, int arg_count){
+//inline caches: a field way maps the receiver's shape straight to a slot, a set
+//that added the field also remembers the shape it moved to, and a method way
+//remembers what the name resolved to on the receiver's class
+typedef enum{
+    PROPERTY_NONE,
+    PROPERTY_FIELD,
+    PROPERTY_METHOD,
+}PropertyKind;
+
+static void fill_cache(RotoVM* vm, InlineCache* cache, Obj* key, int field, Value method, Obj* transition){
+    if (cache == NULL) return;
+    //reuse the way of the same key and kind, else a free one, else evict the oldest
+    CacheWay* way = NULL;
+    for (int i = 0; i < CACHE_WAYS && way == NULL; i++){
+        CacheWay* candidate = &cache->ways[i];
+        if (candidate->key == key && (candidate->field == -1) == (field == -1)){
+            way = candidate;
+        }
+    }
+    for (int i = 0; i < CACHE_WAYS && way == NULL; i++){
+        if (cache->ways[i].key == NULL) way = &cache->ways[i];
+    }
+    if (way == NULL){
+        memmove(cache->ways, cache->ways + 1, sizeof(CacheWay) * (CACHE_WAYS - 1));
+        way = &cache->ways[CACHE_WAYS - 1];
+    }
+    way->key = key;
+    way->field = field;
+    way->method = method;
+    way->transition = transition;
+    //caches are only ever filled with classes, shapes and closures, never young
+    shade_object(vm, key);
+    shade_object(vm, transition);
+    if(IS_OBJ(method)) shade_object(vm, AS_OBJ(method));
+}
+
+//look name up on instance as a field, then as a method of its class. symbol is
+//name's method symbol, or -1 to have it looked up when needed
+static PropertyKind find_property(RotoVM* vm, InlineCache* cache, ObjInstance* instance,
+                                  ObjString* name, int symbol, Value* value){
+    ObjClass* klass = instance->klass;
+    if (cache != NULL){
+        for (int i = 0; i < CACHE_WAYS; i++){
+            CacheWay* way = &cache->ways[i];
+            if (way->key == (Obj*)instance->shape && way->transition == NULL){
+                *value = instance->fields[way->field];
+                return PROPERTY_FIELD;
+            }
+            if (way->key == (Obj*)klass && !klass->field_shadows_method){
+                *value = way->method;
+                return PROPERTY_METHOD;
+            }
+        }
+    }
+
+    int slot = shape_slot(instance->shape, name);
+    if (slot != -1){
+        fill_cache(vm, cache, (Obj*)instance->shape, slot, NIL_VAL, NULL);
+        *value = instance->fields[slot];
+        return PROPERTY_FIELD;
+    }
+    if (symbol == -1) symbol = find_method_symbol(vm, name);
+    *value = class_method(klass, symbol);
+    if (!IS_NIL(*value)){
+        fill_cache(vm, cache, (Obj*)klass, -1, *value, NULL);
+        return PROPERTY_METHOD;
+    }
+    return PROPERTY_NONE;
+}
+
+//value must stay reachable, adding a field can allocate
+static void set_property(RotoVM* vm, InlineCache* cache, ObjInstance* instance,
+                         ObjString* name, Value value){
+    ObjShape* shape = instance->shape;
+    if (cache != NULL){
+        for (int i = 0; i < CACHE_WAYS; i++){
+            CacheWay* way = &cache->ways[i];
+            if (way->key != (Obj*)shape) continue;
+            if (way->transition == NULL){
+                instance->fields[way->field] = value;
+                write_barrier(vm, (Obj*)instance, value);
+                return;
+            }
+            if (way->field < instance->field_capacity){
+                instance->fields[way->field] = value;
+                instance->shape = (ObjShape*)way->transition;
+                write_barrier(vm, (Obj*)instance, value);
+                shade_object(vm, way->transition);
+                return;
+            }
+        }
+    }
+
+    int slot = shape_slot(shape, name);
+    if (slot != -1){
+        instance->fields[slot] = value;
+        write_barrier(vm, (Obj*)instance, value);
+        fill_cache(vm, cache, (Obj*)shape, slot, NIL_VAL, NULL);
+        return;
+    }
+    slot = instance_add_field(vm, instance, name, value);
+    if (!shape->dictionary && !instance->shape->dictionary){
+        fill_cache(vm, cache, (Obj*)shape, slot, NIL_VAL, (Obj*)instance->shape);
+    }
+}
+
+static bool invoke(RotoVM* vm, int symbol, int arg_count, InlineCache* cache){
     Value receiver = peek(vm,arg_count);
+    ObjString* name = METHOD_NAME(vm, symbol);
 //    if(!IS_INSTANCE(receiver)){
 //        runtime_error("Only instances have methods.");
 //        return false;
@@ -232,23 +534,31 @@ static bool invoke(RotoVM* vm, ObjString* name, int arg_count){
 //            vm.stack_top[-arg_count - 1] = value;
             return call_native_methods(vm,value,arg_count);
         }
+        runtime_error(vm, "Undefined property '%s'.", name->chars);
+        return false;
     } else if(IS_INSTANCE(receiver)){
         ObjInstance* instance = AS_INSTANCE(receiver);
         Value value;
-        if(table_get(&instance->fields, name, &value)){
-            vm->stack_top[-arg_count - 1] = value;
-            return call_value(vm,value,arg_count);
+        switch (find_property(vm, cache, instance, name, symbol, &value)){
+            case PROPERTY_FIELD:
+                vm->stack_top[-arg_count - 1] = value;
+                return call_value(vm,value,arg_count);
+            case PROPERTY_METHOD:
+                return call(vm, AS_CLOSURE(value), arg_count);
+            case PROPERTY_NONE:
+                break;
         }
-            return invoke_from_class(vm, instance->klass, name, arg_count);
+        runtime_error(vm, "Undefined property '%s'.", name->chars);
+        return false;
     } else{
         runtime_error(vm,"Only instances and lists have methods.");
         return false;
     }
 }
-static bool bind_method(RotoVM* vm, ObjClass* klass, ObjString* name){
-    Value method;
-    if(!table_get(&klass->methods,name,&method)){
-        runtime_error(vm,"Undefined property '%s'.",name->chars);
+static bool bind_method(RotoVM* vm, ObjClass* klass, int symbol){
+    Value method = class_method(klass, symbol);
+    if(IS_NIL(method)){
+        runtime_error(vm,"Undefined property '%s'.",METHOD_NAME(vm, symbol)->chars);
         return false;
     }
     ObjBoundMethod* bound = newBoundMethod(vm,peek(vm,0),AS_CLOSURE(method));
@@ -281,14 +591,20 @@ static void close_upvalues(RotoVM* vm, Value* last){
         ObjUpvalue* upvalue = vm->open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        write_barrier(vm, (Obj*)upvalue, upvalue->closed);
         vm->open_upvalues = upvalue->next;
     }
 }
 
-static void define_method(RotoVM* vm, ObjString* name){
+static void define_method(RotoVM* vm, int symbol){
     Value method = peek(vm,0);
     ObjClass* klass = AS_CLASS(peek(vm,1));
-    table_set(vm,&klass->methods,name,method);
+    while(klass->methods.count <= symbol){
+        write_val_array(vm,&klass->methods, NIL_VAL);
+    }
+    klass->methods.values[symbol] = method;
+    if(symbol == vm->init_symbol) klass->initializer = method;
+    write_barrier(vm, (Obj*)klass, method);
     pop(vm);
 }
 
@@ -297,57 +613,291 @@ static bool is_falsey(Value value){
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate(RotoVM* vm){
-  ObjString* b = AS_STRING(peek(vm,0));
-  ObjString* a = AS_STRING(peek(vm,1));
+//number operations. two integers give an integer while the result fits and
+//prints the same as the double would, anything else goes through doubles
+static inline bool are_numbers(Value a, Value b){
+    return LIKELY(IS_INTS(a, b)) || (IS_NUMBER(a) && IS_NUMBER(b));
+}
+static inline Value add_numbers(Value a, Value b){
+    if(LIKELY(IS_INTS(a, b))) return int_value(AS_INT(a) + AS_INT(b));
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+static inline Value sub_numbers(Value a, Value b){
+    if(LIKELY(IS_INTS(a, b))) return int_value(AS_INT(a) - AS_INT(b));
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+static inline Value mul_numbers(Value a, Value b){
+    //operands that fit in 32 bits cannot overflow the int64_t product. a zero
+    //product goes through doubles so it keeps the sign the double one has
+    if(LIKELY(IS_INTS(a, b))){
+        int64_t x = AS_INT(a), y = AS_INT(b);
+        if(LIKELY(x == (int32_t)x && y == (int32_t)y && x != 0 && y != 0)){
+            return int_value(x * y);
+        }
+    }
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+static inline Value div_numbers(Value a, Value b){
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+static inline Value negate_number(Value a){
+    if(IS_INT(a) && AS_INT(a) != 0) return int_value(-AS_INT(a));
+    return NUMBER_VAL(-AS_NUMBER(a));
+}
+static inline Value less_numbers(Value a, Value b){
+    if(LIKELY(IS_INTS(a, b))) return BOOL_VAL(AS_INT(a) < AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+}
+static inline Value greater_numbers(Value a, Value b){
+    if(LIKELY(IS_INTS(a, b))) return BOOL_VAL(AS_INT(a) > AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+}
+static inline Value equal_numbers(Value a, Value b){
+    if(LIKELY(IS_INTS(a, b))) return BOOL_VAL(AS_INT(a) == AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+}
 
+//bitwise operands are truncated to 64 bit integers, nan and out of range to 0
+static inline int64_t number_bits(Value value){
+    if(LIKELY(IS_INT(value))) return AS_INT(value);
+    double num = AS_NUMBER(value);
+    if(!(num >= -9223372036854775808.0 && num < 9223372036854775808.0)) return 0;
+    return (int64_t)num;
+}
+static inline Value and_numbers(Value a, Value b){
+    return int_value(number_bits(a) & number_bits(b));
+}
+static inline Value or_numbers(Value a, Value b){
+    return int_value(number_bits(a) | number_bits(b));
+}
+static inline Value xor_numbers(Value a, Value b){
+    return int_value(number_bits(a) ^ number_bits(b));
+}
+static inline Value shift_left_numbers(Value a, Value b){
+    return int_value((int64_t)((uint64_t)number_bits(a) << (number_bits(b) & 63)));
+}
+static inline Value shift_right_numbers(Value a, Value b){
+    return int_value(number_bits(a) >> (number_bits(b) & 63));
+}
+
+//a and b must stay reachable by the GC until this returns
+static ObjString* concatenate_strings(RotoVM* vm, ObjString* a, ObjString* b){
   int length = a->length + b->length;
   char* chars = ALLOCATE(vm,char, length + 1);
   memcpy(chars, a->chars, a->length);
   memcpy(chars + a->length, b->chars, b->length);
   chars[length] = '\0';
 
-  ObjString* result = take_string(vm,chars, length);
+  return take_string(vm,chars, length);
+}
+static void concatenate(RotoVM* vm){
+  ObjString* b = AS_STRING(peek(vm,0));
+  ObjString* a = AS_STRING(peek(vm,1));
+
+  ObjString* result = concatenate_strings(vm, a, b);
   pop(vm);
   pop(vm);
   push(vm,OBJ_VAL(result));
 }
 static InterpretResult run(RotoVM* vm){
-    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    //hot interpreter state lives in locals so the compiler can keep it in
+    //registers. vm->stack_top and frame->ip are only written back at the
+    //sync points below: calls, anything that can allocate (and so trigger
+    //the GC, which scans vm->stack up to vm->stack_top) and runtime errors.
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* sp;
+    Value* slots;
+    Value* constants;
+    InlineCache* caches;
+
+  #define LOAD_FRAME()\
+          do{\
+            frame = &vm->frames[vm->frameCount - 1];\
+            ip = frame->ip;\
+            slots = frame->slots;\
+            constants = frame->closure->function->chunk.constants.values;\
+            caches = frame->closure->function->chunk.caches;\
+          }while(false)
+  //write the cached state back to the vm
+  #define SYNC() (frame->ip = ip, vm->stack_top = sp)
+  //pick up stack changes made by a helper that went through push()/pop()
+  #define RELOAD_SP() (sp = vm->stack_top)
+
+  //minor collections move young objects, so they only run here, where
+  //every live value is in the vm and none in a C local
+#ifdef DEBUG_STRESS_GC
+  #define MINOR_DUE() (vm->nursery_top != vm->nursery)
+#else
+  #define MINOR_DUE() (vm->nursery_top > vm->nursery_limit)
+#endif
+  #define SAFEPOINT()\
+          do{\
+            if(UNLIKELY(MINOR_DUE())){\
+              SYNC();\
+              collect_young(vm);\
+            }\
+          }while(false)
 
-  #define READ_BYTE() (*frame->ip++)
-  #define READ_CONST() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+  #define PUSH(value) (*sp++ = (value))
+  #define POP() (*--sp)
+  #define PEEK(distance) (sp[-1 - (distance)])
+
+  #define READ_BYTE() (*ip++)
+  #define READ_CONST() (constants[READ_BYTE()])
   #define READ_SHORT() \
-          (frame->ip+=2, \
-          (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+          (ip+=2, \
+          (uint16_t)((ip[-2] << 8) | ip[-1]))
 
   #define READ_STRING() AS_STRING(READ_CONST())
-  #define BINARY_OP(val_type, op,type)\
+  #define GLOBAL_NAME(slot) AS_CSTRING(vm->global_names.values[slot])
+  #define READ_CACHE() (*ip == NO_CACHE ? (ip++, NULL) : &caches[*ip++])
+  //register operand: a frame slot, or a constant when the top bit is set
+  #define RK(operand) ((operand) & 0x80 ? constants[(operand) & 0x7f] : slots[operand])
+  //leave sp where the stack code would have it
+  #define SET_TOP() (sp = slots + READ_BYTE())
+  #define RUNTIME_ERROR(...)\
+          do{\
+            SYNC();\
+            runtime_error(vm, __VA_ARGS__);\
+            return INTERPRET_RUNTIME_ERROR;\
+          }while(false)
+  #define BINARY_OP(operation)\
+          do {\
+            Value b = PEEK(0);\
+            Value a = PEEK(1);\
+            if(!are_numbers(a, b)){\
+              RUNTIME_ERROR("Operands must be numbers.");\
+            }\
+            sp--;\
+            PEEK(0) = operation(a, b);\
+          } while(false)
+
+  //quickening: patch the instruction just read into its number-only form
+  #define QUICKEN(quick) (ip[-1] = (quick))
+  //put the generic instruction back and run it
+  #define DEOPTIMIZE(generic)\
+          do {\
+            ip[-1] = (generic);\
+            ip--;\
+            DISPATCH();\
+          } while(false)
+  //quickens to the _INT form when both operands are integers
+  #define QUICKENING_OP(operation, quick, quick_int)\
           do {\
-            if(!IS_NUMBER(peek(vm,0)) || !IS_NUMBER(peek(vm,1))){\
-              runtime_error(vm,"Operands must be numbers.");\
-              return INTERPRET_RUNTIME_ERROR;\
+            Value b = PEEK(0);\
+            Value a = PEEK(1);\
+            if(!are_numbers(a, b)){\
+              RUNTIME_ERROR("Operands must be numbers.");\
             }\
-            \
-            type b = AS_NUMBER(pop(vm));\
-            type a = AS_NUMBER(pop(vm));\
-            push(vm,val_type(a op b)); \
-          } while(false);       \
-
-#define BITWISE_OP(val_type, op) \
-    do{                          \
-         if(!IS_NUMBER(peek(vm,0)) || !IS_NUMBER(peek(vm,1))){\
-              runtime_error(vm,"Operands must be numbers.");\
-              return INTERPRET_RUNTIME_ERROR;\
-         }                       \
-                                 \
-           int b = AS_NUMBER(pop(vm));               \
-           int a = AS_NUMBER(pop(vm));              \
-           push(vm,val_type(a op b));\
-    }while(false);
+            QUICKEN(IS_INTS(a, b) ? (quick_int) : (quick));\
+            sp--;\
+            PEEK(0) = operation(a, b);\
+          } while(false)
+  //at least one double operand: the other one is converted in line. two
+  //integers have their own _INT form
+  #define NUMBER_OP(val_type, op, operation, generic)\
+          do {\
+            Value b = PEEK(0);\
+            Value a = PEEK(1);\
+            if(LIKELY(IS_NUMBER(a) && IS_NUMBER(b) && !IS_INTS(a, b))){\
+              sp--;\
+              PEEK(0) = val_type(AS_NUMBER(a) op AS_NUMBER(b));\
+              DISPATCH();\
+            }\
+            if(!are_numbers(a, b)){\
+              DEOPTIMIZE(generic);\
+            }\
+            sp--;\
+            PEEK(0) = operation(a, b);\
+          } while(false)
+  #define INT_OP(operation, generic)\
+          do {\
+            Value b = PEEK(0);\
+            Value a = PEEK(1);\
+            if(!LIKELY(IS_INTS(a, b))){\
+              DEOPTIMIZE(generic);\
+            }\
+            sp--;\
+            PEEK(0) = operation(a, b);\
+          } while(false)
+
+  //pops both operands, jumps when the comparison comes out as `when`. the
+  //jump gets its own dispatch so it stays a predicted branch: a conditional
+  //move would make every following fetch wait on the operands
+  #define COMPARE_JUMP(comparison, when)\
+          do {\
+            uint16_t offset = READ_SHORT();\
+            Value b = PEEK(0);\
+            Value a = PEEK(1);\
+            if(!are_numbers(a, b)){\
+              RUNTIME_ERROR("Operands must be numbers.");\
+            }\
+            sp -= 2;\
+            if(AS_BOOL(comparison(a, b)) == (when)){\
+              ip += offset;\
+              DISPATCH();\
+            }\
+          } while(false)
 
-#ifdef COMPUTED_GOTO
+  //three address form: operands are read in place, the result goes to its slot
+  #define REGISTER_OP(operation)\
+          do {\
+            uint8_t dest = READ_BYTE();\
+            uint8_t left = READ_BYTE();\
+            uint8_t right = READ_BYTE();\
+            Value a = RK(left);\
+            Value b = RK(right);\
+            if(!are_numbers(a, b)){\
+              RUNTIME_ERROR("Operands must be numbers.");\
+            }\
+            slots[dest] = operation(a, b);\
+            SET_TOP();\
+          } while(false)
+  #define REGISTER_JUMP(comparison, when)\
+          do {\
+            uint8_t left = READ_BYTE();\
+            uint8_t right = READ_BYTE();\
+            Value a = RK(left);\
+            Value b = RK(right);\
+            SET_TOP();\
+            uint16_t offset = READ_SHORT();\
+            if(!are_numbers(a, b)){\
+              RUNTIME_ERROR("Operands must be numbers.");\
+            }\
+            if(AS_BOOL(comparison(a, b)) == (when)){\
+              ip += offset;\
+              DISPATCH();\
+            }\
+          } while(false)
+
+    uint8_t instr;
+
+#ifdef DEBUG_TRACE_EXECUTION
+    #define TRACE_INSTR()\
+        do{\
+            printf("     ");\
+            for (Value* slot = vm->stack; slot < sp; slot++) {\
+                printf("[ ");\
+                print_value(*slot);\
+                printf(" ]");\
+            }\
+            printf("\n");\
+            disassemble_instr(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));\
+        }while(false)
+#else
+    #define TRACE_INSTR() do{}while(false)
+#endif
+
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    #define COUNT_INSTR() (vm->instruction_count++)
+#else
+    #define COUNT_INSTR() do{}while(false)
+#endif
 
+#ifdef COMPUTED_GOTO
+    //one indirect jump per handler instead of a single shared switch branch,
+    //gives the branch predictor a slot per opcode
     static void *dispatchTable[] = {
         #define OPCODE(name) &&op_##name,
         #include "opcodes.h"
@@ -357,31 +907,20 @@ static InterpretResult run(RotoVM* vm){
     #define INTERPRET_LOOP DISPATCH();
     #define CASE_CODE(name) op_##name
 
-    #ifdef DEBUG_TRACE_EXECUTION
-        #define DISPATCH()\
+    #define DISPATCH()\
         do{\
-            printf("     ");\
-        for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {\
-            printf("[ ");\
-            print_value(*slot);\
-            printf(" ]");\
-        }\
-        printf("\n");\
-        disassemble_instr(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));\
-        goto *dispatchTable[instruction = READ_BYTE()];\
+            TRACE_INSTR();\
+            COUNT_INSTR();\
+            goto *dispatchTable[instr = READ_BYTE()];\
         }while(false)
-    #else
-        #define DISPATCH()\
-            do{\
-                goto *dispatchTable[instruction = READ_BYTE()];\
-            }while(false)
-    #endif
 
 #else
 
     #define INTERPRET_LOOP\
         loop:\
-            switch (instr = READ_BYTE()) 
+            TRACE_INSTR();\
+            COUNT_INSTR();\
+            switch (instr = READ_BYTE())
 
     #define DISPATCH() goto loop
 
@@ -389,224 +928,285 @@ static InterpretResult run(RotoVM* vm){
 
 #endif
 
-    uint8_t instr;
+    LOAD_FRAME();
+    sp = vm->stack_top;
+
     INTERPRET_LOOP {
       CASE_CODE(CONSTANT):{
-        Value constant = READ_CONST();
-        push(vm,constant);
+        PUSH(READ_CONST());
         DISPATCH();
       }
 
-      CASE_CODE(NIL): push(vm,NIL_VAL); DISPATCH();
-      CASE_CODE(TRUE): push(vm,BOOL_VAL(true)); DISPATCH();
-      CASE_CODE(FALSE): push(vm,BOOL_VAL(false)); DISPATCH();
-      CASE_CODE(POP): pop(vm); DISPATCH();
+      CASE_CODE(NIL): PUSH(NIL_VAL); DISPATCH();
+      CASE_CODE(TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+      CASE_CODE(FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+      CASE_CODE(POP): sp--; DISPATCH();
       CASE_CODE(GET_LOCAL):{
         uint8_t slot = READ_BYTE();
-        push(vm,frame->slots[slot]);
+        PUSH(slots[slot]);
         DISPATCH();
       }
       CASE_CODE(SET_LOCAL):{
         uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(vm,0);
+        slots[slot] = PEEK(0);
+        DISPATCH();
       }
       CASE_CODE(GET_GLOBAL):{//assuming load gl_var to stack
-        ObjString* name = READ_STRING();
-        Value value;
-        if(!table_get(&vm->globals, name, &value)){
-          runtime_error(vm,"Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        uint16_t slot = READ_SHORT();
+        Value value = vm->global_values.values[slot];
+        if(IS_UNDEFINED(value)){
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
         }
-        push(vm,value);
+        PUSH(value);
         DISPATCH();
       }
       CASE_CODE(DEFINE_GLOBAL): {
-        ObjString* name = READ_STRING();
-        table_set(vm,&vm->globals, name, peek(vm,0));
-        pop(vm);
+        uint16_t slot = READ_SHORT();
+        vm->global_values.values[slot] = POP();
         DISPATCH();
       }
       CASE_CODE(SET_GLOBAL):{
-        ObjString* name = READ_STRING();
-        if(table_set(vm,&vm->globals, name, peek(vm,0))){
-          table_delete(&vm->globals,name);
-          runtime_error(vm,"Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        uint16_t slot = READ_SHORT();
+        Value* global = &vm->global_values.values[slot];
+        if(IS_UNDEFINED(*global)){
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
         }
+        *global = PEEK(0);
         DISPATCH();
       }
       CASE_CODE(GET_UPVALUE):{
           uint8_t slot = READ_BYTE();
-          push(vm,*frame->closure->upvalues[slot]->location);
+          PUSH(*frame->closure->upvalues[slot]->location);
           DISPATCH();
       }
       CASE_CODE(SET_UPVALUE):{
-          uint8_t slot = READ_BYTE();
-          *frame->closure->upvalues[slot]->location = peek(vm,0);
+          ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+          *upvalue->location = PEEK(0);
+          write_barrier(vm, (Obj*)upvalue, PEEK(0));
           DISPATCH();
       }
 
       CASE_CODE(GET_PROPERTY): {
-          if (!IS_INSTANCE(peek(vm,0))){
-              runtime_error(vm,"Only instances have properties.");
-              return INTERPRET_RUNTIME_ERROR;
+          if (!IS_INSTANCE(PEEK(0))){
+              RUNTIME_ERROR("Only instances have properties.");
           }
 
-          ObjInstance* instance = AS_INSTANCE(peek(vm,0));
+          ObjInstance* instance = AS_INSTANCE(PEEK(0));
           ObjString* name = READ_STRING();
+          InlineCache* cache = READ_CACHE();
 
           Value value;
-          if(table_get(&instance->fields, name, &value)){
-              pop(vm); //instance
-              push(vm,value);
-              DISPATCH();
+          switch (find_property(vm, cache, instance, name, -1, &value)){
+              case PROPERTY_FIELD:
+                  PEEK(0) = value; //replaces the instance
+                  DISPATCH();
+              case PROPERTY_METHOD:{
+                  SYNC();
+                  ObjBoundMethod* bound = newBoundMethod(vm, PEEK(0), AS_CLOSURE(value));
+                  PEEK(0) = OBJ_VAL(bound);
+                  DISPATCH();
+              }
+              case PROPERTY_NONE:
+                  break;
           }
-          if(!bind_method(vm,instance->klass, name)){
-              return INTERPRET_RUNTIME_ERROR;
-          }
-          DISPATCH();
+          RUNTIME_ERROR("Undefined property '%s'.", name->chars);
 
       }
 
       CASE_CODE(SET_PROPERTY):{
-          if(!IS_INSTANCE(peek(vm,1))){
-              runtime_error(vm,"Only instances have fields.");
-              return INTERPRET_RUNTIME_ERROR;
+          if(!IS_INSTANCE(PEEK(1))){
+              RUNTIME_ERROR("Only instances have fields.");
           }
-          ObjInstance* instance = AS_INSTANCE(peek(vm,1));
-          table_set(vm,&instance->fields, READ_STRING(), peek(vm,0));
+          ObjInstance* instance = AS_INSTANCE(PEEK(1));
+          ObjString* name = READ_STRING();
+          InlineCache* cache = READ_CACHE();
+          SYNC();
+          set_property(vm, cache, instance, name, PEEK(0));
 
-          Value value = pop(vm);
-          pop(vm);
-          push(vm,value);
+          Value value = POP();
+          PEEK(0) = value;
           DISPATCH();
       }
 
 
       CASE_CODE(GET_SUPER):{
-          ObjString* name = READ_STRING();
-          ObjClass* superclass = AS_CLASS(pop(vm));
-          if(!bind_method(vm,superclass, name)){
+          uint16_t symbol = READ_SHORT();
+          ObjClass* superclass = AS_CLASS(POP());
+          SYNC();
+          if(!bind_method(vm,superclass, symbol)){
               return INTERPRET_RUNTIME_ERROR;
           }
+          RELOAD_SP();
           DISPATCH();
       }
 
       CASE_CODE(EQUAL): {
-        Value b = pop(vm);
-        Value a = pop(vm);
-        push(vm,BOOL_VAL(vals_equal(a,b)));
+        if(IS_INTS(PEEK(1), PEEK(0))) QUICKEN(OP_EQUAL_INT);
+        else if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) QUICKEN(OP_EQUAL_NUM);
+        Value b = POP();
+        PEEK(0) = BOOL_VAL(vals_equal(PEEK(0),b));
         DISPATCH();
       }
-      CASE_CODE(GREATER): BINARY_OP(BOOL_VAL, >,double); DISPATCH();
-      CASE_CODE(LESS): BINARY_OP(BOOL_VAL, <, double); DISPATCH();
+      CASE_CODE(GREATER): QUICKENING_OP(greater_numbers, OP_GREATER_NUM, OP_GREATER_INT); DISPATCH();
+      CASE_CODE(LESS): QUICKENING_OP(less_numbers, OP_LESS_NUM, OP_LESS_INT); DISPATCH();
       CASE_CODE(ADD):{
-        if(IS_STRING(peek(vm,0)) && IS_STRING(peek(vm,1))){
+        if(IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))){
+          SYNC();
           concatenate(vm);
-        }else if(IS_NUMBER(peek(vm,0)) && IS_NUMBER(peek(vm,1))){
-          double b = AS_NUMBER(pop(vm));
-          double a = AS_NUMBER(pop(vm));
-          push(vm,NUMBER_VAL(a+b));
+          RELOAD_SP();
+        }else if(are_numbers(PEEK(1), PEEK(0))){
+          QUICKEN(IS_INTS(PEEK(1), PEEK(0)) ? OP_ADD_INT : OP_ADD_NUM);
+          Value b = POP();
+          PEEK(0) = add_numbers(PEEK(0), b);
         }else{
-          runtime_error(vm,"Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
         }
         DISPATCH();
       }
       CASE_CODE(SUB):{
-        BINARY_OP(NUMBER_VAL, -,double);
+        QUICKENING_OP(sub_numbers, OP_SUB_NUM, OP_SUB_INT);
         DISPATCH();
       }
       CASE_CODE(MUL):{
-        BINARY_OP(NUMBER_VAL, *, double);
+        QUICKENING_OP(mul_numbers, OP_MUL_NUM, OP_MUL_INT);
         DISPATCH();
       }
       CASE_CODE(DIV):{
-        BINARY_OP(NUMBER_VAL, /, double);
+        QUICKENING_OP(div_numbers, OP_DIV_NUM, OP_DIV_NUM);
         DISPATCH();
       }
       CASE_CODE(BITWISE_AND):{
-          BINARY_OP(NUMBER_VAL, &, int);
+          BINARY_OP(and_numbers);
           DISPATCH();
       }
         CASE_CODE(BITWISE_OR):{
-            BINARY_OP(NUMBER_VAL, |, int);
+            BINARY_OP(or_numbers);
             DISPATCH();
         }
         CASE_CODE(BITWISE_XOR):{
-            BINARY_OP(NUMBER_VAL, ^, int);
+            BINARY_OP(xor_numbers);
             DISPATCH();
         }
         CASE_CODE(LEFT_SHIFT):{
-            BINARY_OP(NUMBER_VAL, <<, int);
+            BINARY_OP(shift_left_numbers);
             DISPATCH();
         }
         CASE_CODE(RIGHT_SHIFT):{
-            BINARY_OP(NUMBER_VAL, >>,int);
+            BINARY_OP(shift_right_numbers);
             DISPATCH();
         }
       CASE_CODE(NOT):
-        push(vm,BOOL_VAL(is_falsey(pop(vm))));
+        PEEK(0) = BOOL_VAL(is_falsey(PEEK(0)));
         DISPATCH();
       CASE_CODE(NEGATE):{
-        if(!IS_NUMBER(peek(vm,0))){
-          runtime_error(vm,"Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+        if(!IS_NUMBER(PEEK(0))){
+          RUNTIME_ERROR("Operand must be a number.");
         }
-        push(vm,NUMBER_VAL(-AS_NUMBER(pop(vm))));
+        QUICKEN(OP_NEGATE_NUM);
+        PEEK(0) = negate_number(PEEK(0));
         DISPATCH();
       }
 
       CASE_CODE(JUMP): {
         uint16_t offset = READ_SHORT();
-        frame->ip += offset;
+        ip += offset;
         DISPATCH();
       }
 
       CASE_CODE(JUMP_IF_FALSE): {
         uint16_t offset = READ_SHORT();
-        if(is_falsey(peek(vm,0))) frame->ip += offset;
+        if(is_falsey(PEEK(0))) ip += offset;
         DISPATCH();
       }
       CASE_CODE(LOOP): {
         uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
+        ip -= offset;
+        SAFEPOINT();
         DISPATCH();
       }
         CASE_CODE(CALL): {
             int arg_count = READ_BYTE();
-            if (!call_value(vm,peek(vm,arg_count), arg_count)) {
+            SYNC();
+            if (!call_value(vm,PEEK(arg_count), arg_count)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm->frames[vm->frameCount - 1];
+            LOAD_FRAME();
+            RELOAD_SP();
             DISPATCH();
         }
 
         CASE_CODE(INVOKE): {
-            ObjString* method = READ_STRING();
+            uint16_t symbol = READ_SHORT();
+            int arg_count = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            SYNC();
+            if(!invoke(vm,symbol, arg_count, cache)){
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            RELOAD_SP();
+            DISPATCH();
+        }
+        //calls in tail position, followed by a RETURN that only runs when the
+        //callee couldn't take over the frame (natives, classes without init)
+        CASE_CODE(TAIL_CALL): {
+            int arg_count = READ_BYTE();
+            SYNC();
+            vm->tail_call = true;
+            bool called = call_value(vm,PEEK(arg_count), arg_count);
+            vm->tail_call = false;
+            if (!called) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            RELOAD_SP();
+            DISPATCH();
+        }
+        CASE_CODE(TAIL_INVOKE): {
+            uint16_t symbol = READ_SHORT();
+            int arg_count = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            SYNC();
+            vm->tail_call = true;
+            bool called = invoke(vm,symbol, arg_count, cache);
+            vm->tail_call = false;
+            if(!called){
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            RELOAD_SP();
+            DISPATCH();
+        }
+        CASE_CODE(TAIL_SUPER_INVOKE):{
+            uint16_t symbol = READ_SHORT();
             int arg_count = READ_BYTE();
-            if(!invoke(vm,method, arg_count)){
+            ObjClass* superclass = AS_CLASS(POP());
+            SYNC();
+            vm->tail_call = true;
+            bool called = invoke_from_class(vm,superclass,symbol, arg_count);
+            vm->tail_call = false;
+            if(!called) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm->frames[vm->frameCount - 1];
+            LOAD_FRAME();
+            RELOAD_SP();
             DISPATCH();
         }
         CASE_CODE(BUILD_LIST):{
-            ObjList* list = newList(vm);
             uint8_t item_count = READ_BYTE();
+            SYNC();
+            ObjList* list = newList(vm);
 
             //add items to list
-            push(vm,OBJ_VAL(list));//for gc
+            PUSH(OBJ_VAL(list));//for gc
+            vm->stack_top = sp;
             for (int i = item_count; i > 0; i--) {
-                append_to_list(vm,list, peek(vm,i));
+                append_to_list(vm,list, PEEK(i));
             }
-            pop(vm);
 
             //pop items from stack
-            while (item_count-- > 0){
-                pop(vm);
-            }
-            push(vm,OBJ_VAL(list));
+            sp -= item_count + 1;
+            PUSH(OBJ_VAL(list));
             DISPATCH();
         }
         CASE_CODE(WIDE):{
@@ -614,130 +1214,368 @@ static InterpretResult run(RotoVM* vm){
             DISPATCH();
         }
         CASE_CODE(INDEX_SUBSCR):{
-            Value index = peek(vm,0);
-            Value list = peek(vm,1);
+            Value index = PEEK(0);
+            Value list = PEEK(1);
 
-            Value result;
             if(!IS_LIST(list)){
-                runtime_error(vm,"Invalid type to index into.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Invalid type to index into.");
             }
             ObjList* list_ = AS_LIST(list);
             if(!IS_NUMBER(index)){
-                runtime_error(vm,"List index is not a number.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("List index is not a number.");
             }
             int index_ = AS_NUMBER(index);
             if(!is_valid_list_index(list_,index_)){
-                runtime_error(vm,"List index out of range.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("List index out of range.");
             }
-            result = index_from_list(list_, AS_NUMBER(index));
-            pop(vm);
-            pop(vm);
-            push(vm,result);
+            sp--;
+            PEEK(0) = index_from_list(list_, index_);
             DISPATCH();
         }
 
         CASE_CODE(STORE_SUBSCR):{
-            Value item = peek(vm,0);
-            Value index = peek(vm,1);
-            Value list = peek(vm,2);
+            Value item = PEEK(0);
+            Value index = PEEK(1);
+            Value list = PEEK(2);
 
             if (!IS_LIST(list)){
-                runtime_error(vm,"Cannot store value in a non-list.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Cannot store value in a non-list.");
             }
             ObjList* list_ = AS_LIST(list);
             if (!IS_NUMBER(index)){
-                runtime_error(vm,"List index is not a number.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("List index is not a number.");
             }
             int index_ = AS_NUMBER(index);
 
             if (!is_valid_list_index(list_, index_)){
-                runtime_error(vm,"Invalid list index.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Invalid list index.");
             }
-            store_to_list(list_,index_, item);
-            pop(vm);
-            pop(vm);
-            pop(vm);
-             push(vm,item);
-//            push(NIL_VAL);
+            store_to_list(vm, list_, index_, item);
+            sp -= 2;
+            PEEK(0) = item;
             DISPATCH();
         }
         CASE_CODE(SUPER_INVOKE):{
-            ObjString* method = READ_STRING();
+            uint16_t symbol = READ_SHORT();
             int arg_count = READ_BYTE();
-            ObjClass* superclass = AS_CLASS(pop(vm));
-            if(!invoke_from_class(vm,superclass,method, arg_count)) {
+            ObjClass* superclass = AS_CLASS(POP());
+            SYNC();
+            if(!invoke_from_class(vm,superclass,symbol, arg_count)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm->frames[vm->frameCount-1];
+            LOAD_FRAME();
+            RELOAD_SP();
             DISPATCH();
         }
 
 
         CASE_CODE(CLOSURE):{
             ObjFunction* function = AS_FUNCTION(READ_CONST());
+            SYNC();
             ObjClosure* closure = newClosure(vm,function);
-            push(vm,OBJ_VAL(closure));
+            PUSH(OBJ_VAL(closure));
+            vm->stack_top = sp;
             for (int i = 0; i < closure->upvalue_count; ++i) {
                 uint8_t is_local = READ_BYTE();
                 uint8_t index = READ_BYTE();
                 if(is_local){
-                    closure->upvalues[i] = capture_upvalue(vm,frame->slots + index);
+                    closure->upvalues[i] = capture_upvalue(vm,slots + index);
                 } else{
-                    closure->upvalues[i] =closure->upvalues[index];
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
+                write_barrier(vm, (Obj*)closure, OBJ_VAL(closure->upvalues[i]));
             }
             DISPATCH();
         }
         CASE_CODE(CLOSE_UPVALUE):
-            close_upvalues(vm,vm->stack_top - 1);
-            pop(vm);
+            close_upvalues(vm,sp - 1);
+            sp--;
             DISPATCH();
       CASE_CODE(RETURN):{
-          Value result = pop(vm);
-          close_upvalues(vm,frame->slots);
+          Value result = POP();
+          close_upvalues(vm,slots);
           vm->frameCount--;
           if(vm->frameCount == 0){
-              pop(vm);
+              vm->stack_top = sp - 1;
               return INTERPRET_OK;
           }
-          vm->stack_top = frame->slots;
-          push(vm,result);
-          frame = &vm->frames[vm->frameCount-1];
+          sp = slots;
+          PUSH(result);
+          LOAD_FRAME();
+          SAFEPOINT();
           DISPATCH();
       }
-      CASE_CODE(CLASS):
-          push(vm,OBJ_VAL(newClass(vm,READ_STRING())));
+      CASE_CODE(CLASS):{
+          ObjString* name = READ_STRING();
+          SYNC();
+          ObjClass* klass = newClass(vm,name);
+          PUSH(OBJ_VAL(klass));
           DISPATCH();
+      }
 
 
         CASE_CODE(INHERIT):{
-            Value superclass = peek(vm,1);
+            Value superclass = PEEK(1);
             if(!IS_CLASS(superclass)){
-                runtime_error(vm,"Superclass must be a class.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Superclass must be a class.");
+            }
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            SYNC();
+            ValueArray* inherited = &AS_CLASS(superclass)->methods;
+            for (int i = 0; i < inherited->count; i++) {
+                write_val_array(vm,&subclass->methods, inherited->values[i]);
+                write_barrier(vm, (Obj*)subclass, inherited->values[i]);
+            }
+            subclass->initializer = AS_CLASS(superclass)->initializer;
+            sp--;//subclass
+            DISPATCH();
+        }
+        CASE_CODE(METHOD):{
+            uint16_t symbol = READ_SHORT();
+            SYNC();
+            define_method(vm,symbol);
+            RELOAD_SP();
+            DISPATCH();
+        }
+
+        //superinstructions
+        CASE_CODE(GET_THIS_PROPERTY):{
+            Value receiver = slots[0];
+            if (!IS_INSTANCE(receiver)){
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+            ObjInstance* instance = AS_INSTANCE(receiver);
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+
+            Value value;
+            switch (find_property(vm, cache, instance, name, -1, &value)){
+                case PROPERTY_FIELD:
+                    PUSH(value);
+                    DISPATCH();
+                case PROPERTY_METHOD:{
+                    PUSH(receiver);
+                    SYNC();
+                    ObjBoundMethod* bound = newBoundMethod(vm, receiver, AS_CLOSURE(value));
+                    PEEK(0) = OBJ_VAL(bound);
+                    DISPATCH();
+                }
+                case PROPERTY_NONE:
+                    break;
+            }
+            RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+        }
+        CASE_CODE(INC_LOCAL):{
+            uint8_t slot = READ_BYTE();
+            Value step = READ_CONST();
+            Value value = slots[slot];
+            if(!are_numbers(value, step)){
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            ObjClass* subclass = AS_CLASS(peek(vm,0));
-            table_add_all(vm,&AS_CLASS(superclass)->methods,&subclass->methods);
-            pop(vm);//subclass
+            slots[slot] = add_numbers(value, step);
             DISPATCH();
         }
-        CASE_CODE(METHOD):
-            define_method(vm,READ_STRING());
+        CASE_CODE(JUMP_IF_NOT_LESS): COMPARE_JUMP(less_numbers, false); DISPATCH();
+        CASE_CODE(JUMP_IF_NOT_GREATER): COMPARE_JUMP(greater_numbers, false); DISPATCH();
+        CASE_CODE(JUMP_IF_LESS): COMPARE_JUMP(less_numbers, true); DISPATCH();
+        CASE_CODE(JUMP_IF_GREATER): COMPARE_JUMP(greater_numbers, true); DISPATCH();
+        CASE_CODE(JUMP_IF_NOT_EQUAL):{
+            uint16_t offset = READ_SHORT();
+            sp -= 2;
+            if(!vals_equal(sp[0], sp[1])) ip += offset;
             DISPATCH();
+        }
+        CASE_CODE(JUMP_IF_EQUAL):{
+            uint16_t offset = READ_SHORT();
+            sp -= 2;
+            if(vals_equal(sp[0], sp[1])) ip += offset;
+            DISPATCH();
+        }
+
+        //quickened instructions
+        CASE_CODE(ADD_NUM): NUMBER_OP(NUMBER_VAL, +, add_numbers, OP_ADD); DISPATCH();
+        CASE_CODE(SUB_NUM): NUMBER_OP(NUMBER_VAL, -, sub_numbers, OP_SUB); DISPATCH();
+        CASE_CODE(MUL_NUM): NUMBER_OP(NUMBER_VAL, *, mul_numbers, OP_MUL); DISPATCH();
+        CASE_CODE(DIV_NUM): NUMBER_OP(NUMBER_VAL, /, div_numbers, OP_DIV); DISPATCH();
+        CASE_CODE(LESS_NUM): NUMBER_OP(BOOL_VAL, <, less_numbers, OP_LESS); DISPATCH();
+        CASE_CODE(GREATER_NUM): NUMBER_OP(BOOL_VAL, >, greater_numbers, OP_GREATER); DISPATCH();
+        CASE_CODE(EQUAL_NUM): NUMBER_OP(BOOL_VAL, ==, equal_numbers, OP_EQUAL); DISPATCH();
+        CASE_CODE(NEGATE_NUM):{
+            if(!IS_NUMBER(PEEK(0))){
+                DEOPTIMIZE(OP_NEGATE);
+            }
+            PEEK(0) = negate_number(PEEK(0));
+            DISPATCH();
+        }
+        CASE_CODE(ADD_INT): INT_OP(add_numbers, OP_ADD); DISPATCH();
+        CASE_CODE(SUB_INT): INT_OP(sub_numbers, OP_SUB); DISPATCH();
+        CASE_CODE(MUL_INT): INT_OP(mul_numbers, OP_MUL); DISPATCH();
+        CASE_CODE(LESS_INT): INT_OP(less_numbers, OP_LESS); DISPATCH();
+        CASE_CODE(GREATER_INT): INT_OP(greater_numbers, OP_GREATER); DISPATCH();
+        CASE_CODE(EQUAL_INT): INT_OP(equal_numbers, OP_EQUAL); DISPATCH();
+
+        //register instructions
+        CASE_CODE(R_MOVE):{
+            uint8_t dest = READ_BYTE();
+            slots[dest] = slots[READ_BYTE()];
+            SET_TOP();
+            DISPATCH();
+        }
+        CASE_CODE(R_LOADK):{
+            uint8_t dest = READ_BYTE();
+            slots[dest] = READ_CONST();
+            SET_TOP();
+            DISPATCH();
+        }
+        CASE_CODE(R_LOADNIL): slots[READ_BYTE()] = NIL_VAL; SET_TOP(); DISPATCH();
+        CASE_CODE(R_LOADTRUE): slots[READ_BYTE()] = BOOL_VAL(true); SET_TOP(); DISPATCH();
+        CASE_CODE(R_LOADFALSE): slots[READ_BYTE()] = BOOL_VAL(false); SET_TOP(); DISPATCH();
+        CASE_CODE(R_ADD):{
+            uint8_t dest = READ_BYTE();
+            uint8_t left = READ_BYTE();
+            uint8_t right = READ_BYTE();
+            Value a = RK(left);
+            Value b = RK(right);
+            if(are_numbers(a, b)){
+                slots[dest] = add_numbers(a, b);
+            }else if(IS_STRING(a) && IS_STRING(b)){
+                //keep the allocator's pushes clear of every register in the frame
+                sp = slots + frame->closure->function->max_slots;
+                SYNC();
+                slots[dest] = OBJ_VAL(concatenate_strings(vm, AS_STRING(a), AS_STRING(b)));
+            }else{
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            SET_TOP();
+            DISPATCH();
+        }
+        CASE_CODE(R_SUB): REGISTER_OP(sub_numbers); DISPATCH();
+        CASE_CODE(R_MUL): REGISTER_OP(mul_numbers); DISPATCH();
+        CASE_CODE(R_DIV): REGISTER_OP(div_numbers); DISPATCH();
+        CASE_CODE(R_LESS): REGISTER_OP(less_numbers); DISPATCH();
+        CASE_CODE(R_GREATER): REGISTER_OP(greater_numbers); DISPATCH();
+        CASE_CODE(R_EQUAL):{
+            uint8_t dest = READ_BYTE();
+            uint8_t left = READ_BYTE();
+            uint8_t right = READ_BYTE();
+            slots[dest] = BOOL_VAL(vals_equal(RK(left), RK(right)));
+            SET_TOP();
+            DISPATCH();
+        }
+        CASE_CODE(R_NOT):{
+            uint8_t dest = READ_BYTE();
+            uint8_t operand = READ_BYTE();
+            slots[dest] = BOOL_VAL(is_falsey(RK(operand)));
+            SET_TOP();
+            DISPATCH();
+        }
+        CASE_CODE(R_NEGATE):{
+            uint8_t dest = READ_BYTE();
+            uint8_t operand = READ_BYTE();
+            Value value = RK(operand);
+            if(!IS_NUMBER(value)){
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            slots[dest] = negate_number(value);
+            SET_TOP();
+            DISPATCH();
+        }
+        CASE_CODE(R_GET_UPVALUE):{
+            uint8_t dest = READ_BYTE();
+            slots[dest] = *frame->closure->upvalues[READ_BYTE()]->location;
+            SET_TOP();
+            DISPATCH();
+        }
+        CASE_CODE(R_SET_UPVALUE):{
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            uint8_t operand = READ_BYTE();
+            Value value = RK(operand);
+            *upvalue->location = value;
+            write_barrier(vm, (Obj*)upvalue, value);
+            DISPATCH();
+        }
+        CASE_CODE(R_GET_GLOBAL):{
+            uint8_t dest = READ_BYTE();
+            uint16_t slot = READ_SHORT();
+            Value value = vm->global_values.values[slot];
+            if(IS_UNDEFINED(value)){
+                RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+            }
+            slots[dest] = value;
+            SET_TOP();
+            DISPATCH();
+        }
+        CASE_CODE(R_JUMP_IF_NOT_LESS): REGISTER_JUMP(less_numbers, false); DISPATCH();
+        CASE_CODE(R_JUMP_IF_NOT_GREATER): REGISTER_JUMP(greater_numbers, false); DISPATCH();
+        CASE_CODE(R_JUMP_IF_LESS): REGISTER_JUMP(less_numbers, true); DISPATCH();
+        CASE_CODE(R_JUMP_IF_GREATER): REGISTER_JUMP(greater_numbers, true); DISPATCH();
+        CASE_CODE(R_JUMP_IF_NOT_EQUAL):{
+            uint8_t left = READ_BYTE();
+            uint8_t right = READ_BYTE();
+            bool equal = vals_equal(RK(left), RK(right));
+            SET_TOP();
+            uint16_t offset = READ_SHORT();
+            if(!equal) ip += offset;
+            DISPATCH();
+        }
+        CASE_CODE(R_JUMP_IF_EQUAL):{
+            uint8_t left = READ_BYTE();
+            uint8_t right = READ_BYTE();
+            bool equal = vals_equal(RK(left), RK(right));
+            SET_TOP();
+            uint16_t offset = READ_SHORT();
+            if(equal) ip += offset;
+            DISPATCH();
+        }
+        CASE_CODE(R_SETTOP): SET_TOP(); DISPATCH();
+        CASE_CODE(R_RETURN):{
+            uint8_t operand = READ_BYTE();
+            Value result = RK(operand);
+            close_upvalues(vm,slots);
+            vm->frameCount--;
+            if(vm->frameCount == 0){
+                vm->stack_top = slots;
+                return INTERPRET_OK;
+            }
+            sp = slots;
+            PUSH(result);
+            LOAD_FRAME();
+            SAFEPOINT();
+            DISPATCH();
+        }
     }
 
+  #undef LOAD_FRAME
+  #undef SYNC
+  #undef RELOAD_SP
+  #undef MINOR_DUE
+  #undef SAFEPOINT
+  #undef PUSH
+  #undef POP
+  #undef PEEK
   #undef READ_BYTE
   #undef READ_SHORT
   #undef READ_CONST
   #undef READ_STRING
+  #undef READ_CACHE
+  #undef GLOBAL_NAME
+  #undef RUNTIME_ERROR
   #undef BINARY_OP
-  #undef BITWISE_OP
+  #undef QUICKEN
+  #undef DEOPTIMIZE
+  #undef QUICKENING_OP
+  #undef NUMBER_OP
+  #undef INT_OP
+  #undef COMPARE_JUMP
+  #undef RK
+  #undef SET_TOP
+  #undef REGISTER_OP
+  #undef REGISTER_JUMP
+  #undef TRACE_INSTR
+  #undef COUNT_INSTR
+  #undef INTERPRET_LOOP
+  #undef DISPATCH
+  #undef CASE_CODE
 
   return INTERPRET_RUNTIME_ERROR;
 }
@@ -745,7 +1583,11 @@ static InterpretResult run(RotoVM* vm){
 InterpretResult interpret(RotoVM* vm,const char* source){
     ObjFunction* function = compile(vm,source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpret_function(vm, function);
+}
 
+//run a script function that was compiled earlier, or loaded from bytecode
+InterpretResult interpret_function(RotoVM* vm, ObjFunction* function){
     push(vm,OBJ_VAL(function));
     ObjClosure* closure = newClosure(vm,function);
     pop(vm);
@@ -5,11 +5,32 @@
 #include "table.h"
 #include "value.h"
 #include "object.h"
+#include "pool.h"
 #include "include/roto.h"
 
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+//the stacks start small and double as calls need them, up to these limits
+#define FRAMES_INITIAL 8
+#define FRAMES_MAX 65536
+#define STACK_INITIAL 256
+#define STACK_MAX (1 << 22)
+//room above a frame's own values for natives and allocation helpers that push while they work
+#define STACK_RESERVE 4
+
+//where a major collection has got to
+typedef enum{
+    GC_IDLE,
+    GC_MARKING,//gray objects left to trace
+    GC_SWEEPING,//pool pages left to sweep
+}GcPhase;
+
+//objects marked but not traced yet
+typedef struct{
+    int count;
+    int capacity;
+    Obj** stack;
+    bool shared;//other threads mark alongside, so marks are set atomically
+}GrayStack;
 
 //single ongoing function call
 typedef struct{
@@ -19,27 +40,70 @@ typedef struct{
 } CallFrame;
 
  struct _rotoVM{
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;//height of the callframe stack
-  Value stack[STACK_MAX];//stack
+  int frame_capacity;
+  Value* stack;//stack
   Value *stack_top; //the top or beginning of the stack
+  int stack_capacity;
   Table strings; //for string interning
   ObjString* init_string;
-  Table globals; //for globals
+  Table global_slots;//global name -> index into global_values
+  ValueArray global_values;//UNDEFINED_VAL until the global is defined
+  ValueArray global_names;//name of each slot, for error messages
+  Table method_symbols;//method name -> index into every class's methods
+  ValueArray method_names;//name of each symbol
+  int init_symbol;
   Table listMethods;
   ObjUpvalue* open_upvalues;
+  struct Parser* parser;//compile in progress, its functions are gc roots
 
   uint8_t next_op_wide;
+  bool tail_call;//the next call() reuses the running frame
+  RotoBackend backend;
+  bool lazy_bodies;//compile() skims function bodies, their first call compiles them
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+  unsigned long instruction_count;
+#endif
   size_t bytes_alocated;//running total of no of bytes of managed memory
   size_t next_gc;//threshold that triggers next collection
 
-  Obj* objects;
-  int gray_count;
-  int gray_capacity;
-  Obj** gray_stack;
+  ObjectPool pool;//where old objects live
+  bool gc_paused;//no collections while a heap image is half rebuilt
+  GrayStack gray;
+  int gc_threads;//marking done in one go is split over this many threads
+  //an incremental collection does gc_slice units of work, a value traced or
+  //an object swept each, for every GC_SLICE_BYTES the script allocates.
+  //with 0, marking is done in one go and only the sweep is spread out
+  GcPhase gc_phase;
+  int gc_slice;
+  size_t gc_debt;//bytes allocated since the last slice
+  ObjList* gray_list;//too long to trace in one slice, traced down from gray_list_next
+  int gray_list_next;
+
+  //young objects are bump allocated here and moved out by the first minor
+  //collection they live through. NULL when the vm has no nursery
+  uint8_t* nursery;
+  uint8_t* nursery_top;
+  uint8_t* nursery_limit;//past this a minor collection runs at the next safepoint
+  uint8_t* nursery_end;
+  int remembered_count;
+  int remembered_capacity;
+  Obj** remembered;//old objects that may point into the nursery
+  RotoGcStats gc_stats;
 };
 
+//globals can't outgrow the 16-bit operand of the global instructions
+#define GLOBALS_MAX (UINT16_MAX + 1)
+//same for method symbols
+#define METHODS_MAX (UINT16_MAX + 1)
+
 void push(RotoVM* vm, Value value);
+int global_slot(RotoVM* vm, ObjString* name);
+#define METHOD_NAME(vm, symbol) AS_STRING((vm)->method_names.values[symbol])
+
+int method_symbol(RotoVM* vm, ObjString* name);
+int find_method_symbol(RotoVM* vm, ObjString* name);
 Value pop(RotoVM* vm);
 
 
@@ -47,6 +111,7 @@ void append_to_list(RotoVM* vm,ObjList* list, Value value);
 bool is_valid_list_index(ObjList* list, int index);
 void delete_from_list(ObjList* list, int index);
 void runtime_error(RotoVM* vm,const char *format, ...);
+InterpretResult interpret_function(RotoVM* vm, ObjFunction* function);
 
 
 